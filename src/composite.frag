@@ -0,0 +1,110 @@
+#version 330 core
+
+// Puts the instanced passes together into what draw.frag draws: their
+// light, the players on top, the grid and the tone mapping
+
+in vec2 fragCoord;
+
+out vec4 outFragColor;
+
+#define MAX_PLAYERS 20
+#define MAX_TRAILS 1000
+
+// Same as in draw.frag
+layout (std140) uniform SceneData {
+  mat4 invOrtho;
+  vec2 wMapStart;
+  vec2 wMapEnd;
+
+  float wGridScale;
+  float time;
+  float maxLazerTime;
+  int controlledPlayer;
+  int playerCount;
+  int trailCount;
+
+  // x,y coordinates; z=orient; w=scale
+  vec4 wPlayerProp[MAX_PLAYERS];
+
+  // timeStart of trails 4i to 4i+3; x,y=start; z,w=end
+  vec4 trailTimes[MAX_TRAILS / 4];
+  vec4 wTrails[MAX_TRAILS];
+} uSceneData;
+
+// Full resolution
+uniform sampler2D uLight;
+uniform sampler2D uBeam;
+uniform sampler2D uMask;
+// Low resolution, with uFarSize texels of them in use
+uniform sampler2D uFarLight;
+uniform sampler2D uFarBeam;
+uniform vec2 uFarSize;
+
+float sdSegment(vec2 p, vec2 a, vec2 b) {
+  vec2 pa = p-a, ba = b-a;
+  float h = clamp( dot(pa,ba)/dot(ba,ba), 0.0, 1.0 );
+  return length( pa - ba*h );
+}
+
+// Grid mapping, as in draw.frag
+float mapGrid(vec2 wCoord) {
+  float d = 1e10;
+
+  vec2 clamped = clamp(
+    wCoord,
+    uSceneData.wMapStart-vec2(0.5),
+    uSceneData.wMapEnd+vec2(0.5));
+
+  d = min(d, sdSegment(
+            mod(clamped, vec2(uSceneData.wGridScale, 0.0)),
+            vec2(0.0, uSceneData.wMapStart.y),
+            vec2(0.0, uSceneData.wMapEnd.y))-0.05);
+
+  d = min(d, sdSegment(
+            mod(clamped, vec2(0.0, uSceneData.wGridScale)),
+            vec2(uSceneData.wMapStart.x, 0.0),
+            vec2(uSceneData.wMapEnd.x, 0.0))-0.05);
+
+  return d;
+}
+
+vec3 calcFinalColor(vec3 color, float exposure) {
+  vec3 one = vec3(1.0);
+  vec3 expValue = exp(-color / vec3(1.0) * exposure);
+  vec3 diff = one - expValue;
+  vec3 gamma = vec3(1.0 / 2.2);
+  return pow(diff, gamma);
+}
+
+void main() {
+  vec2 wCoord = (uSceneData.invOrtho * vec4(fragCoord,0.0,1.0)).xy;
+  ivec2 pixel = ivec2(gl_FragCoord.xy);
+  // Kept off the texels past the edge, which hold nothing
+  vec2 farTexel = clamp(
+    (fragCoord * 0.5 + 0.5) * uFarSize, vec2(0.5), uFarSize - vec2(0.5));
+  vec2 farCoord = farTexel / vec2(textureSize(uFarLight, 0));
+
+  float light = texelFetch(uLight, pixel, 0).r +
+    texture(uFarLight, farCoord).r;
+  float beam = max(
+    texelFetch(uBeam, pixel, 0).r, texture(uFarBeam, farCoord).r);
+  vec2 mask = texelFetch(uMask, pixel, 0).rg;
+
+  vec3 litColor = (light + beam) * vec3(1.5, 1.3, 0.5);
+
+  if (dot(litColor,litColor) > 0.0005 && mask.x > 0.5) {
+    litColor += vec3(litColor) * 5.0;
+  }
+
+  outFragColor = vec4(litColor, 1.0);
+
+  if (mask.y > 0.5) {
+    outFragColor.rgb += vec3(0.2);
+  }
+
+  if (mapGrid(wCoord) <= 0.0001) {
+    outFragColor += vec4(0.5);
+  }
+
+  outFragColor.rgb = calcFinalColor(outFragColor.rgb, 0.06);
+}
@@ -4,13 +4,6 @@ in vec2 fragCoord;
 
 out vec4 outFragColor;
 
-struct Trail {
-  vec2 start;
-  vec2 inbetween0;
-  vec2 end;
-  float timeStart;
-};
-
 #define MAX_PLAYERS 20
 #define MAX_TRAILS 1000
 
@@ -26,12 +19,18 @@ layout (std140) uniform SceneData {
   int playerCount;
   int trailCount;
 
-  Trail trails[MAX_TRAILS];
-
   // x,y coordinates; z=orient; w=scale
   vec4 wPlayerProp[MAX_PLAYERS];
+
+  // timeStart of trails 4i to 4i+3; x,y=start; z,w=end
+  vec4 trailTimes[MAX_TRAILS / 4];
+  vec4 wTrails[MAX_TRAILS];
 } uSceneData;
 
+float trailTimeStart(int i) {
+  return uSceneData.trailTimes[i / 4][i % 4];
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                 Math stuff                                //
 ///////////////////////////////////////////////////////////////////////////////
@@ -115,18 +114,18 @@ float mapLazers(in vec2 wCoord) {
   float d = 1e10;
 
   for (int i = 0; i < uSceneData.trailCount; i++) {
-    float dt = uSceneData.time - uSceneData.trails[i].timeStart;
+    float dt = uSceneData.time - trailTimeStart(i);
     float progress = dt / uSceneData.maxLazerTime;
+    vec4 trail = uSceneData.wTrails[i];
 
     if (progress < 1.0) {
 
-      vec2 start = uSceneData.trails[i].start + progress *
-        (uSceneData.trails[i].end - uSceneData.trails[i].start);
+      vec2 start = trail.xy + progress * (trail.zw - trail.xy);
 
       d = min(d, sdSegment(
                 wCoord,
                 start,
-                uSceneData.trails[i].end));
+                trail.zw));
     }
   }
 
@@ -142,24 +141,24 @@ vec3 lightScene(in vec2 wCoord, float hiddenPlayers) {
   vec3 litColor = vec3(0.0);
 
   for (int i = 0; i < uSceneData.trailCount; i++) {
-    float dt = uSceneData.time - uSceneData.trails[i].timeStart;
+    float dt = uSceneData.time - trailTimeStart(i);
     float progress = dt / uSceneData.maxLazerTime;
+    vec4 trail = uSceneData.wTrails[i];
 
     if (progress < 1.0) {
-      vec2 start = uSceneData.trails[i].start + progress *
-        (uSceneData.trails[i].end - uSceneData.trails[i].start);
+      vec2 start = trail.xy + progress * (trail.zw - trail.xy);
 
       d = min(d, sdSegment(
                 wCoord,
                 start,
-                uSceneData.trails[i].end));
+                trail.zw));
 
-      vec2 diff = uSceneData.trails[i].end - wCoord;
+      vec2 diff = trail.zw - wCoord;
 
       litColor += FINAL_LIGHT_INTENSITY*progress*vec3(1.5, 1.3, 0.5)/dot(diff,diff);
     }
     else {
-      vec2 diff = uSceneData.trails[i].end - wCoord;
+      vec2 diff = trail.zw - wCoord;
       litColor += FINAL_LIGHT_INTENSITY*vec3(1.5, 1.3, 0.5)/dot(diff,diff);
     }
   }
@@ -0,0 +1,98 @@
+#version 330 core
+
+// What each entity adds to the pixels its quad covers. Light passes are
+// blended additively into one target, beam and player passes take the
+// maximum, into the beam target and the player mask
+
+#define MODE_LIGHT_NEAR 0
+#define MODE_LIGHT_FAR 1
+#define MODE_BEAM_NEAR 2
+#define MODE_BEAM_FAR 3
+#define MODE_PLAYERS 4
+
+uniform int uMode;
+uniform float uNearRadius;
+
+in vec2 wCoord;
+flat in vec4 entity;
+flat in int isControlled;
+
+// Lights and beams (without their color)
+layout (location = 0) out vec4 outValue;
+// x=hidden player; y=controlled player
+layout (location = 1) out vec4 outMask;
+
+float sdSegment(vec2 p, vec2 a, vec2 b) {
+  vec2 pa = p-a, ba = b-a;
+  float h = clamp( dot(pa,ba)/dot(ba,ba), 0.0, 1.0 );
+  return length( pa - ba*h );
+}
+
+float sdUnevenCapsule(vec2 p, float r1, float r2, float h) {
+  p.x = abs(p.x);
+  float b = (r1-r2)/h;
+  float a = sqrt(1.0-b*b);
+  float k = dot(p,vec2(-b,a));
+  if( k < 0.0 ) return length(p) - r1;
+  if( k > a*h ) return length(p-vec2(0.0,h)) - r2;
+  return dot(p, vec2(a,b) ) - r1;
+}
+
+mat2 rotate(float angle) {
+  mat2 r = mat2(
+    cos(angle), sin(angle),
+    -sin(angle), cos(angle));
+  return r;
+}
+
+void main() {
+  const float FINAL_LIGHT_INTENSITY = 2.0;
+  float nearSq = uNearRadius * uNearRadius;
+
+  outValue = vec4(0.0);
+  outMask = vec4(0.0);
+
+  if (uMode == MODE_LIGHT_NEAR || uMode == MODE_LIGHT_FAR) {
+    // weight/r^2 split in two: whatever is over weight/R^2 near the light,
+    // and the rest (flat inside R), which is smooth enough for low res
+    vec2 diff = entity.xy - wCoord;
+    float distSq = dot(diff, diff);
+    float light = FINAL_LIGHT_INTENSITY * entity.z;
+
+    if (uMode == MODE_LIGHT_NEAR) {
+      if (distSq >= nearSq) {
+        discard;
+      }
+      outValue.r = light / distSq - light / nearSq;
+    }
+    else {
+      outValue.r = light / max(distSq, nearSq);
+    }
+  }
+  else if (uMode == MODE_BEAM_NEAR || uMode == MODE_BEAM_FAR) {
+    // Only the closest beam counts, the maximum of the parts is exact
+    float d = sdSegment(wCoord, entity.xy, entity.zw);
+
+    if (uMode == MODE_BEAM_NEAR) {
+      if (d >= uNearRadius) {
+        discard;
+      }
+      outValue.r = 0.2 / (d*d);
+    }
+    else {
+      outValue.r = 0.2 / max(d*d, nearSq);
+    }
+  }
+  else {
+    float d = 0.8*entity.w * sdUnevenCapsule(
+      (rotate(entity.z) * (wCoord - entity.xy)) / (0.8*entity.w),
+      0.9f, 0.2f, 3.2f);
+
+    if (d > 0.001) {
+      discard;
+    }
+
+    outMask = isControlled == 1 ? vec4(0.0, 1.0, 0.0, 0.0) :
+      vec4(1.0, 0.0, 0.0, 0.0);
+  }
+}
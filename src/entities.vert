@@ -0,0 +1,131 @@
+#version 330 core
+
+// One quad per player or trail, around what of it the pass draws. The
+// fragment shader gets the world coordinates and the entity
+
+#define MODE_LIGHT_NEAR 0
+#define MODE_LIGHT_FAR 1
+#define MODE_BEAM_NEAR 2
+#define MODE_BEAM_FAR 3
+#define MODE_PLAYERS 4
+
+#define MAX_PLAYERS 20
+#define MAX_TRAILS 1000
+
+// Same as in draw.frag
+layout (std140) uniform SceneData {
+  mat4 invOrtho;
+  vec2 wMapStart;
+  vec2 wMapEnd;
+
+  float wGridScale;
+  float time;
+  float maxLazerTime;
+  int controlledPlayer;
+  int playerCount;
+  int trailCount;
+
+  // x,y coordinates; z=orient; w=scale
+  vec4 wPlayerProp[MAX_PLAYERS];
+
+  // timeStart of trails 4i to 4i+3; x,y=start; z,w=end
+  vec4 trailTimes[MAX_TRAILS / 4];
+  vec4 wTrails[MAX_TRAILS];
+} uSceneData;
+
+uniform int uMode;
+// Where near passes stop and far passes take over (world units)
+uniform float uNearRadius;
+
+out vec2 wCoord;
+// Lights: x,y=position; z=weight. Beams: x,y=start; z,w=end.
+// Players: x,y=position; z=orient; w=scale
+flat out vec4 entity;
+flat out int isControlled;
+
+const vec2 CORNERS[4] = vec2[4](
+  vec2(-1.0), vec2(-1.0, 1.0), vec2(1.0, -1.0), vec2(1.0));
+
+float trailTimeStart(int i) {
+  return uSceneData.trailTimes[i / 4][i % 4];
+}
+
+mat2 rotate(float angle) {
+  mat2 r = mat2(
+    cos(angle), sin(angle),
+    -sin(angle), cos(angle));
+  return r;
+}
+
+// Nothing gets drawn for this instance
+void skip() {
+  gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+  wCoord = vec2(0.0);
+  entity = vec4(0.0);
+  isControlled = 0;
+}
+
+void main() {
+  vec2 corner = CORNERS[gl_VertexID];
+  int i = gl_InstanceID;
+  isControlled = 0;
+
+  // Far passes cover the whole view
+  if (uMode == MODE_LIGHT_FAR || uMode == MODE_BEAM_FAR) {
+    gl_Position = vec4(corner, 0.0, 1.0);
+    wCoord = (uSceneData.invOrtho * vec4(corner, 0.0, 1.0)).xy;
+  }
+
+  float progress = (uSceneData.time - trailTimeStart(i)) /
+    uSceneData.maxLazerTime;
+  vec4 trail = uSceneData.wTrails[i];
+
+  if (uMode == MODE_LIGHT_NEAR || uMode == MODE_LIGHT_FAR) {
+    entity = vec4(trail.zw, progress < 1.0 ? progress : 1.0, 0.0);
+    wCoord = uMode == MODE_LIGHT_NEAR ?
+      trail.zw + corner * uNearRadius : wCoord;
+  }
+  else if (uMode == MODE_BEAM_NEAR || uMode == MODE_BEAM_FAR) {
+    if (progress >= 1.0) {
+      skip();
+      return;
+    }
+
+    vec2 start = trail.xy + progress * (trail.zw - trail.xy);
+    entity = vec4(start, trail.zw);
+
+    if (uMode == MODE_BEAM_NEAR) {
+      // Box around the segment, uNearRadius away from it
+      vec2 along = trail.zw - start;
+      float len = length(along);
+      vec2 dir = len > 0.0 ? along / len : vec2(1.0, 0.0);
+      vec2 side = vec2(-dir.y, dir.x);
+      vec2 mid = (start + trail.zw) * 0.5;
+
+      wCoord = mid + dir * corner.x * (len * 0.5 + uNearRadius) +
+        side * corner.y * uNearRadius;
+    }
+  }
+  else {
+    // Like draw.frag: the players in use, and the controlled one even
+    // past them
+    vec4 prop = uSceneData.wPlayerProp[i];
+    int controlled = uSceneData.controlledPlayer;
+    if (prop.w <= 0.0 || (i >= uSceneData.playerCount && i != controlled)) {
+      skip();
+      return;
+    }
+
+    entity = prop;
+    isControlled = i == controlled ? 1 : 0;
+
+    // The capsule is within (-0.9,-0.9) and (0.9,3.4) in its own space
+    vec2 local = vec2(corner.x * 0.95, corner.y < 0.0 ? -0.95 : 3.45);
+    wCoord = prop.xy + transpose(rotate(prop.z)) * (local * 0.8 * prop.w);
+  }
+
+  if (uMode != MODE_LIGHT_FAR && uMode != MODE_BEAM_FAR) {
+    gl_Position = inverse(uSceneData.invOrtho) * vec4(wCoord, 0.0, 1.0);
+    gl_Position.zw = vec2(0.0, 1.0);
+  }
+}
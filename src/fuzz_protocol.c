@@ -0,0 +1,43 @@
+/* libFuzzer entry point for the wire decoders (make fuzz, needs clang).
+   The input is taken as the payload of a packet of every schema in turn:
+   whatever validateName accepts has to decode to exactly the end of the
+   packet without running out of bytes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+
+static void fillPacket(
+  PacketBuffer *packet, const uint8_t *data, size_t size) {
+  resetPacketBuffer(packet);
+  packet->size = size < PACKET_BUFFER_SIZE ? (uint32_t)size : PACKET_BUFFER_SIZE;
+  memcpy(packet->data, data, packet->size);
+}
+
+static void checkDecoded(const PacketBuffer *packet, const char *name) {
+  if (packet->failed || packet->cursor != packet->size) {
+    fprintf(stderr, "%s: validated but decoded %u of %u bytes%s\n",
+            name, packet->cursor, packet->size,
+            packet->failed ? " (ran out)" : "");
+    abort();
+  }
+}
+
+#define FUZZ_WIRE_SCHEMA(Name, FIELDS)          \
+  {                                             \
+    static Name wire;                           \
+    fillPacket(&packet, data, size);            \
+    if (validate##Name(&packet)) {              \
+      decode##Name(&packet, &wire);             \
+      checkDecoded(&packet, #Name);             \
+    }                                           \
+  }
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static PacketBuffer packet;
+
+  PROTOCOL_SCHEMAS(FUZZ_WIRE_SCHEMA)
+
+  return 0;
+}
@@ -3,17 +3,23 @@
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 
 #include "io.h"
 #include "glo.h"
 #include "net.h"
+#include "trace.h"
 #include "render.h"
+#include "metrics.h"
+#include "softrender.h"
 
 /* Initializes default game state - ready to join/create a game. */
 GloState *createGloState() {
-  GloState *state = (GloState *)malloc(sizeof(GloState));
+  /* Players are laid out by cache line */
+  size_t size = (sizeof(GloState) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+  GloState *state = (GloState *)aligned_alloc(CACHE_LINE_SIZE, size);
   memset(state, 0, sizeof(GloState));
 
   state->bulletOccupation = createBitvec(MAX_BULLET_TRAILS);
@@ -32,10 +38,6 @@ Player createPlayer(Vec2 position) {
     .health = PLAYER_BASE_HEALTH
   };
 
-  for (int i = 0; i < MAX_PLAYER_ACTIVE_TRAJECTORIES; ++i) {
-    player.activeTrajectories[i] = INVALID_TRAJECTORY;
-  }
-
   return player;
 }
 
@@ -55,8 +57,9 @@ Player *spawnPlayer(GloState *game, int idx) {
   player->speed = BASE_SPEED;
   player->health = PLAYER_BASE_HEALTH;
 
+  PlayerHistory *history = &game->playerHistories[idx];
   for (int i = 0; i < MAX_PLAYER_ACTIVE_TRAJECTORIES; ++i) {
-    player->activeTrajectories[i] = INVALID_TRAJECTORY;
+    history->activeTrajectories[i] = INVALID_TRAJECTORY;
   }
 
   game->playerCount = MAX(game->playerCount, (idx+1));
@@ -169,37 +172,46 @@ static void predictState(GloState *gameState, GameCommands commands) {
   updatePlayerState(gameState, commands, me);
 }
 
-static void interpolateState(GloState *gameState, float dt) {
+/* Remote players are placed where they were at renderTime (server clock),
+   between the two snapshots surrounding it */
+static void interpolateState(GloState *gameState, float renderTime) {
   for (int i = 0; i < gameState->playerCount; ++i) {
     Player *p = &gameState->players[i];
+    PlayerHistory *h = &gameState->playerHistories[i];
     /* We want to interpolate state for all remote players */
     if (p->flags.isInitialized && i != gameState->controlled) {
-      int b = p->snapshotStart, e = p->snapshotEnd;
+      int b = h->snapshotStart, e = h->snapshotEnd;
       uint32_t snapshotCount = (e-b+MAX_PLAYER_SNAPSHOTS) % MAX_PLAYER_SNAPSHOTS;
 
-      if (snapshotCount >= 3) {
-        /* We need to make sure that there are enough snapshots so as to
-           avoid halting */
-        p->progress += dt/SNAPSHOT_PACKET_INTERVAL;
-        if (p->progress >= 1.0f) {
-          float newProgress = p->progress - floorf(p->progress);
-          uint32_t skipCount = (uint32_t)(floorf(p->progress));
+      /* Drop the snapshots we are done interpolating from */
+      while (snapshotCount >= 2 &&
+             h->snapshots[(b+1)%MAX_PLAYER_SNAPSHOTS].serverTime <= renderTime) {
+        b = (b+1)%MAX_PLAYER_SNAPSHOTS;
+        snapshotCount--;
+      }
 
-          p->progress = newProgress;
+      if (snapshotCount >= 2) {
+        PlayerSnapshot *s0 = &h->snapshots[b];
+        PlayerSnapshot *s1 = &h->snapshots[(b+1)%MAX_PLAYER_SNAPSHOTS];
 
-          b = (b+skipCount)%MAX_PLAYER_SNAPSHOTS;
+        float progress = 0.0f;
+        if (s1->serverTime > s0->serverTime) {
+          progress = clamp(
+            (renderTime - s0->serverTime) / (s1->serverTime - s0->serverTime),
+            0.0f, 1.0f);
         }
 
-        PlayerSnapshot *s0 = &p->snapshots[b];
-        PlayerSnapshot *s1 = &p->snapshots[(b+1)%MAX_PLAYER_SNAPSHOTS];
-
-        p->position.x = lerp(s0->position.x, s1->position.x, p->progress);
-        p->position.y = lerp(s0->position.y, s1->position.y, p->progress);
-        p->orientation = lerp(s0->orientation, s1->orientation, p->progress);
-
-        p->snapshotStart = b;
-        p->snapshotEnd = e;
+        p->position.x = lerp(s0->position.x, s1->position.x, progress);
+        p->position.y = lerp(s0->position.y, s1->position.y, progress);
+        p->orientation = lerp(s0->orientation, s1->orientation, progress);
       }
+      else if (snapshotCount == 1) {
+        /* Starved - hold the last known state */
+        p->position = h->snapshots[b].position;
+        p->orientation = h->snapshots[b].orientation;
+      }
+
+      h->snapshotStart = b;
     }
   }
 }
@@ -208,37 +220,499 @@ static void interpolateState(GloState *gameState, float dt) {
 /*****************************************************************************/
 /*                             Client entry point                            */
 /*****************************************************************************/
+/* Zones the simulation thread times in a step */
+#define MAX_SIMULATION_ZONES 5
+
+typedef struct SimulationZone {
+  const char *name;
+  uint64_t start;
+  uint64_t duration;
+} SimulationZone;
+
+/* Steps the game on a thread of its own while the main thread renders
+   the view the step before published. The two only meet when a step
+   starts (its input) and when it is done (its view and zones) */
+typedef struct Simulation {
+  pthread_t thread;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t stepReady;
+  pthread_cond_t stepDone;
+
+  /* Bumped for every step, the thread waits for it to change */
+  uint32_t step;
+  bool isStepping;
+  bool isStopping;
+
+  /* Only touched by the simulation thread while a step runs */
+  Client *client;
+  GloState *game;
+  const Tracer *tracer;
+
+  GameCommands commands[MAX_SAMPLED_COMMANDS];
+  int commandCount;
+
+  SimulationZone zones[MAX_SIMULATION_ZONES];
+  int zoneCount;
+
+  /* Rendering reads views[front], a step writes the other one */
+  RenderView views[2];
+  int front;
+} Simulation;
+
+static void beginSimulationZone(Simulation *sim, const char *name) {
+  SimulationZone *zone = &sim->zones[sim->zoneCount];
+  zone->name = name;
+  zone->start = getTraceTime(sim->tracer);
+}
+
+static void endSimulationZone(Simulation *sim) {
+  SimulationZone *zone = &sim->zones[sim->zoneCount++];
+  zone->duration = getTraceTime(sim->tracer) - zone->start;
+}
+
+static void runSimulationStep(Simulation *sim) {
+  Client *client = sim->client;
+  GloState *game = sim->game;
+
+  sim->zoneCount = 0;
+
+  beginSimulationZone(sim, "tickClient");
+  tickClient(client, game);
+  endSimulationZone(sim);
+
+  /* The server corrected our position: predict what it hasn't got to */
+  beginSimulationZone(sim, "replay");
+  GameCommands replay[MAX_INPUT_COMMANDS];
+  int replayCount = getReplayCommands(client, replay);
+  for (int i = 0; i < replayCount; ++i) {
+    /* Shots were already fired */
+    replay[i].actions.shoot = 0;
+    predictState(game, replay[i]);
+  }
+  endSimulationZone(sim);
+
+  beginSimulationZone(sim, "predictState");
+  for (int i = 0; i < sim->commandCount; ++i) {
+    predictState(game, sim->commands[i]);
+    pushGameCommands(client, &sim->commands[i], &game->players[client->id]);
+  }
+  endSimulationZone(sim);
+
+  beginSimulationZone(sim, "interpolateState");
+  interpolateState(game, getInterpolationTime(client));
+  endSimulationZone(sim);
+
+  beginSimulationZone(sim, "fillRenderView");
+  fillRenderView(&sim->views[1 - sim->front], game);
+  endSimulationZone(sim);
+}
+
+static void *simulationThread(void *data) {
+  Simulation *sim = (Simulation *)data;
+  uint32_t step = 0;
+
+  pthread_mutex_lock(&sim->mutex);
+
+  while (true) {
+    while (sim->step == step && !sim->isStopping) {
+      pthread_cond_wait(&sim->stepReady, &sim->mutex);
+    }
+
+    if (sim->isStopping) {
+      break;
+    }
+
+    step = sim->step;
+    pthread_mutex_unlock(&sim->mutex);
+
+    runSimulationStep(sim);
+
+    pthread_mutex_lock(&sim->mutex);
+    sim->isStepping = false;
+    pthread_cond_signal(&sim->stepDone);
+  }
+
+  pthread_mutex_unlock(&sim->mutex);
+
+  return NULL;
+}
+
+/* Publishes the game as it is as the first view */
+static Simulation *createSimulation(
+  Client *client, GloState *game, const Tracer *tracer) {
+  Simulation *sim = (Simulation *)calloc(1, sizeof(Simulation));
+  sim->client = client;
+  sim->game = game;
+  sim->tracer = tracer;
+
+  fillRenderView(&sim->views[sim->front], game);
+
+  pthread_mutex_init(&sim->mutex, NULL);
+  pthread_cond_init(&sim->stepReady, NULL);
+  pthread_cond_init(&sim->stepDone, NULL);
+  pthread_create(&sim->thread, NULL, simulationThread, sim);
+
+  return sim;
+}
+
+/* Not while a step runs */
+static void destroySimulation(Simulation *sim) {
+  pthread_mutex_lock(&sim->mutex);
+  sim->isStopping = true;
+  pthread_cond_signal(&sim->stepReady);
+  pthread_mutex_unlock(&sim->mutex);
+
+  pthread_join(sim->thread, NULL);
+
+  pthread_mutex_destroy(&sim->mutex);
+  pthread_cond_destroy(&sim->stepReady);
+  pthread_cond_destroy(&sim->stepDone);
+  free(sim);
+}
+
+static void beginSimulationStep(
+  Simulation *sim, const GameCommands *commands, int commandCount) {
+  pthread_mutex_lock(&sim->mutex);
+  memcpy(sim->commands, commands, sizeof(GameCommands) * commandCount);
+  sim->commandCount = commandCount;
+  sim->isStepping = true;
+  sim->step++;
+  pthread_cond_signal(&sim->stepReady);
+  pthread_mutex_unlock(&sim->mutex);
+}
+
+/* Waits for the step, then its view is the one to render. The client and
+   game can be read again until the next step begins */
+static void endSimulationStep(Simulation *sim, Tracer *tracer) {
+  beginTraceZone(tracer, "waitSimulation");
+  pthread_mutex_lock(&sim->mutex);
+  while (sim->isStepping) {
+    pthread_cond_wait(&sim->stepDone, &sim->mutex);
+  }
+  pthread_mutex_unlock(&sim->mutex);
+  endTraceZone(tracer);
+
+  for (int i = 0; i < sim->zoneCount; ++i) {
+    const SimulationZone *zone = &sim->zones[i];
+    addTraceZone(
+      tracer, zone->name, zone->start, zone->duration, TT_SIMULATION);
+  }
+
+  sim->front = 1 - sim->front;
+}
+
+/* Debug overlay: how the connection is doing, as far as we and the server
+   can tell, and what the render scale is at */
+static void showNetStats(
+  DrawContext *ctx, const Client *c, const RenderData *renderData) {
+  const NetStats *stats = &c->stats;
+  char status[224];
+
+  snprintf(
+    status, sizeof(status),
+    "rtt %.1fms jitter %.1fms | loss in %.0f%% out %.0f%% | "
+    "%.1f kB/s in %.1f kB/s out | %.0f snap/s | %.1f corr/s | queue %u | "
+    "%s scale %.2f gpu %.1fms",
+    stats->rtt * 1000.0f, stats->jitter * 1000.0f,
+    stats->lossIn * 100.0f, stats->lossOut * 100.0f,
+    stats->bytesInRate / 1000.0f, stats->bytesOutRate / 1000.0f,
+    stats->snapshotRate, stats->correctionRate, stats->inputQueue,
+    getRenderModeName(renderData->mode), renderData->renderScale,
+    renderData->gpuTime);
+
+  setWindowStatus(ctx, status);
+}
+
+/* The server address (or addresses) comes first if there is one, options
+   follow as "-name value" pairs */
+static const char *parseClientOptions(
+  int argc, char *argv[], RenderScaleConfig *scaleConfig,
+  enum RenderMode *renderMode, float *connectTimeout) {
+  const char *ip = "";
+  int i = 1;
+
+  if (argc > 1 && argv[1][0] != '-') {
+    ip = argv[1];
+    i = 2;
+  }
+
+  for (; i + 1 < argc; i += 2) {
+    const char *name = argv[i], *value = argv[i+1];
+
+    if (!strcmp(name, "-target-gpu-time")) {
+      scaleConfig->targetGpuTime = atof(value);
+    }
+    else if (!strcmp(name, "-min-render-scale")) {
+      scaleConfig->minScale = atof(value);
+    }
+    else if (!strcmp(name, "-max-render-scale")) {
+      scaleConfig->maxScale = atof(value);
+    }
+    else if (!strcmp(name, "-connect-timeout")) {
+      *connectTimeout = atof(value);
+    }
+    else if (!strcmp(name, "-render-mode")) {
+      enum RenderMode mode = parseRenderMode(value);
+
+      if (mode == RM_COUNT) {
+        fprintf(stderr, "Unknown render mode: %s\n", value);
+      }
+      else {
+        *renderMode = mode;
+      }
+    }
+    else {
+      fprintf(stderr, "Unknown option: %s\n", name);
+    }
+  }
+
+  return ip;
+}
+
 int main(int argc, char *argv[]) {
+  RenderScaleConfig scaleConfig = defaultRenderScaleConfig();
+  enum RenderMode renderMode = DEFAULT_RENDER_MODE;
+  float connectTimeout = CONNECT_TIMEOUT;
+  const char *ip = parseClientOptions(
+    argc, argv, &scaleConfig, &renderMode, &connectTimeout);
+
   DrawContext *drawContext = createDrawContext();
-  RenderData *renderData = createRenderData(drawContext);
+  RenderData *renderData = createRenderData(
+    drawContext, scaleConfig, renderMode);
   GloState *gameState = createGloState();
+  Tracer *tracer = createTracer();
 
   /* May add ability to change port */
   uint16_t port = MAIN_SOCKET_PORT_CLIENT;
   Client client = createClient(port);
 
-  const char *ip = (argc>1) ? argv[1]:"";
-  waitForGameState(&client, gameState, ip);
+  /* The empty map is drawn while connecting, with the progress in the
+     window title */
+  Connector *connector = beginConnecting(&client, ip, connectTimeout);
+  enum ConnectState connectState = CS_RESOLVING;
+  char connectStatus[128] = "", lastConnectStatus[128] = "";
+  static RenderView waitingView;
+
+  fillRenderView(&waitingView, gameState);
+
+  while (connectState != CS_CONNECTED && connectState != CS_FAILED) {
+    if (isContextClosed(drawContext)) {
+      break;
+    }
+
+    beginTraceFrame(tracer);
+
+    beginTraceZone(tracer, "tickConnecting");
+    connectState = tickConnecting(connector, &client, gameState);
+    endTraceZone(tracer);
+
+    getConnectingStatus(connector, connectStatus, sizeof(connectStatus));
+    if (strcmp(connectStatus, lastConnectStatus)) {
+      setWindowStatus(drawContext, connectStatus);
+      strcpy(lastConnectStatus, connectStatus);
+    }
+
+    beginTraceZone(tracer, "render");
+    render(&waitingView, drawContext, renderData, tracer);
+    endTraceZone(tracer);
+
+    beginTraceZone(tracer, "tickDisplay");
+    tickDisplay(drawContext);
+    endTraceZone(tracer);
+
+    endTraceFrame(tracer);
+  }
+
+  endConnecting(connector);
+
+  if (connectState != CS_CONNECTED) {
+    destroyTracer(tracer);
+    destroyClient(&client);
+
+    return connectState == CS_FAILED ? 1 : 0;
+  }
+
+  setWindowStatus(drawContext, NULL);
+  startNetThread(&client);
+
+  Simulation *simulation = createSimulation(&client, gameState, tracer);
+  InputSampler sampler = createInputSampler();
+
+  /* Last refresh of the debug overlay, 0 while it is hidden */
+  float overlayTime = 0.0f;
 
   bool isRunning = true;
 
   while (isRunning) {
-    tickClient(&client, gameState);
+    beginTraceFrame(tracer);
+
+    /* Fixed rate commands: the server sees the same number of them per
+       second however fast we render. GLFW wants its input read here */
+    beginTraceZone(tracer, "sampleInput");
+    GameCommands commands[MAX_SAMPLED_COMMANDS];
+    int commandCount = sampleInput(&sampler, drawContext, commands);
+    endTraceZone(tracer);
+
+    /* The next step runs while the last one's view is drawn */
+    beginSimulationStep(simulation, commands, commandCount);
+
+    beginTraceZone(tracer, "render");
+    render(
+      &simulation->views[simulation->front], drawContext, renderData,
+      tracer);
+    endTraceZone(tracer);
+
+    /* Includes waiting for the GPU and vsync */
+    beginTraceZone(tracer, "tickDisplay");
+    tickDisplay(drawContext);
+    endTraceZone(tracer);
 
-    GameCommands commands = translateIO(drawContext);
-    pushGameCommands(&client, &commands);
-    predictState(gameState, commands);
-    interpolateState(gameState, drawContext->dt);
+    endSimulationStep(simulation, tracer);
 
-    render(gameState, drawContext, renderData);
-    tickDisplay(drawContext);
+    endTraceFrame(tracer);
+
+    if (drawContext->wantsTrace) {
+      drawContext->wantsTrace = false;
+      writeChromeTrace(tracer, TRACE_FILE);
+      printFrameHistogram(tracer);
+    }
+
+    if (drawContext->wantsRenderModeSwitch) {
+      drawContext->wantsRenderModeSwitch = false;
+      renderData->mode = (renderData->mode + 1) % RM_COUNT;
+      printf("Render mode: %s\n", getRenderModeName(renderData->mode));
+    }
+
+    float currentTime = getTime();
+    if (drawContext->showDebugOverlay) {
+      if (currentTime - overlayTime >= DEBUG_OVERLAY_INTERVAL) {
+        showNetStats(drawContext, &client, renderData);
+        overlayTime = currentTime;
+      }
+    }
+    else if (overlayTime > 0.0f) {
+      setWindowStatus(drawContext, NULL);
+      overlayTime = 0.0f;
+    }
 
     isRunning = !isContextClosed(drawContext);
   }
 
+  destroySimulation(simulation);
+
   /* Send disconnect packet to the server */
   disconnectFromServer(&client);
 
+  /* For captures without a keyboard (CI): GLO_TRACE=path */
+  const char *tracePath = getenv("GLO_TRACE");
+  if (tracePath) {
+    writeChromeTrace(tracer, tracePath);
+    printFrameHistogram(tracer);
+  }
+
+  destroyTracer(tracer);
+
+  return 0;
+}
+#elif defined(BUILD_SOFTRENDER)
+/*****************************************************************************/
+/*                       Software renderer entry point                       */
+/*****************************************************************************/
+/* Time the test scene is rendered at */
+#define TEST_SCENE_TIME 10.0f
+
+/* Players all over the map and shots between them, some of them still
+   flying. Always the same one */
+static void createTestScene(GloState *game, int playerCount, int trailCount) {
+  srand(1);
+
+  for (int i = 0; i < playerCount; ++i) {
+    spawnPlayer(game, i);
+  }
+
+  for (int i = 0; i < trailCount; ++i) {
+    int shooter = i % playerCount;
+    Vec2 start = game->players[shooter].position;
+    Vec2 end = vec2_add(
+      start, vec2_mul(vec2_orient(randomf(0.0f, 6.3f)), randomf(5.0f, 20.0f)));
+    float timeStart = TEST_SCENE_TIME - randomf(0.0f, 2.0f * MAX_LAZER_TIME);
+
+    createBulletTrail(game, start, end, timeStart, shooter);
+  }
+}
+
+/* Renders the test scene to a file, then again and again to measure how
+   fast the renderer goes. Options are "-name value" pairs */
+int main(int argc, char *argv[]) {
+  initializeGLFW();
+
+  int width = 1280, height = 720;
+  int threadCount = 0, frameCount = 100;
+  int playerCount = MAX_PLAYER_COUNT, trailCount = 16;
+  const char *path = "render.png";
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const char *name = argv[i], *value = argv[i+1];
+
+    if (!strcmp(name, "-width")) width = atoi(value);
+    else if (!strcmp(name, "-height")) height = atoi(value);
+    else if (!strcmp(name, "-threads")) threadCount = atoi(value);
+    else if (!strcmp(name, "-frames")) frameCount = atoi(value);
+    else if (!strcmp(name, "-players")) playerCount = atoi(value);
+    else if (!strcmp(name, "-trails")) trailCount = atoi(value);
+    else if (!strcmp(name, "-out")) path = value;
+    else fprintf(stderr, "Unknown option: %s\n", name);
+  }
+
+  playerCount = (int)clamp(playerCount, 1, MAX_PLAYER_COUNT);
+  trailCount = (int)clamp(trailCount, 0, MAX_BULLET_TRAILS);
+
+  GloState *game = createGloState();
+  createTestScene(game, playerCount, trailCount);
+
+  /* The whole map */
+  static RenderView view;
+  static UniformData scene;
+  float aspect = (float)width / (float)height;
+  fillRenderView(&view, game);
+  fillUniformData(
+    &scene, &view, vec2(0.0f, 0.0f), getMapViewWidth(&view, aspect),
+    aspect, TEST_SCENE_TIME);
+
+  SoftRenderer *renderer = createSoftRenderer(threadCount);
+  SoftImage image = createSoftImage(width, height);
+
+  softRender(renderer, &scene, &image);
+
+  size_t pathLength = strlen(path);
+  if (pathLength > 4 && !strcmp(path + pathLength - 4, ".ppm")) {
+    writePPM(&image, path);
+  }
+  else {
+    writePNG(&image, path);
+  }
+
+  /* Benchmark */
+  float start = getTime();
+  for (int i = 0; i < frameCount; ++i) {
+    softRender(renderer, &scene, &image);
+  }
+  float elapsed = getTime() - start;
+
+  if (frameCount > 0 && elapsed > 0.0f) {
+    double pixels = (double)width * height * frameCount;
+    printf(
+      "%dx%d, %d players, %d trails, %d threads, %d lanes: "
+      "%.2f ms per frame, %.1f megapixels/s\n",
+      width, height, playerCount, trailCount,
+      getSoftRendererThreads(renderer), getSoftRendererLanes(),
+      elapsed * 1000.0f / (float)frameCount, pixels / elapsed / 1e6);
+  }
+
+  freeSoftImage(&image);
+  destroySoftRenderer(renderer);
+
   return 0;
 }
 #else
@@ -247,10 +721,12 @@ int main(int argc, char *argv[]) {
 /*****************************************************************************/
 static Server server;
 
+/* Set by Ctrl+C, the loop stops and cleans up on its own thread (the
+   job pool can't be torn down from inside one of its loops) */
+static volatile sig_atomic_t isStopping = 0;
+
 static void handleCtrlC(int signum) {
-  destroyServer(&server);
-  printf("Stopped server session\n");
-  exit(signum);
+  isStopping = 1;
 }
 
 static int checkBulletHit(BulletTrajectory *bullet, GloState *game) {
@@ -269,56 +745,116 @@ static int checkBulletHit(BulletTrajectory *bullet, GloState *game) {
   return -1;
 }
 
-/* The server is the program which authoritatively updates the game state */
-static void tickGameState(Server *s, GloState *game) {
+/* Shots a client fired during a tick (popInputCommands gives it up to 2
+   commands), fired into the game once everybody moved */
+typedef struct ClientShots {
+  int count;
+  Vec2 wStart[2];
+  Vec2 wEnd[2];
+} ClientShots;
+
+typedef struct GameTick {
+  Server *server;
+  GloState *game;
+  ClientShots shots[MAX_PLAYER_COUNT];
+} GameTick;
+
+/* One tick worth of a client's input. Only touches the client and its
+   player, so clients are simulated in parallel */
+static void simulateCommand(
+  GloState *game, Client *c, const InputCommand *input, ClientShots *shots) {
+  Player *player = &game->players[c->id];
+  GameCommands commands = input->commands;
+  float dt = commands.dt;
+
+  player->orientation = commands.newOrientation;
+
+  if (commands.actions.moveUp) player->position.y += dt*player->speed;
+  if (commands.actions.moveLeft) player->position.x += -dt*player->speed;
+  if (commands.actions.moveDown) player->position.y += -dt*player->speed;
+  if (commands.actions.moveRight) player->position.x += dt*player->speed;
+
+  /* Same as the client's prediction: bounds are applied every command */
+  player->position = keepInGridBounds(game, player->position);
+
+  if (commands.actions.shoot) {
+    shots->wStart[shots->count] = player->position;
+    shots->wEnd[shots->count] = commands.wShootTarget;
+    shots->count++;
+  }
+
+  /* End of a commands packet: does the client's prediction match? */
+  if (input->hasPrediction) {
+    if (!eqf(player->position.x, input->predictedPosition.x, 0.0001f) ||
+        !eqf(player->position.y, input->predictedPosition.y, 0.0001f)) {
+      /* Prediction error - the client needs to fix this immediately */
+      c->flags.predictionError = 1;
+      c->stats.corrections++;
+    }
+    else {
+      c->flags.predictionError = 0;
+    }
+  }
+}
+
+static void simulateClient(void *data, int index) {
+  GameTick *tick = (GameTick *)data;
+  Client *c = &tick->server->clients[index];
+  ClientShots *shots = &tick->shots[index];
+
+  shots->count = 0;
+
+  if (c->id != INVALID_CLIENT_ID) {
+    InputCommand inputs[2];
+    int count = popInputCommands(c, inputs);
+
+    for (int input = 0; input < count; ++input) {
+      simulateCommand(tick->game, c, &inputs[input], shots);
+    }
+  }
+}
+
+/* Shots hit whoever is there after everybody moved. They go in client
+   order, so how the clients were spread over threads doesn't matter */
+static void fireShots(Server *s, GloState *game, const GameTick *tick) {
   for (int i = 0; i < s->clientCount; ++i) {
-    Client *c = &s->clients[i];
-
-    if (c->id != INVALID_CLIENT_ID) {
-      Player *player = &game->players[c->id];
-
-      Vec2 copy = player->position;
-
-      /* Grind through those commands! */
-      for (int command = 0; command < c->commandCount; ++command) {
-        GameCommands commands = c->commandStack[command];
-        if (commands.actions.moveUp) copy.y += commands.dt*player->speed;
-        if (commands.actions.moveLeft) copy.x += -commands.dt*player->speed;
-        if (commands.actions.moveDown) copy.y += -commands.dt*player->speed;
-        if (commands.actions.moveRight) copy.x += commands.dt*player->speed;
-
-        if (commands.actions.shoot) {
-          int bulletIdx = createBulletTrail(
-            game, player->position, commands.wShootTarget, -1.0f, c->id);
-          game->newTrails[game->newTrailsCount++] = bulletIdx;
-
-          int hitPlayer = checkBulletHit(&game->bulletTrails[bulletIdx], game);
-          if (hitPlayer != -1) {
-            Player *p = &game->players[hitPlayer];
-            p->health -= 25;
-            if (p->health <= 0) {
-              spawnPlayer(game, hitPlayer);
-            }
-          }
+    const Client *c = &s->clients[i];
+    const ClientShots *shots = &tick->shots[i];
+
+    for (int shot = 0; shot < shots->count; ++shot) {
+      int bulletIdx = createBulletTrail(
+        game, shots->wStart[shot], shots->wEnd[shot], -1.0f, c->id);
+      BulletTrajectory *trail = &game->bulletTrails[bulletIdx];
+
+      ServerEvent event = {
+        .time = trail->timeStart, .type = ET_TRAIL, .player = c->id,
+        .wStart = trail->wStart, .wEnd = trail->wEnd
+      };
+      pushServerEvent(s, event);
+
+      int hitPlayer = checkBulletHit(trail, game);
+      if (hitPlayer != -1) {
+        Player *p = &game->players[hitPlayer];
+        p->health -= 25;
+        if (p->health <= 0) {
+          spawnPlayer(game, hitPlayer);
         }
       }
-
-      /* Does the predicted state match the actual state? */
-      if (!eqf(copy.x, c->predicted.position.x, 0.0001f) ||
-          !eqf(copy.y, c->predicted.position.y, 0.0001f)) {
-        /* Prediction error - the client needs to fix this immediately */
-        c->flags.predictionError = 1;
-      }
-      else {
-        c->flags.predictionError = 0;
-        player->position = copy;
-        player->position = keepInGridBounds(game, player->position);
-        player->orientation = c->predicted.orientation;
-      }
-
-      c->commandCount = 0;
     }
   }
+}
+
+/* The server is the program which authoritatively updates the game state.
+   Runs at SIMULATION_RATE: every client gets (normally) one command per
+   tick, so movement is as smooth as it was on the client. Clients move on
+   the job pool, shots are fired afterwards on this thread */
+static void tickGameState(Server *s, GloState *game) {
+  static GameTick tick;
+  tick.server = s;
+  tick.game = game;
+
+  parallelFor(s->jobPool, s->clientCount, simulateClient, &tick);
+  fireShots(s, game, &tick);
 
   /* Predict which bullets to desintegrate */
   float currentTime = getTime();
@@ -332,6 +868,178 @@ static void tickGameState(Server *s, GloState *game) {
   }
 }
 
+/* Renders and writes thumbnails on a thread of its own, so the tick loop
+   only pays for copying the game into a view. The two only meet when a
+   thumbnail starts */
+typedef struct ThumbnailWriter {
+  pthread_t thread;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t thumbnailReady;
+
+  /* Bumped for every thumbnail, the thread waits for it to change */
+  uint32_t thumbnail;
+  bool isWriting;
+  bool isStopping;
+
+  /* Only touched by the writer thread while a thumbnail is written */
+  SoftRenderer *renderer;
+  SoftImage image;
+  const char *path;
+  RenderView view;
+  UniformData scene;
+  float time;
+} ThumbnailWriter;
+
+/* The whole map from above, nobody's camera */
+static void writeThumbnail(ThumbnailWriter *writer) {
+  SoftImage *image = &writer->image;
+  float aspect = (float)image->width / (float)image->height;
+
+  fillUniformData(
+    &writer->scene, &writer->view, vec2(0.0f, 0.0f),
+    getMapViewWidth(&writer->view, aspect), aspect, writer->time);
+  writer->scene.controlledPlayer = -1;
+
+  softRender(writer->renderer, &writer->scene, image);
+  writePNG(image, writer->path);
+}
+
+static void *thumbnailThread(void *data) {
+  ThumbnailWriter *writer = (ThumbnailWriter *)data;
+  uint32_t thumbnail = 0;
+
+  pthread_mutex_lock(&writer->mutex);
+
+  while (true) {
+    while (writer->thumbnail == thumbnail && !writer->isStopping) {
+      pthread_cond_wait(&writer->thumbnailReady, &writer->mutex);
+    }
+
+    if (writer->isStopping) {
+      break;
+    }
+
+    thumbnail = writer->thumbnail;
+    pthread_mutex_unlock(&writer->mutex);
+
+    writeThumbnail(writer);
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->isWriting = false;
+  }
+
+  pthread_mutex_unlock(&writer->mutex);
+
+  return NULL;
+}
+
+static ThumbnailWriter *createThumbnailWriter(const char *path) {
+  ThumbnailWriter *writer =
+    (ThumbnailWriter *)calloc(1, sizeof(ThumbnailWriter));
+  writer->renderer = createSoftRenderer(THUMBNAIL_THREADS);
+  writer->image = createSoftImage(THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT);
+  writer->path = path;
+
+  pthread_mutex_init(&writer->mutex, NULL);
+  pthread_cond_init(&writer->thumbnailReady, NULL);
+
+  /* Ctrl+C has to land on the tick loop's thread */
+  sigset_t signals, callerSignals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_SETMASK, &signals, &callerSignals);
+  pthread_create(&writer->thread, NULL, thumbnailThread, writer);
+  pthread_sigmask(SIG_SETMASK, &callerSignals, NULL);
+
+  return writer;
+}
+
+/* Lets a thumbnail being written finish first */
+static void destroyThumbnailWriter(ThumbnailWriter *writer) {
+  pthread_mutex_lock(&writer->mutex);
+  writer->isStopping = true;
+  pthread_cond_signal(&writer->thumbnailReady);
+  pthread_mutex_unlock(&writer->mutex);
+
+  pthread_join(writer->thread, NULL);
+
+  pthread_mutex_destroy(&writer->mutex);
+  pthread_cond_destroy(&writer->thumbnailReady);
+  freeSoftImage(&writer->image);
+  destroySoftRenderer(writer->renderer);
+  free(writer);
+}
+
+/* Hands the game as it is to the writer thread. False (and nothing
+   happens) if the last thumbnail is still being written */
+static bool beginThumbnail(
+  ThumbnailWriter *writer, const GloState *game, float time) {
+  pthread_mutex_lock(&writer->mutex);
+  bool isWriting = writer->isWriting;
+  pthread_mutex_unlock(&writer->mutex);
+
+  if (isWriting) {
+    return false;
+  }
+
+  /* The thread is waiting, so the view is ours until it is woken up */
+  fillRenderView(&writer->view, game);
+  writer->time = time;
+
+  pthread_mutex_lock(&writer->mutex);
+  writer->isWriting = true;
+  writer->thumbnail++;
+  pthread_cond_signal(&writer->thumbnailReady);
+  pthread_mutex_unlock(&writer->mutex);
+
+  return true;
+}
+
+/* Options are given as "-name value" pairs */
+static ServerConfig parseServerConfig(int argc, char *argv[]) {
+  ServerConfig config = defaultServerConfig();
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const char *name = argv[i], *value = argv[i+1];
+
+    if (!strcmp(name, "-min-snapshot-interval")) {
+      config.minSnapshotInterval = atof(value);
+    }
+    else if (!strcmp(name, "-max-snapshot-interval")) {
+      config.maxSnapshotInterval = atof(value);
+    }
+    else if (!strcmp(name, "-max-snapshot-rate")) {
+      config.maxSnapshotBytesPerSecond = (uint32_t)atoi(value);
+    }
+    else if (!strcmp(name, "-keepalive-interval")) {
+      config.keepaliveInterval = atof(value);
+    }
+    else if (!strcmp(name, "-client-timeout")) {
+      config.clientTimeout = atof(value);
+    }
+    else if (!strcmp(name, "-io-uring")) {
+      config.useIoUring = atoi(value);
+    }
+    else if (!strcmp(name, "-job-threads")) {
+      config.jobThreads = atoi(value);
+    }
+    else if (!strcmp(name, "-metrics-port")) {
+      config.metricsPort = (uint16_t)atoi(value);
+    }
+    else if (!strcmp(name, "-thumbnail-interval")) {
+      config.thumbnailInterval = atof(value);
+    }
+    else if (!strcmp(name, "-thumbnail-path")) {
+      config.thumbnailPath = value;
+    }
+    else {
+      fprintf(stderr, "Unknown option: %s\n", name);
+    }
+  }
+
+  return config;
+}
+
 /* Server entry point */
 int main(int argc, char *argv[]) {
   initializeGLFW();
@@ -339,14 +1047,76 @@ int main(int argc, char *argv[]) {
 
   signal(SIGINT, handleCtrlC);
 
-  server = createServer();
+  ServerConfig config = parseServerConfig(argc, argv);
+  server = createServer(&config);
   printf("Started server session\n");
 
-  while (true) {
+  /* Optional - the server runs the same without it */
+  MetricsEndpoint *metrics = NULL;
+  if (config.metricsPort) {
+    metrics = createMetricsEndpoint(config.metricsPort);
+  }
+
+  ThumbnailWriter *thumbnails = NULL;
+  float thumbnailTime = 0.0f;
+  if (config.thumbnailInterval > 0.0f) {
+    thumbnails = createThumbnailWriter(config.thumbnailPath);
+  }
+
+  /* Networking runs as fast as it can, the simulation at a fixed rate */
+  float lastTime = getTime();
+  float accumulator = 0.0f;
+
+  /* Time spent simulating, reported as a share of the tick budget */
+  float loadStart = lastTime;
+  float busyTime = 0.0f;
+
+  while (!isStopping) {
     tickServer(&server, gameState);
-    tickGameState(&server, gameState);
+
+    if (metrics) {
+      tickMetricsEndpoint(metrics, &server);
+    }
+
+    float currentTime = getTime();
+    accumulator += currentTime - lastTime;
+    lastTime = currentTime;
+
+    /* Don't try to catch up on more than a few ticks after a stall */
+    accumulator = MIN(accumulator, MAX_SAMPLED_COMMANDS * SIMULATION_DT);
+
+    while (accumulator >= SIMULATION_DT) {
+      tickGameState(&server, gameState);
+      accumulator -= SIMULATION_DT;
+    }
+
+    busyTime += getTime() - currentTime;
+
+    if (currentTime - loadStart >= 1.0f) {
+      server.simulationLoad = busyTime / (currentTime - loadStart);
+      loadStart = currentTime;
+      busyTime = 0.0f;
+    }
+
+    /* A slow write skips thumbnails instead of holding up ticks */
+    if (thumbnails &&
+        currentTime - thumbnailTime >= config.thumbnailInterval &&
+        beginThumbnail(thumbnails, gameState, currentTime)) {
+      thumbnailTime = currentTime;
+    }
   }
 
+  if (thumbnails) {
+    destroyThumbnailWriter(thumbnails);
+  }
+
+  if (metrics) {
+    destroyMetricsEndpoint(metrics);
+  }
+
+  destroyServer(&server);
+  printf("Stopped server session\n");
+
   return 0;
 }
 #endif
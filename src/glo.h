@@ -16,35 +16,54 @@
 #define MAX_EXPLOSION_TIME 0.15f
 #define MAX_PLAYER_SNAPSHOTS 10
 #define PLAYER_BASE_HEALTH 100
+/* Commands are produced (and simulated) at this fixed rate, whatever the
+   frame rate is */
+#define SIMULATION_RATE 60.0f
+#define SIMULATION_DT (1.0f / SIMULATION_RATE)
+/* Hot structs get laid out around this (see the static asserts) */
+#define CACHE_LINE_SIZE 64
 
 /* A player will have a radius of 1.0f meter. The grid will be of 8x8 squares */
 typedef struct PlayerSnapshot {
   /* Only two things that we need to interpolate between */
   Vec2 position;
   float orientation;
+
+  /* Server time at which the snapshot was taken */
+  float serverTime;
 } PlayerSnapshot;
 
+/* What every tick (simulation, snapshots, rendering) looks at. The rest
+   is in PlayerHistory so that loops over the players stay in a few cache
+   lines: two players per line, neither of them straddling two lines */
 typedef struct Player {
-  Vec2 position;
+  _Alignas(CACHE_LINE_SIZE / 2) Vec2 position;
   float orientation;
   float speed;
 
-  /* May not be needed */
-  char activeTrajectories[MAX_PLAYER_ACTIVE_TRAJECTORIES];
+  int health;
 
   struct {
     uint8_t isInitialized: 1;
     uint8_t justJoined: 1;
     uint8_t pad: 6;
   } flags;
+} Player;
+
+_Static_assert(sizeof(Player) == CACHE_LINE_SIZE / 2,
+               "Player has to stay half a cache line");
 
-  float progress;
+/* Per player data only touched when snapshots come in or get interpolated,
+   indexed like the players */
+typedef struct PlayerHistory {
+  /* Ring of snapshots of a remote player (client program) */
   uint32_t snapshotStart;
   uint32_t snapshotEnd;
   PlayerSnapshot snapshots[MAX_PLAYER_SNAPSHOTS];
 
-  int health;
-} Player;
+  /* May not be needed */
+  char activeTrajectories[MAX_PLAYER_ACTIVE_TRAJECTORIES];
+} PlayerHistory;
 
 typedef struct BulletTrajectory {
   Vec2 wStart;
@@ -94,13 +113,12 @@ typedef struct GloState {
   BulletTrajectory bulletTrails[MAX_BULLET_TRAILS];
   int bulletTrailCount;
 
-  /* For the server when sending state to the clients */
-  int newTrailsCount;
-  unsigned short newTrails[MAX_BULLET_TRAILS];
-
   float gridBoxSize;
   /* In grid boxes */
   float gridWidth;
+
+  /* Cold part of the players */
+  PlayerHistory playerHistories[MAX_PLAYER_COUNT];
 } GloState;
 
 GloState *createGloState();
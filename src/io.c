@@ -6,7 +6,7 @@
 
 #include "io.h"
 
-bool gSimulatePacketLoss = false;
+atomic_bool gSimulatePacketLoss = false;
 
 /* Callback prototypes */
 static void keyCallback(int,int,int,int);
@@ -49,6 +49,13 @@ DrawContext *createDrawContext() {
   ctx->dt = 0.0f;
   ctx->currentTime = glfwGetTime();
 
+  ctx->showDebugOverlay = false;
+  ctx->isOverlayKeyDown = false;
+  ctx->wantsTrace = false;
+  ctx->isTraceKeyDown = false;
+  ctx->wantsRenderModeSwitch = false;
+  ctx->isRenderModeKeyDown = false;
+
   return ctx;
 }
 
@@ -66,6 +73,25 @@ void tickDisplay(DrawContext *ctx) {
   ctx->currentTime = newTime;
 }
 
+void setWindowStatus(DrawContext *ctx, const char *status) {
+  if (status) {
+    char title[256];
+    snprintf(title, sizeof(title), "Glo | %s", status);
+    glfwSetWindowTitle(ctx->window, title);
+  }
+  else {
+    glfwSetWindowTitle(ctx->window, "Glo");
+  }
+}
+
+/* True on the frame the key goes down, not for as long as it is held */
+static bool isKeyPressed(DrawContext *ctx, int key, bool *isDown) {
+  bool wasDown = *isDown;
+  *isDown = glfwGetKey(ctx->window, key) == GLFW_PRESS;
+
+  return *isDown && !wasDown;
+}
+
 GameCommands translateIO(DrawContext *ctx) {
   GameCommands commands = {};
 
@@ -119,9 +145,66 @@ GameCommands translateIO(DrawContext *ctx) {
     gSimulatePacketLoss = false;
   }
 
+  if (isKeyPressed(ctx, GLFW_KEY_F3, &ctx->isOverlayKeyDown)) {
+    ctx->showDebugOverlay = !ctx->showDebugOverlay;
+  }
+
+  if (isKeyPressed(ctx, GLFW_KEY_F4, &ctx->isTraceKeyDown)) {
+    ctx->wantsTrace = true;
+  }
+
+  if (isKeyPressed(ctx, GLFW_KEY_F5, &ctx->isRenderModeKeyDown)) {
+    ctx->wantsRenderModeSwitch = true;
+  }
+
   return commands;
 }
 
+InputSampler createInputSampler() {
+  InputSampler sampler = {};
+  return sampler;
+}
+
+int sampleInput(
+  InputSampler *sampler, DrawContext *ctx,
+  GameCommands commands[MAX_SAMPLED_COMMANDS]) {
+  GameCommands frame = translateIO(ctx);
+  GameCommands *pending = &sampler->pending;
+
+  pending->actions.bytes |= frame.actions.bytes;
+  pending->newOrientation = frame.newOrientation;
+  if (frame.actions.shoot) {
+    pending->wShootTarget = frame.wShootTarget;
+  }
+
+  sampler->accumulator += ctx->dt;
+
+  int count = 0;
+  while (sampler->accumulator >= SIMULATION_DT &&
+         count < MAX_SAMPLED_COMMANDS) {
+    sampler->accumulator -= SIMULATION_DT;
+
+    GameCommands *command = &commands[count++];
+    *command = *pending;
+    command->dt = SIMULATION_DT;
+
+    /* Movement keeps going for the other ticks of this frame, the shot
+       only happens once */
+    pending->actions.shoot = 0;
+  }
+
+  if (count == MAX_SAMPLED_COMMANDS) {
+    sampler->accumulator = 0.0f;
+  }
+
+  if (count) {
+    /* Start collecting again - only what's held from now on counts */
+    pending->actions.bytes = 0;
+  }
+
+  return count;
+}
+
 float getTime() {
   return glfwGetTime();
 }
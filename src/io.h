@@ -2,10 +2,17 @@
 #define _IO_H_
 
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include "glo.h"
 #include "math.h"
 
+/* Most simulation ticks a single frame can produce - after a long stall the
+   rest of the time gets dropped instead of flooding the server */
+#define MAX_SAMPLED_COMMANDS 8
+/* Seconds between two refreshes of the debug overlay */
+#define DEBUG_OVERLAY_INTERVAL 0.5f
+
 struct GLFWwindow;
 
 typedef struct DrawContext {
@@ -19,17 +26,46 @@ typedef struct DrawContext {
 
   /* For rendering */
   Mat4 invOrtho;
+
+  /* Debug overlay (network numbers in the window title), F3 toggles it */
+  bool showDebugOverlay;
+  bool isOverlayKeyDown;
+
+  /* F4 asks for a trace to be written, the main loop clears it */
+  bool wantsTrace;
+  bool isTraceKeyDown;
+
+  /* F5 asks for the next render mode, the main loop clears it */
+  bool wantsRenderModeSwitch;
+  bool isRenderModeKeyDown;
 } DrawContext;
 
+/* Turns per frame input into commands at SIMULATION_RATE. Between two
+   samples, held keys are ORed together (a tap shorter than a tick still
+   counts), the latest aim wins and a shot is kept until it is sent */
+typedef struct InputSampler {
+  float accumulator;
+  GameCommands pending;
+} InputSampler;
+
 void initializeGLFW();
 /* Don't need to call initializeGLFW in client program because 
    this function does it */
 DrawContext *createDrawContext();
 bool isContextClosed(DrawContext *ctx);
 void tickDisplay(DrawContext *ctx);
+/* Shown after the window's name, NULL for just the name */
+void setWindowStatus(DrawContext *ctx, const char *status);
 GameCommands translateIO(DrawContext *ctx);
+InputSampler createInputSampler();
+/* Call once per frame. Fills commands with one entry per simulation tick
+   that elapsed (each with dt = SIMULATION_DT) and returns how many */
+int sampleInput(
+  InputSampler *sampler, DrawContext *ctx,
+  GameCommands commands[MAX_SAMPLED_COMMANDS]);
 float getTime();
 
-extern bool gSimulatePacketLoss;
+/* Read by the client's network thread */
+extern atomic_bool gSimulatePacketLoss;
 
 #endif
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "jobs.h"
+#include "math.h"
+
+/* The indices a thread has left: begin in the low 32 bits, end in the
+   high ones, so that its thread and the thieves agree with one CAS */
+typedef struct JobRange {
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t bounds;
+} JobRange;
+
+typedef struct JobWorker {
+  JobPool *pool;
+  int index;
+} JobWorker;
+
+struct JobPool {
+  int threadCount;
+  pthread_t threads[MAX_JOB_THREADS];
+  JobWorker workers[MAX_JOB_THREADS];
+
+  pthread_mutex_t mutex;
+  pthread_cond_t jobReady;
+  pthread_cond_t jobDone;
+
+  /* Bumped for every loop, workers wait for it to change */
+  uint32_t job;
+  uint32_t busyWorkers;
+  bool isStopping;
+
+  /* The loop being run */
+  JobFunction function;
+  void *data;
+
+  JobRange ranges[MAX_JOB_THREADS];
+};
+
+static uint64_t packRange(uint32_t begin, uint32_t end) {
+  return (uint64_t)end << 32 | begin;
+}
+
+/* Next index of the thread's own range, from the front */
+static bool popJob(JobRange *range, int *index) {
+  uint64_t bounds = atomic_load(&range->bounds);
+
+  while (true) {
+    uint32_t begin = (uint32_t)bounds, end = (uint32_t)(bounds >> 32);
+
+    if (begin >= end) {
+      return false;
+    }
+
+    if (atomic_compare_exchange_weak(
+          &range->bounds, &bounds, packRange(begin + 1, end))) {
+      *index = (int)begin;
+      return true;
+    }
+  }
+}
+
+/* Takes the back half of another thread's range (rounded up, so that the
+   last index can be stolen too) and makes it ours. Only called once our
+   own range is empty, which nobody else writes to then */
+static bool stealJobs(JobPool *pool, int self) {
+  for (int i = 1; i < pool->threadCount; ++i) {
+    JobRange *victim = &pool->ranges[(self + i) % pool->threadCount];
+    uint64_t bounds = atomic_load(&victim->bounds);
+
+    while (true) {
+      uint32_t begin = (uint32_t)bounds, end = (uint32_t)(bounds >> 32);
+
+      if (begin >= end) {
+        break;
+      }
+
+      uint32_t middle = end - (end - begin + 1) / 2;
+
+      if (atomic_compare_exchange_weak(
+            &victim->bounds, &bounds, packRange(begin, middle))) {
+        atomic_store(&pool->ranges[self].bounds, packRange(middle, end));
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static void runJobs(JobPool *pool, int self) {
+  int index;
+
+  do {
+    while (popJob(&pool->ranges[self], &index)) {
+      pool->function(pool->data, index);
+    }
+  } while (stealJobs(pool, self));
+}
+
+static void *jobWorker(void *data) {
+  JobWorker *worker = (JobWorker *)data;
+  JobPool *pool = worker->pool;
+  uint32_t job = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  while (true) {
+    while (pool->job == job && !pool->isStopping) {
+      pthread_cond_wait(&pool->jobReady, &pool->mutex);
+    }
+
+    if (pool->isStopping) {
+      break;
+    }
+
+    job = pool->job;
+    pthread_mutex_unlock(&pool->mutex);
+
+    runJobs(pool, worker->index);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->busyWorkers == 0) {
+      pthread_cond_signal(&pool->jobDone);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+JobPool *createJobPool(int threadCount) {
+  if (threadCount <= 0) {
+    threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  JobPool *pool = (JobPool *)aligned_alloc(CACHE_LINE_SIZE, sizeof(JobPool));
+  memset(pool, 0, sizeof(JobPool));
+  pool->threadCount = (int)clamp(threadCount, 1, MAX_JOB_THREADS);
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->jobReady, NULL);
+  pthread_cond_init(&pool->jobDone, NULL);
+
+  for (int i = 0; i < MAX_JOB_THREADS; ++i) {
+    atomic_init(&pool->ranges[i].bounds, 0);
+  }
+
+  /* Workers start with every signal blocked, so that handlers (the
+     server's Ctrl+C) run on the caller's thread */
+  sigset_t signals, callerSignals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_SETMASK, &signals, &callerSignals);
+
+  /* The caller is the first thread */
+  for (int i = 1; i < pool->threadCount; ++i) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    pthread_create(&pool->threads[i], NULL, jobWorker, &pool->workers[i]);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &callerSignals, NULL);
+
+  return pool;
+}
+
+void destroyJobPool(JobPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->isStopping = true;
+  pthread_cond_broadcast(&pool->jobReady);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 1; i < pool->threadCount; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->jobReady);
+  pthread_cond_destroy(&pool->jobDone);
+  free(pool);
+}
+
+int getJobPoolThreads(const JobPool *pool) {
+  return pool->threadCount;
+}
+
+void parallelFor(JobPool *pool, int count, JobFunction function, void *data) {
+  /* Not worth waking anyone up for */
+  if (pool->threadCount == 1 || count <= 1) {
+    for (int i = 0; i < count; ++i) {
+      function(data, i);
+    }
+
+    return;
+  }
+
+  pool->function = function;
+  pool->data = data;
+
+  for (int i = 0; i < pool->threadCount; ++i) {
+    uint32_t begin = (uint32_t)((int64_t)count * i / pool->threadCount);
+    uint32_t end = (uint32_t)((int64_t)count * (i + 1) / pool->threadCount);
+    atomic_store(&pool->ranges[i].bounds, packRange(begin, end));
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->busyWorkers = pool->threadCount - 1;
+  pool->job++;
+  pthread_cond_broadcast(&pool->jobReady);
+  pthread_mutex_unlock(&pool->mutex);
+
+  runJobs(pool, 0);
+
+  /* Every index is taken, wait for the ones still running */
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->busyWorkers) {
+    pthread_cond_wait(&pool->jobDone, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
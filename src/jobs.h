@@ -0,0 +1,30 @@
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "glo.h"
+
+#define MAX_JOB_THREADS 16
+
+/* Called once for every index of a parallelFor, on any of the threads */
+typedef void (*JobFunction)(void *data, int index);
+
+/* Threads which share the indices of a loop. Each starts on an equal
+   share of them, taken from the front, and steals half of what another
+   thread has left (from the back) once its own share is done. So a few
+   slow indices don't leave the other threads waiting */
+typedef struct JobPool JobPool;
+
+/* threadCount counts the calling thread, 0 for one per CPU */
+JobPool *createJobPool(int threadCount);
+void destroyJobPool(JobPool *pool);
+int getJobPoolThreads(const JobPool *pool);
+
+/* Calls function(data, i) for i from 0 to count - 1 and returns once they
+   are all done. The calling thread works on them too. Indices may run in
+   any order, and a function can't start a parallelFor of its own */
+void parallelFor(JobPool *pool, int count, JobFunction function, void *data);
+
+#endif
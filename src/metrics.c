@@ -0,0 +1,407 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "io.h"
+#include "metrics.h"
+
+#ifdef MSG_NOSIGNAL
+#define METRICS_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define METRICS_SEND_FLAGS 0
+#endif
+
+/* Everything gets exported with this prefix */
+#define METRICS_PREFIX "glo_"
+
+/* Per client metrics: name, type, help and value (c is the client). They
+   get labelled with the client's id and address */
+#define CLIENT_METRICS(METRIC)                                          \
+  METRIC(rtt_seconds, gauge,                                            \
+         "Smoothed round trip time.", c->stats.rtt)                     \
+  METRIC(rtt_jitter_seconds, gauge,                                     \
+         "Interarrival jitter of the commands packets (RFC 3550).",     \
+         c->stats.jitter)                                               \
+  METRIC(command_loss_ratio, gauge,                                     \
+         "Share of the commands packets lost on the way in.",           \
+         c->stats.lossIn)                                               \
+  METRIC(snapshot_loss_ratio, gauge,                                    \
+         "Smoothed share of the snapshots lost on the way out.",        \
+         c->stats.lossOut)                                              \
+  METRIC(received_packets_total, counter,                               \
+         "Packets received from the client.", c->stats.packetsIn)       \
+  METRIC(sent_packets_total, counter,                                   \
+         "Packets sent to the client.", c->stats.packetsOut)            \
+  METRIC(received_bytes_total, counter,                                 \
+         "Bytes received from the client.", c->stats.bytesIn)           \
+  METRIC(sent_bytes_total, counter,                                     \
+         "Bytes sent to the client.", c->stats.bytesOut)                \
+  METRIC(received_bytes_per_second, gauge,                              \
+         "Bytes received from the client per second.",                  \
+         c->stats.bytesInRate)                                          \
+  METRIC(sent_bytes_per_second, gauge,                                  \
+         "Bytes sent to the client per second.", c->stats.bytesOutRate) \
+  METRIC(snapshots_total, counter,                                      \
+         "Snapshots sent to the client.", c->stats.snapshots)           \
+  METRIC(snapshots_per_second, gauge,                                   \
+         "Snapshots sent to the client per second.",                    \
+         c->stats.snapshotRate)                                         \
+  METRIC(snapshot_interval_seconds, gauge,                              \
+         "Snapshot interval picked by rate control.",                   \
+         c->snapshotInterval)                                           \
+  METRIC(prediction_corrections_total, counter,                         \
+         "Client predictions which didn't match the simulation.",       \
+         c->stats.corrections)                                          \
+  METRIC(prediction_corrections_per_second, gauge,                      \
+         "Client predictions corrected per second.",                    \
+         c->stats.correctionRate)                                       \
+  METRIC(input_queue_depth, gauge,                                      \
+         "Commands waiting to be simulated.", c->inputCount)            \
+  METRIC(input_target_depth, gauge,                                     \
+         "De-jitter depth the input queue fills up to.", c->inputDepth) \
+  METRIC(input_underruns_total, counter,                                \
+         "Ticks the input queue ran dry.", c->inputUnderruns)           \
+  METRIC(input_overruns_total, counter,                                 \
+         "Commands which didn't fit in the input queue.",               \
+         c->inputOverruns)
+
+/* Server wide metrics: name, type, help and value (s is the server) */
+#define SERVER_METRICS(METRIC)                                          \
+  METRIC(clients, gauge,                                                \
+         "Connected clients.", countClients(s))                         \
+  METRIC(dropped_packets_total, counter,                                \
+         "Malformed or rate limited packets.", s->droppedPackets)       \
+  METRIC(challenges_sent_total, counter,                                \
+         "Challenges sent to connecting clients.", s->challengesSent)   \
+  METRIC(server_full_replies_total, counter,                            \
+         "Connects turned down because the server was full.",           \
+         s->fullRepliesSent)                                            \
+  METRIC(info_replies_total, counter,                                   \
+         "Server browser queries answered.", s->infoRepliesSent)        \
+  METRIC(timeouts_total, counter,                                       \
+         "Clients evicted because they went silent.", s->timeoutCount)  \
+  METRIC(simulation_load_ratio, gauge,                                  \
+         "Share of the tick budget the simulation uses.",               \
+         s->simulationLoad)
+
+typedef struct MetricsConnection {
+  /* -1 when the slot is free */
+  int sock;
+  float openTime;
+
+  /* Request so far (null terminated) */
+  uint32_t requestSize;
+  char request[METRICS_REQUEST_SIZE];
+
+  /* Once the request is in: the response and how much of it went out */
+  bool isResponding;
+  uint32_t responseSize;
+  uint32_t responseSent;
+  char response[METRICS_RESPONSE_SIZE];
+} MetricsConnection;
+
+/* Text being written into a fixed buffer. Whatever doesn't fit is cut */
+typedef struct MetricsText {
+  char *data;
+  uint32_t size;
+  uint32_t capacity;
+} MetricsText;
+
+struct MetricsEndpoint {
+  int listenSocket;
+  MetricsConnection connections[MAX_METRICS_CONNECTIONS];
+
+  /* Body of the response being rendered */
+  char body[METRICS_RESPONSE_SIZE];
+};
+
+static void setNonBlocking(int sock) {
+  int flags = fcntl(sock, F_GETFL, 0);
+  fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+MetricsEndpoint *createMetricsEndpoint(uint16_t port) {
+  int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+  if (sock < 0) {
+    fprintf(stderr, "Failed to create metrics socket: %d\n", errno);
+    return NULL;
+  }
+
+  int reuse = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  /* Local only: there is no authentication */
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, MAX_METRICS_CONNECTIONS) < 0) {
+    fprintf(
+      stderr, "Failed to listen for metrics on port %d: %d\n",
+      (int)port, errno);
+    close(sock);
+    return NULL;
+  }
+
+  setNonBlocking(sock);
+
+  MetricsEndpoint *endpoint =
+    (MetricsEndpoint *)malloc(sizeof(MetricsEndpoint));
+  endpoint->listenSocket = sock;
+
+  for (int i = 0; i < MAX_METRICS_CONNECTIONS; ++i) {
+    endpoint->connections[i].sock = -1;
+  }
+
+  printf("Serving metrics on 127.0.0.1:%d\n", (int)port);
+
+  return endpoint;
+}
+
+static void closeConnection(MetricsConnection *connection) {
+  close(connection->sock);
+  connection->sock = -1;
+}
+
+void destroyMetricsEndpoint(MetricsEndpoint *endpoint) {
+  for (int i = 0; i < MAX_METRICS_CONNECTIONS; ++i) {
+    if (endpoint->connections[i].sock != -1) {
+      closeConnection(&endpoint->connections[i]);
+    }
+  }
+
+  close(endpoint->listenSocket);
+  free(endpoint);
+}
+
+/*****************************************************************************/
+/*                                 Rendering                                 */
+/*****************************************************************************/
+static void appendText(MetricsText *text, const char *format, ...) {
+  uint32_t left = text->capacity - text->size;
+
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(text->data + text->size, left, format, args);
+  va_end(args);
+
+  if (written > 0) {
+    text->size += MIN((uint32_t)written, left - 1);
+  }
+}
+
+static uint32_t countClients(const Server *s) {
+  uint32_t count = 0;
+
+  for (int i = 0; i < s->clientCount; ++i) {
+    count += s->clients[i].id != INVALID_CLIENT_ID;
+  }
+
+  return count;
+}
+
+static void appendMetricHeader(
+  MetricsText *text, const char *name, const char *type, const char *help) {
+  appendText(text, "# HELP " METRICS_PREFIX "%s %s\n", name, help);
+  appendText(text, "# TYPE " METRICS_PREFIX "%s %s\n", name, type);
+}
+
+#define RENDER_SERVER_METRIC(name, type, help, value)                   \
+  appendMetricHeader(text, #name, #type, help);                         \
+  appendText(text, METRICS_PREFIX #name " %.15g\n", (double)(value));
+
+#define RENDER_CLIENT_METRIC(name, type, help, value)                   \
+  appendMetricHeader(text, #name, #type, help);                         \
+  for (int i = 0; i < s->clientCount; ++i) {                            \
+    const Client *c = &s->clients[i];                                   \
+    if (c->id != INVALID_CLIENT_ID) {                                   \
+      appendText(                                                       \
+        text, METRICS_PREFIX #name "{%s} %.15g\n",                      \
+        labels[i], (double)(value));                                    \
+    }                                                                   \
+  }
+
+static void renderMetrics(MetricsText *text, const Server *s) {
+  SERVER_METRICS(RENDER_SERVER_METRIC)
+
+  /* client="id",address="ip:port" */
+  char labels[MAX_PLAYER_COUNT][64];
+  for (int i = 0; i < s->clientCount; ++i) {
+    const Client *c = &s->clients[i];
+    struct in_addr address = {.s_addr = c->clientAddr};
+    char ip[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &address, ip, sizeof(ip));
+
+    snprintf(
+      labels[i], sizeof(labels[i]), "client=\"%d\",address=\"%s:%d\"",
+      c->id, ip, (int)c->clientPort);
+  }
+
+  CLIENT_METRICS(RENDER_CLIENT_METRIC)
+}
+
+/* Answers the request in connection->request */
+static void respond(
+  MetricsEndpoint *endpoint, MetricsConnection *connection,
+  const Server *s) {
+  MetricsText response = {
+    .data = connection->response, .capacity = METRICS_RESPONSE_SIZE
+  };
+
+  bool isMetrics =
+    !strncmp(connection->request, "GET /metrics ", 13) ||
+    !strncmp(connection->request, "GET / ", 6);
+
+  if (isMetrics) {
+    MetricsText body = {
+      .data = endpoint->body, .capacity = METRICS_RESPONSE_SIZE
+    };
+    renderMetrics(&body, s);
+
+    appendText(
+      &response,
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: %u\r\n"
+      "Connection: close\r\n\r\n", body.size);
+
+    uint32_t copied = MIN(body.size, response.capacity - response.size);
+    memcpy(response.data + response.size, body.data, copied);
+    response.size += copied;
+  }
+  else {
+    appendText(
+      &response,
+      "HTTP/1.0 404 Not Found\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n");
+  }
+
+  connection->isResponding = true;
+  connection->responseSize = response.size;
+  connection->responseSent = 0;
+}
+
+/*****************************************************************************/
+/*                                Connections                                */
+/*****************************************************************************/
+static void acceptConnections(MetricsEndpoint *endpoint, float currentTime) {
+  for (int i = 0; i < MAX_METRICS_CONNECTIONS; ++i) {
+    MetricsConnection *connection = &endpoint->connections[i];
+
+    if (connection->sock != -1) {
+      continue;
+    }
+
+    int sock = accept(endpoint->listenSocket, NULL, NULL);
+
+    if (sock < 0) {
+      /* Nobody waiting */
+      return;
+    }
+
+    setNonBlocking(sock);
+
+    connection->sock = sock;
+    connection->openTime = currentTime;
+    connection->requestSize = 0;
+    connection->request[0] = 0;
+    connection->isResponding = false;
+  }
+}
+
+/* Returns false once the connection is done with */
+static bool readRequest(
+  MetricsEndpoint *endpoint, MetricsConnection *connection,
+  const Server *s) {
+  uint32_t left = METRICS_REQUEST_SIZE - 1 - connection->requestSize;
+  ssize_t received = recv(
+    connection->sock, connection->request + connection->requestSize, left, 0);
+
+  if (received == 0 ||
+      (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    return false;
+  }
+
+  if (received > 0) {
+    connection->requestSize += (uint32_t)received;
+    connection->request[connection->requestSize] = 0;
+  }
+
+  /* Only answer once the whole header is in: closing a socket with unread
+     data in it resets the connection, and the response with it */
+  bool isComplete = strstr(connection->request, "\r\n\r\n") != NULL ||
+    strstr(connection->request, "\n\n") != NULL;
+
+  if (isComplete) {
+    respond(endpoint, connection, s);
+  }
+  else if (connection->requestSize == METRICS_REQUEST_SIZE - 1) {
+    /* Not a request we want */
+    return false;
+  }
+
+  return true;
+}
+
+/* Returns false once the whole response went out */
+static bool sendResponse(MetricsConnection *connection) {
+  uint32_t left = connection->responseSize - connection->responseSent;
+  ssize_t sent = send(
+    connection->sock, connection->response + connection->responseSent, left,
+    METRICS_SEND_FLAGS);
+
+  if (sent < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+
+  connection->responseSent += (uint32_t)sent;
+
+  if (connection->responseSent == connection->responseSize) {
+    shutdown(connection->sock, SHUT_WR);
+    return false;
+  }
+
+  return true;
+}
+
+void tickMetricsEndpoint(MetricsEndpoint *endpoint, const Server *s) {
+  float currentTime = getTime();
+
+  acceptConnections(endpoint, currentTime);
+
+  for (int i = 0; i < MAX_METRICS_CONNECTIONS; ++i) {
+    MetricsConnection *connection = &endpoint->connections[i];
+
+    if (connection->sock == -1) {
+      continue;
+    }
+
+    bool isOpen = true;
+
+    if (!connection->isResponding) {
+      isOpen = readRequest(endpoint, connection, s);
+    }
+
+    /* The response goes out on the tick the request completed, as far as
+       the socket takes it */
+    if (isOpen && connection->isResponding) {
+      isOpen = sendResponse(connection);
+    }
+
+    if (!isOpen ||
+        currentTime - connection->openTime > METRICS_CONNECTION_TIMEOUT) {
+      closeConnection(connection);
+    }
+  }
+}
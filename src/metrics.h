@@ -0,0 +1,30 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+#include "net.h"
+
+/* Connections served at the same time, the others wait in the backlog */
+#define MAX_METRICS_CONNECTIONS 4
+/* Requests are read up to the end of their header, and no further */
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_RESPONSE_SIZE (64 * 1024)
+/* Seconds a connection gets to send its request and take the response */
+#define METRICS_CONNECTION_TIMEOUT 2.0f
+
+/* Plain HTTP endpoint on 127.0.0.1 which serves the server's counters and
+   every client's NetStats in the Prometheus text format (GET /metrics).
+   It is polled from the server loop and never blocks it: the sockets are
+   non-blocking and a slow scraper only holds on to its own connection */
+typedef struct MetricsEndpoint MetricsEndpoint;
+
+/* NULL if the port can't be listened on - the server runs without it */
+MetricsEndpoint *createMetricsEndpoint(uint16_t port);
+void destroyMetricsEndpoint(MetricsEndpoint *endpoint);
+
+/* Accepts, reads and answers whatever it can without waiting. Call once
+   per server tick */
+void tickMetricsEndpoint(MetricsEndpoint *endpoint, const Server *s);
+
+#endif
@@ -1,3 +1,5 @@
+#include <time.h>
+#include <math.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -5,17 +7,60 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "io.h"
 #include "net.h"
 #include "math.h"
-
-#define MSG_BUFFER_SIZE 1000
-static uint8_t msgBuffer[MSG_BUFFER_SIZE];
+#include "spsc.h"
+#include "protocol.h"
+
+/* A snapshot decoded by the network thread, with the link's clock and
+   numbers as they were once it was received */
+typedef struct ClientSnapshot {
+  SnapshotWire wire;
+  TimeSync timeSync;
+  float snapshotInterval;
+  NetStats stats;
+} ClientSnapshot;
+
+/* A command on its way to the network thread, with where the player was
+   predicted to be after it */
+typedef struct ClientCommand {
+  GameCommands commands;
+  uint32_t sequence;
+
+  Vec2 predictedPosition;
+  float predictedOrientation;
+  float predictedSpeed;
+} ClientCommand;
+
+/* The client program's socket, once connected. The thread works on its
+   own copy of the client (acks, clock, stats, command stack), the main
+   thread's copy only learns about the link through the snapshots */
+struct NetThread {
+  Client client;
+
+  pthread_t thread;
+  atomic_bool isRunning;
+  atomic_bool isConnected;
+
+  /* The main thread writes a byte to wake the thread up from poll */
+  int wakeFds[2];
+
+  /* ClientSnapshot to the main thread, ClientCommand from it */
+  SpscRing *snapshots;
+  SpscRing *commands;
+
+  /* Decoded into when the snapshot ring is full */
+  SnapshotWire dropped;
+};
 
 /*****************************************************************************/
 /*                                Socket stuff                               */
@@ -57,30 +102,38 @@ static void setSocketOptions(int sock) {
     sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(int));
 }
 
+/* Fills the packet with the next datagram, returns its size (0 if none) */
 static int32_t receivePacket(
-  int sock, char *buffer, uint32_t size, struct sockaddr_in *dst) {
+  int sock, PacketBuffer *packet, struct sockaddr_in *dst) {
   struct sockaddr_in fromAddress = {};
   socklen_t fromSize = sizeof(fromAddress);
 
+  resetPacketBuffer(packet);
+
   int32_t bytesReceived = recvfrom(
-    sock, buffer, size, 0, (struct sockaddr *)&fromAddress, &fromSize);
+    sock, packet->data, PACKET_BUFFER_SIZE, 0,
+    (struct sockaddr *)&fromAddress, &fromSize);
 
   if (bytesReceived < 0) {
     return 0;
   }
-  else {
-    buffer[bytesReceived] = 0;
-  }
 
+  packet->size = (uint32_t)bytesReceived;
   *dst = fromAddress;
 
   return bytesReceived;
 }
 
 static int sendPacket(
-  int sock, struct sockaddr_in *address, const char *buffer, uint32_t size) {
+  int sock, struct sockaddr_in *address, const PacketBuffer *packet) {
+  if (packet->failed) {
+    fprintf(stderr, "Dropping packet which didn't fit in its buffer\n");
+    return 0;
+  }
+
   int32_t sendto_ret = sendto(
-    sock, buffer, size, 0, (struct sockaddr *)address, sizeof(*address));
+    sock, packet->data, packet->size, 0,
+    (struct sockaddr *)address, sizeof(*address));
 
   if (sendto_ret < 0) {
     // Error
@@ -93,9 +146,73 @@ static int sendPacket(
   }
 }
 
+/* Sends header and body as one datagram, without copying them together */
+static int sendPacketParts(
+  int sock, struct sockaddr_in *address,
+  const PacketBuffer *header, const PacketBuffer *body) {
+  if (header->failed || body->failed ||
+      header->size + body->size > PACKET_BUFFER_SIZE) {
+    fprintf(stderr, "Dropping packet which didn't fit in its buffer\n");
+    return 0;
+  }
+
+  struct iovec vectors[2] = {
+    {.iov_base = (void *)header->data, .iov_len = header->size},
+    {.iov_base = (void *)body->data, .iov_len = body->size}
+  };
+
+  struct msghdr message = {
+    .msg_name = address,
+    .msg_namelen = sizeof(*address),
+    .msg_iov = vectors,
+    .msg_iovlen = 2
+  };
+
+  if (sendmsg(sock, &message, 0) < 0) {
+    fprintf(stderr, "Failed to call sendmsg: %d\n", errno);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* The server's socket goes through io_uring when it can */
+static int32_t receiveServerPacket(
+  Server *s, PacketBuffer *packet, struct sockaddr_in *addr) {
+  if (s->ring) {
+    return receiveFromUdpRing(s->ring, packet, addr);
+  }
+
+  return receivePacket(s->mainSocket, packet, addr);
+}
+
+static int sendServerPacket(
+  Server *s, struct sockaddr_in *addr, const PacketBuffer *packet) {
+  if (s->ring && !packet->failed && sendToUdpRing(s->ring, addr, packet)) {
+    return 1;
+  }
+
+  /* No ring, or all its send slots are in flight */
+  return sendPacket(s->mainSocket, addr, packet);
+}
+
+/* The body is shared between clients. io_uring sends straight from it, so
+   tickServer holds on to it (see sentBodies) until the ring is done */
+static int sendServerPacketParts(
+  Server *s, struct sockaddr_in *addr,
+  const PacketBuffer *header, const PacketBuffer *body) {
+  if (s->ring && s->sentBodyCount < MAX_SENT_SNAPSHOT_BODIES &&
+      !header->failed && header->size + body->size <= PACKET_BUFFER_SIZE &&
+      sendPartsToUdpRing(s->ring, addr, header, body)) {
+    return 1;
+  }
+
+  return sendPacketParts(s->mainSocket, addr, header, body);
+}
+
 static uint32_t strToIpv4(
   const char *name, uint32_t port, int32_t protocol) {
-  struct addrinfo hints = {}, *addresses;
+  struct addrinfo hints = {}, *addresses = NULL;
 
   hints.ai_family = AF_INET;
 
@@ -120,437 +237,777 @@ static uint32_t strToIpv4(
 
   if (err != 0) {
     fprintf(stderr, "%s: %s\n", name, gai_strerror(err));
+    return 0;
   }
 
-  // (This is a really bad way)
-  // Find way to get correct address
-  if (addresses) {
-    for (struct addrinfo *addr = addresses; addr != NULL; addr = addr->ai_next) {
-      if (addr->ai_family == AF_INET) {
-        struct sockaddr_in *addrIn = (struct sockaddr_in *)addr->ai_addr;
-        uint32_t address = addrIn->sin_addr.s_addr;
-        freeaddrinfo(addresses);
-        return address;
-      }
+  /* The first IPv4 address */
+  uint32_t address = 0;
+
+  for (struct addrinfo *addr = addresses; addr != NULL; addr = addr->ai_next) {
+    if (addr->ai_family == AF_INET) {
+      address = ((struct sockaddr_in *)addr->ai_addr)->sin_addr.s_addr;
+      break;
     }
+  }
 
+  if (!address) {
     fprintf(stderr, "Couldn't find address: %s\n", name);
+  }
 
-    return 0;
+  freeaddrinfo(addresses);
+
+  return address;
+}
+
+/*****************************************************************************/
+/*                           Clock synchronization                           */
+/*****************************************************************************/
+/* Called by the client whenever the server echoes back one of our pings.
+   pingEcho is our own send time, holdTime is how long the server sat on the
+   ping before replying and serverTime is the server clock at reply time. */
+static void addTimeSample(
+  TimeSync *sync, float pingEcho, float holdTime, float serverTime) {
+  if (pingEcho == NO_PING) {
+    return;
+  }
+
+  float currentTime = getTime();
+  float rtt = (currentTime - pingEcho) - holdTime;
+
+  /* Reject nonsense (clock went backwards, reordered echo, ...) */
+  if (rtt < 0.0f || rtt > TIME_SYNC_MAX_RTT) {
+    return;
+  }
+
+  TimeSyncSample *sample = &sync->samples[sync->sampleHead];
+  sample->rtt = rtt;
+  sample->offset = serverTime + rtt / 2.0f - currentTime;
+
+  sync->sampleHead = (sync->sampleHead + 1) % TIME_SYNC_SAMPLES;
+  sync->sampleCount = MIN(sync->sampleCount + 1, TIME_SYNC_SAMPLES);
+
+  /* Clock filter: the sample with the lowest round trip spent the least
+     time in queues so its offset is the most trustworthy. Samples with
+     inflated round trips (the outliers) are never picked. */
+  TimeSyncSample *best = &sync->samples[0];
+  for (int i = 1; i < sync->sampleCount; ++i) {
+    if (sync->samples[i].rtt < best->rtt) {
+      best = &sync->samples[i];
+    }
+  }
+
+  sync->minRtt = best->rtt;
+
+  if (sync->isSynced) {
+    sync->rtt = lerp(sync->rtt, rtt, 0.125f);
+    sync->offset = lerp(sync->offset, best->offset, TIME_SYNC_SLEW);
   }
   else {
-    return 0;
+    sync->rtt = rtt;
+    sync->offset = best->offset;
+    sync->isSynced = 1;
+  }
+}
+
+float getServerTime(const Client *c) {
+  return getTime() + c->timeSync.offset;
+}
+
+/* Remote players are rendered a couple of snapshots in the past so that
+   there is (almost) always a snapshot on either side to interpolate */
+float getInterpolationTime(const Client *c) {
+  return getServerTime(c) -
+    INTERPOLATION_DELAY_SNAPSHOTS * c->snapshotInterval;
+}
+
+float serverToLocalTime(const Client *c, float serverTime) {
+  if (c->timeSync.isSynced) {
+    return serverTime - c->timeSync.offset;
+  }
+  else {
+    /* Best we can do until the first ping comes back */
+    return getTime();
+  }
+}
+
+/*****************************************************************************/
+/*                           Snapshot rate control                           */
+/*****************************************************************************/
+/* Called by the server whenever a client acks snapshots. Loss is measured
+   against the highest snapshot number the client has seen, so snapshots
+   which are still in flight don't count as lost. */
+static void updateSnapshotRate(
+  Server *s, Client *c,
+  uint32_t snapshotNumber, uint32_t snapshots, uint32_t bytes) {
+  /* Duplicate or reordered ack */
+  if (snapshotNumber <= c->ackedSnapshotNumber) {
+    return;
+  }
+
+  float currentTime = getTime();
+
+  uint32_t expected = snapshotNumber - c->ackedSnapshotNumber;
+  uint32_t received = MIN(snapshots - c->ackedSnapshots, expected);
+  float loss = 1.0f - (float)received / (float)expected;
+  c->snapshotLoss = lerp(c->snapshotLoss, loss, 0.25f);
+
+  float dt = currentTime - c->lastAckTime;
+  if (c->lastAckTime > 0.0f && dt > 0.0f) {
+    /* Windowed max of the delivery rate (slowly forgets old highs) */
+    float deliveryRate = (float)(bytes - c->ackedBytes) / dt;
+    c->bandwidth = MAX(deliveryRate, c->bandwidth * 0.95f);
+  }
+
+  c->ackedSnapshotNumber = snapshotNumber;
+  c->ackedSnapshots = snapshots;
+  c->ackedBytes = bytes;
+  c->lastAckTime = currentTime;
+
+  /* AIMD on the snapshot rate */
+  if (c->snapshotLoss > SNAPSHOT_LOSS_BACKOFF) {
+    c->snapshotInterval *= SNAPSHOT_INTERVAL_BACKOFF;
+  }
+  else if (c->snapshotLoss < SNAPSHOT_LOSS_PROBE) {
+    c->snapshotInterval -= SNAPSHOT_INTERVAL_STEP;
+  }
+
+  /* Never plan on sending more than the byte budget. Once the link is
+     losing packets, don't go over what it has shown it can deliver */
+  float minInterval = s->config.minSnapshotInterval;
+  float snapshotSize = (float)s->lastSnapshotSize;
+  minInterval = MAX(
+    minInterval, snapshotSize / (float)s->config.maxSnapshotBytesPerSecond);
+
+  if (c->snapshotLoss > SNAPSHOT_LOSS_BACKOFF && c->bandwidth > 0.0f) {
+    minInterval = MAX(minInterval, snapshotSize / c->bandwidth);
+  }
+
+  c->snapshotInterval = clamp(
+    c->snapshotInterval, minInterval, s->config.maxSnapshotInterval);
+}
+
+/*****************************************************************************/
+/*                             Network statistics                            */
+/*****************************************************************************/
+static void countPacketIn(NetStats *stats, uint32_t size) {
+  stats->packetsIn++;
+  stats->bytesIn += size;
+}
+
+static void countPacketOut(NetStats *stats, uint32_t size) {
+  stats->packetsOut++;
+  stats->bytesOut += size;
+}
+
+/* Packets the other side numbers: the ones missing below the highest
+   number seen at the end of a window count as lost */
+static void countSequence(NetStats *stats, uint32_t sequence) {
+  if ((int32_t)(sequence - stats->highestSequence) > 0) {
+    stats->highestSequence = sequence;
+  }
+
+  stats->windowReceived++;
+}
+
+static void addRttSample(NetStats *stats, float rtt) {
+  if (rtt < 0.0f || rtt > TIME_SYNC_MAX_RTT) {
+    return;
+  }
+
+  if (stats->rtt > 0.0f) {
+    stats->rtt = lerp(stats->rtt, rtt, NET_STATS_RTT_GAIN);
+  }
+  else {
+    stats->rtt = rtt;
+  }
+}
+
+/* Transit is the receive time minus the send time of the same packet,
+   each on its own side's clock */
+static void addTransitSample(NetStats *stats, float transit) {
+  if (stats->hasTransit) {
+    float deviation = fabsf(transit - stats->lastTransit);
+    stats->jitter += (deviation - stats->jitter) * NET_STATS_JITTER_GAIN;
+  }
+
+  stats->lastTransit = transit;
+  stats->hasTransit = true;
+}
+
+/* Turns the totals into rates and loss once per NET_STATS_WINDOW */
+static void updateNetStats(NetStats *stats, float currentTime) {
+  float elapsed = currentTime - stats->windowStart;
+
+  if (elapsed < NET_STATS_WINDOW) {
+    return;
+  }
+
+  stats->bytesInRate = (float)(stats->bytesIn - stats->windowBytesIn) / elapsed;
+  stats->bytesOutRate =
+    (float)(stats->bytesOut - stats->windowBytesOut) / elapsed;
+  stats->snapshotRate =
+    (float)(stats->snapshots - stats->windowSnapshots) / elapsed;
+  stats->correctionRate =
+    (float)(stats->corrections - stats->windowCorrections) / elapsed;
+
+  uint32_t expected = stats->highestSequence - stats->windowSequence;
+  if (expected) {
+    uint32_t received = MIN(stats->windowReceived, expected);
+    stats->lossIn = 1.0f - (float)received / (float)expected;
   }
+
+  stats->windowStart = currentTime;
+  stats->windowBytesIn = stats->bytesIn;
+  stats->windowBytesOut = stats->bytesOut;
+  stats->windowSnapshots = stats->snapshots;
+  stats->windowCorrections = stats->corrections;
+  stats->windowSequence = stats->highestSequence;
+  stats->windowReceived = 0;
 }
 
 /*****************************************************************************/
 /*                               Data transfer                               */
 /*****************************************************************************/
-void serializeByte(unsigned char b, uint8_t *buffer, uint32_t *dstCounter) {
-  buffer[(*dstCounter)++] = b;
-}
-
-unsigned char deserializeByte(uint8_t *buffer, uint32_t *dstCounter) {
-  return buffer[(*dstCounter)++];
-}
-
-void serializeFloat32(float f32, uint8_t *buffer, uint32_t *dstCounter) {
-  buffer = &buffer[*dstCounter];
-  *dstCounter += 4;
-#if defined (__i386) || defined (__x86_64__) || defined (_M_IX86) || defined(_M_X64)
-  *(float *)buffer = f32;
-#else
-  uint32_t *f = (uint32_t *)&f32;
-  *(buffer++) = (uint8_t)*f;
-  *(buffer++) = (uint8_t)(*f >> 8);
-  *(buffer++) = (uint8_t)(*f >> 16);
-  *(buffer++) = (uint8_t)(*f >> 24);
-#endif
-}
-
-float deserializeFloat32(uint8_t *buffer, uint32_t *dstCounter) {
-  buffer = &buffer[*dstCounter];
-  *dstCounter += 4;
-#if defined (__i386) || defined (__x86_64__) || defined (_M_IX86) || defined(_M_X64)
-  return(*(float *)buffer);
-#else
-  uint32_t ret = 0;
-  ret += (*(buffer++));
-  ret += ((uint32_t)(*(buffer++))) << 8;
-  ret += ((uint32_t)(*(buffer++))) << 16;
-  ret += ((uint32_t)(*(buffer++))) << 24;
-    
-  return(*(float *)(&ret));
-#endif
-}
-
-void serializeUint32(uint32_t u32, uint8_t *buffer, uint32_t *dstCounter) {
-  buffer = &buffer[*dstCounter];
-  *dstCounter += 4;
-#if defined (__i386) || defined (__x86_64__) || defined (_M_IX86) || defined(_M_X64)
-  *(uint32_t *)buffer = u32;
-#else
-  *(buffer++) = (uint8_t)u32;
-  *(buffer++) = (uint8_t)(u32 >> 8);
-  *(buffer++) = (uint8_t)(u32 >> 16);
-  *(buffer++) = (uint8_t)(u32 >> 24);
-#endif
-}
-
-uint32_t deserializeUint32(uint8_t *buffer, uint32_t *dstCounter) {
-  buffer = &buffer[*dstCounter];
-  *dstCounter += 4;
-#if defined (__i386) || defined (__x86_64__) || defined (_M_IX86) || defined(_M_X64)
-  return(*(uint32_t *)buffer);
-#else
-  uint32_t ret = 0;
-  ret += (*(buffer++));
-  ret += ((uint32_t)(*(buffer++))) << 8;
-  ret += ((uint32_t)(*(buffer++))) << 16;
-  ret += ((uint32_t)(*(buffer++))) << 24;
-  return(ret);
-#endif
-}
-
-static uint32_t serializePacketHeader(Client *c, int packetType) {
+static void serializePacketHeader(
+  PacketBuffer *packet, Client *c, int packetType) {
   PacketHeader header = {
     .packetType = packetType,
     .clientID = c->id
   };
 
-  uint32_t msgPtr = 0;
-  serializeUint32(header.bytes, msgBuffer, &msgPtr);
+  serializeUint32(header.bytes, packet);
+}
 
-  return msgPtr;
+static void deserializePacketHeader(PacketBuffer *packet, PacketHeader *header) {
+  header->bytes = deserializeUint32(packet);
 }
 
-static uint32_t deserializePacketHeader(PacketHeader *header) {
-  uint32_t msgPtr = 0;
-  header->bytes = deserializeUint32(msgBuffer, &msgPtr);
+static void serializeCommands(PacketBuffer *packet, Client *c) {
+  CommandsWire wire = {
+    /* Ping (our clock) and the time the commands were sent (server clock) */
+    .pingTime = getTime(),
+    .serverTimestamp = getServerTime(c),
 
-  return msgPtr;
-}
+    /* Snapshot acks */
+    .lastSnapshotNumber = c->lastSnapshotNumber,
+    .snapshotsReceived = c->snapshotsReceived,
+    .snapshotBytesReceived = c->snapshotBytesReceived,
+
+    .predictedX = c->predicted.position.x,
+    .predictedY = c->predicted.position.y,
+    .predictedOrientation = c->predicted.orientation,
+    .predictedSpeed = c->predicted.speed,
+
+    .packetNumber = ++c->commandsPacketsSent,
+
+    .newestCommand = c->commandSequence,
+    .commandsCount = c->commandCount + c->sentCommandCount
+  };
 
-static uint32_t serializeCommands(Client *c, uint32_t *msgPtr) {
-  serializeFloat32(c->predicted.position.x, msgBuffer, msgPtr);
-  serializeFloat32(c->predicted.position.y, msgBuffer, msgPtr);
-  serializeFloat32(c->predicted.orientation, msgBuffer, msgPtr);
-  serializeFloat32(c->predicted.speed, msgBuffer, msgPtr);
+  /* Commands[] - newest first: the new ones, then the ones sent before */
+  ClientBuffers *buffers = c->buffers;
+  for (int i = 0; i < wire.commandsCount; ++i) {
+    GameCommands *command = i < c->commandCount ?
+      &buffers->commandStack[c->commandCount - 1 - i] :
+      &buffers->sentCommands[c->sentCommandCount - 1 - (i - c->commandCount)];
+
+    CommandWire *commandWire = &wire.commands[i];
+    commandWire->actions = (uint8_t)command->actions.bytes;
+    commandWire->orientation = command->newOrientation;
+
+    if (command->actions.shoot && wire.shotsCount < MAX_COMMAND_SHOTS) {
+      ShotWire *shot = &wire.shots[wire.shotsCount++];
+      shot->command = (uint8_t)i;
+      shot->targetX = command->wShootTarget.x;
+      shot->targetY = command->wShootTarget.y;
+    }
+  }
 
-  /* Command count */
-  serializeUint32(c->commandCount, msgBuffer, msgPtr);
-  /* Commands[] */
+  encodeCommandsWire(packet, &wire);
+
+  /* Keep the last COMMAND_REDUNDANCY commands around for the next packets */
   for (int i = 0; i < c->commandCount; ++i) {
-    GameCommands *command = &c->commandStack[i];
-    serializeUint32(command->actions.bytes, msgBuffer, msgPtr);
-    serializeFloat32(command->newOrientation, msgBuffer, msgPtr);
-    serializeFloat32(command->dt, msgBuffer, msgPtr);
-    serializeFloat32(command->wShootTarget.x, msgBuffer, msgPtr);
-    serializeFloat32(command->wShootTarget.y, msgBuffer, msgPtr);
+    if (c->sentCommandCount == COMMAND_REDUNDANCY) {
+      memmove(
+        &buffers->sentCommands[0], &buffers->sentCommands[1],
+        sizeof(GameCommands) * (COMMAND_REDUNDANCY - 1));
+      c->sentCommandCount--;
+    }
+
+    buffers->sentCommands[c->sentCommandCount++] = buffers->commandStack[i];
   }
 
   c->commandCount = 0;
-
-  /* Return the size of this packet */
-  return *msgPtr;
 }
 
-/* This will add the commands to the client's command stack */
-static uint32_t deserializeCommands(Client *c, uint32_t *msgPtr) {
-  c->predicted.position.x = deserializeFloat32(msgBuffer, msgPtr);
-  c->predicted.position.y = deserializeFloat32(msgBuffer, msgPtr);
-  c->predicted.orientation = deserializeFloat32(msgBuffer, msgPtr);
-  c->predicted.speed = deserializeFloat32(msgBuffer, msgPtr);
+/* This will add the commands the server hasn't seen yet to the client's
+   command stack. Returns false (and leaves the client alone) if the packet
+   is malformed */
+static bool deserializeCommands(PacketBuffer *packet, Server *s, Client *c) {
+  if (!validateCommandsWire(packet)) {
+    return false;
+  }
+
+  CommandsWire wire;
+  decodeCommandsWire(packet, &wire);
 
-  /* Command count */
-  uint32_t commandCount = deserializeUint32(msgBuffer, msgPtr);
-  // c->commandCount = MIN(c->commandCount, MAX_COMMANDS);
-  /* Commands[] */
-  for (int i = 0; i < commandCount && c->commandCount < MAX_COMMANDS; ++i) {
-    GameCommands *command = &c->commandStack[c->commandCount];
-    command->actions.bytes = deserializeUint32(msgBuffer, msgPtr);
-    command->newOrientation = deserializeFloat32(msgBuffer, msgPtr);
-    command->dt = deserializeFloat32(msgBuffer, msgPtr);
-    command->wShootTarget.x = deserializeFloat32(msgBuffer, msgPtr);
-    command->wShootTarget.y = deserializeFloat32(msgBuffer, msgPtr);
-    c->commandCount++;
+  /* Shots have to point at a command which shot */
+  for (int i = 0; i < wire.shotsCount; ++i) {
+    ShotWire *shot = &wire.shots[i];
+
+    if (shot->command >= wire.commandsCount) {
+      return false;
+    }
+
+    GameCommands shooter = {
+      .actions.bytes = wire.commands[shot->command].actions
+    };
+
+    if (!shooter.actions.shoot) {
+      return false;
+    }
+  }
+
+  /* Keep the ping around to echo it in the next snapshot */
+  c->pingTime = wire.pingTime;
+  c->pingReceiveTime = getTime();
+
+  /* The client stamps its commands with our clock as it estimates it,
+     which is half its round trip behind. Being off by half the difference
+     between the two ways, receive time minus stamp is half the round trip
+     even when they differ */
+  NetStats *stats = &c->stats;
+  addRttSample(stats, 2.0f * (c->pingReceiveTime - wire.serverTimestamp));
+  addTransitSample(stats, c->pingReceiveTime - wire.pingTime);
+  countSequence(stats, wire.packetNumber);
+
+  /* Snapshot acks */
+  updateSnapshotRate(
+    s, c, wire.lastSnapshotNumber,
+    wire.snapshotsReceived, wire.snapshotBytesReceived);
+
+  /* Commands[] - oldest first, skipping the ones already queued (they are
+     repeats, or came in a packet which overtook this one) */
+  for (int i = (int)wire.commandsCount - 1; i >= 0; --i) {
+    uint32_t sequence = wire.newestCommand - (uint32_t)i;
+
+    if ((int32_t)(sequence - c->commandSequence) <= 0) {
+      continue;
+    }
+
+    if (c->inputCount == MAX_INPUT_COMMANDS) {
+      /* Overrun - the rest comes again in the next packets */
+      c->inputOverruns++;
+      break;
+    }
+
+    InputCommand *input = &c->buffers->inputs[
+      (c->inputStart + c->inputCount++) % MAX_INPUT_COMMANDS];
+    input->sequence = sequence;
+
+    /* The client's prediction is for after its newest command */
+    input->hasPrediction = (i == 0);
+    input->predictedPosition = vec2(wire.predictedX, wire.predictedY);
+
+    CommandWire *commandWire = &wire.commands[i];
+    GameCommands *command = &input->commands;
+    command->actions.bytes = commandWire->actions;
+    command->newOrientation = commandWire->orientation;
+    /* Commands are produced once per simulation tick */
+    command->dt = SIMULATION_DT;
+    command->wShootTarget = vec2(0.0f, 0.0f);
+
+    /* A shot which didn't fit in the packet doesn't happen */
+    bool hasTarget = false;
+    for (int shot = 0; shot < wire.shotsCount; ++shot) {
+      if (wire.shots[shot].command == i) {
+        command->wShootTarget.x = wire.shots[shot].targetX;
+        command->wShootTarget.y = wire.shots[shot].targetY;
+        hasTarget = true;
+      }
+    }
+
+    if (!hasTarget) {
+      command->actions.shoot = 0;
+    }
+
+    c->commandSequence = sequence;
   }
 
-  /* Return the size of this packet */
-  return *msgPtr;
+  return true;
 }
 
-static uint32_t serializeConnect(
-  Server *s, Client *c, GloState *game, uint32_t *msgPtr) {
-  /* Client ID */
-  serializeUint32((uint32_t)c->id, msgBuffer, msgPtr);
-  /* Player count */
-  serializeUint32((uint32_t)s->clientCount, msgBuffer, msgPtr);
-  /* Players[] */
+/* Players[] as they are in the connect and snapshot packets */
+static void serializePlayers(
+  PlayerWire *players, uint32_t *playerCount, Server *s, GloState *game) {
+  *playerCount = (uint32_t)s->clientCount;
+
   for (int i = 0; i < s->clientCount; ++i) {
     Client *currentClient = &s->clients[i];
+    PlayerWire *wire = &players[i];
 
-    serializeUint32((uint32_t)currentClient->id, msgBuffer, msgPtr);
+    wire->id = (uint8_t)currentClient->id;
 
     if (currentClient->id == INVALID_CLIENT_ID) {
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeUint32(0.0f, msgBuffer, msgPtr);
+      wire->positionX = 0.0f;
+      wire->positionY = 0.0f;
+      wire->orientation = 0.0f;
+      wire->speed = 0.0f;
+      wire->health = 0;
     }
     else {
       Player *player = &game->players[currentClient->id];
-      serializeFloat32(player->position.x, msgBuffer, msgPtr);
-      serializeFloat32(player->position.y, msgBuffer, msgPtr);
-      serializeFloat32(player->orientation, msgBuffer, msgPtr);
-      serializeFloat32(player->speed, msgBuffer, msgPtr);
-      serializeUint32(player->health, msgBuffer, msgPtr);
+      wire->positionX = player->position.x;
+      wire->positionY = player->position.y;
+      wire->orientation = player->orientation;
+      wire->speed = player->speed;
+      wire->health = (uint32_t)player->health;
     }
   }
+}
+
+static void serializeConnect(
+  PacketBuffer *packet, Server *s, Client *c, GloState *game) {
+  /* Echo the ping of the discover packet to get clock sync started */
+  float currentTime = getTime();
+
+  ConnectWire wire = {
+    .pingEcho = c->pingTime,
+    .holdTime = currentTime - c->pingReceiveTime,
+    .serverTime = currentTime,
+    .clientID = (uint8_t)c->id,
+    /* Anything up to here is already reflected in the players below */
+    .eventSequence = s->eventSequence
+  };
+
+  c->pingTime = NO_PING;
+
+  serializePlayers(wire.players, &wire.playersCount, s, game);
+  encodeConnectWire(packet, &wire);
 
   /* Serialize current trajectories as well */
   /* Client will have to calculate the starting time of the trajectories */
-
-  /* Return the size of this packet */
-  return *msgPtr;
 }
 
-/* This will add the commands to the client's command stack */
-static uint32_t deserializeConnect(Client *c, GloState *game, uint32_t *msgPtr) {
-  /* Client ID */
-  game->controlled = c->id = (int)deserializeUint32(msgBuffer, msgPtr);
-  /* Player count */
-  game->playerCount = deserializeUint32(msgBuffer, msgPtr);
-  /* Players[] */
-  for (int i = 0; i < game->playerCount; ++i) {
-    Player *currentPlayer = &game->players[i];
+/* Returns false (and leaves the game alone) if the packet is malformed */
+static bool deserializeConnect(
+  PacketBuffer *packet, Client *c, GloState *game) {
+  if (!validateConnectWire(packet)) {
+    return false;
+  }
 
-    int currentID = (int)deserializeUint32(msgBuffer, msgPtr);
+  ConnectWire wire;
+  decodeConnectWire(packet, &wire);
 
-    if (currentID == INVALID_CLIENT_ID) {
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeUint32(msgBuffer, msgPtr);
-    }
-    else {
-      Player *player = &game->players[currentID];
-      player->position.x = deserializeFloat32(msgBuffer, msgPtr);
-      player->position.y = deserializeFloat32(msgBuffer, msgPtr);
-      player->orientation = deserializeFloat32(msgBuffer, msgPtr);
-      player->speed = deserializeFloat32(msgBuffer, msgPtr);
-      player->health = (int)deserializeUint32(msgBuffer, msgPtr);
+  addTimeSample(&c->timeSync, wire.pingEcho, wire.holdTime, wire.serverTime);
+
+  /* Client ID */
+  game->controlled = c->id = (int)wire.clientID;
+  c->eventSequence = wire.eventSequence;
+  /* Players[] */
+  game->playerCount = (int)wire.playersCount;
+  for (int i = 0; i < wire.playersCount; ++i) {
+    PlayerWire *playerWire = &wire.players[i];
+
+    if (playerWire->id != INVALID_CLIENT_ID) {
+      Player *player = &game->players[playerWire->id];
+      player->position.x = playerWire->positionX;
+      player->position.y = playerWire->positionY;
+      player->orientation = playerWire->orientation;
+      player->speed = playerWire->speed;
+      player->health = (int)playerWire->health;
       player->flags.isInitialized = 1;
     }
   }
 
-  /* Return the size of this packet */
-  return *msgPtr;
+  return true;
 }
 
-static uint32_t serializeSnapshot(
-  Server *s, GloState *game, uint32_t *msgPtr) {
-  /* Place holder value to be filled in after function is called */
-  serializeByte((unsigned char)0, msgBuffer, msgPtr);
-
-  /* New client count */
-  serializeUint32(s->newClientCount, msgBuffer, msgPtr);
-  for (int i = 0; i < s->newClientCount; ++i) {
-    serializeUint32((uint32_t)s->newClientStack[i], msgBuffer, msgPtr);
-    /* May serialize other things like lazer colors, etc... */
-  }
+/* The body is the same for every client, see sendSnapshotToClient */
+static void serializeSnapshot(PacketBuffer *packet, Server *s, GloState *game) {
+  SnapshotBodyWire wire = {
+    /* Everything in the snapshot is stamped with the server clock */
+    .serverTime = getTime()
+  };
 
-  /* New disconnects */
-  serializeUint32(s->newDisconnects, msgBuffer, msgPtr);
-  for (int i = 0; i < s->newDisconnects; ++i) {
-    printf("Disconnected\n");
-    serializeUint32((uint32_t)s->newDisconnectStack[i], msgBuffer, msgPtr);
+  /* Events[] - the most recent ones, clients skip what they've seen */
+  wire.eventsCount = MIN(s->eventCount, MAX_SNAPSHOT_EVENTS);
+  for (int i = 0; i < wire.eventsCount; ++i) {
+    uint32_t index = s->eventStart + s->eventCount - wire.eventsCount + i;
+    ServerEvent *event = &s->events[index % MAX_SERVER_EVENTS];
+    EventWire *eventWire = &wire.events[i];
+    eventWire->type = event->type;
+    eventWire->sequence = event->sequence;
+    eventWire->player = event->player;
+    eventWire->startX = event->wStart.x;
+    eventWire->startY = event->wStart.y;
+    eventWire->endX = event->wEnd.x;
+    eventWire->endY = event->wEnd.y;
+    /* Server time - the client maps it onto its own clock */
+    eventWire->time = event->time;
   }
 
   /* Players[] */
-  serializeUint32(s->clientCount, msgBuffer, msgPtr);
-  for (int i = 0; i < s->clientCount; ++i) {
-    Client *currentClient = &s->clients[i];
+  serializePlayers(wire.players, &wire.playersCount, s, game);
 
-    serializeUint32((uint32_t)currentClient->id, msgBuffer, msgPtr);
+  encodeSnapshotBodyWire(packet, &wire);
+}
 
-    if (currentClient->id == INVALID_CLIENT_ID) {
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeFloat32(0.0f, msgBuffer, msgPtr);
-      serializeUint32(0, msgBuffer, msgPtr);
+/* A remote player starts over: no history, and it's put where the next
+   snapshot of it says */
+static void joinPlayer(GloState *game, int id) {
+  Player *p = spawnPlayer(game, id);
+  game->playerHistories[id].snapshotStart = 0;
+  game->playerHistories[id].snapshotEnd = 0;
+  p->flags.justJoined = 1;
+}
+
+static void applyEvent(Client *c, GloState *game, const ServerEvent *event) {
+  switch (event->type) {
+  case ET_JOIN: {
+    if (event->player != game->controlled) {
+      printf("New player joined!\n");
+      joinPlayer(game, event->player);
     }
-    else {
-      Player *player = &game->players[currentClient->id];
-      serializeFloat32(player->position.x, msgBuffer, msgPtr);
-      serializeFloat32(player->position.y, msgBuffer, msgPtr);
-      serializeFloat32(player->orientation, msgBuffer, msgPtr);
-      serializeFloat32(player->speed, msgBuffer, msgPtr);
-      serializeUint32(player->health, msgBuffer, msgPtr);
+  } break;
+
+  case ET_DISCONNECT: {
+    game->players[event->player].flags.isInitialized = 0;
+    printf("Player disconnected!\n");
+  } break;
+
+  case ET_TRAIL: {
+    if (event->player != game->controlled) {
+      createBulletTrail(
+        game, event->wStart, event->wEnd,
+        serverToLocalTime(c, event->time), event->player);
     }
+  } break;
   }
+}
 
-  /* Serialize current trajectories as well */
-  /* Client will have to calculate the starting time of the trajectories */
-  float currentTime = getTime();
-  serializeUint32(game->newTrailsCount, msgBuffer, msgPtr);
-  for (int i = 0; i < game->newTrailsCount; ++i) {
-    BulletTrajectory *trajectory = &game->bulletTrails[game->newTrails[i]];
-    serializeFloat32(trajectory->wStart.x, msgBuffer, msgPtr);
-    serializeFloat32(trajectory->wStart.y, msgBuffer, msgPtr);
-    serializeFloat32(trajectory->wEnd.x, msgBuffer, msgPtr);
-    serializeFloat32(trajectory->wEnd.y, msgBuffer, msgPtr);
-    /* We serialize the time difference */
-    serializeFloat32(currentTime - trajectory->timeStart, msgBuffer, msgPtr);
-    serializeUint32(trajectory->shooter, msgBuffer, msgPtr);
+/* Network thread: what a snapshot tells about the link (clock, acks and
+   stats). Returns false for malformed and stale snapshots, which the game
+   never gets to see */
+static bool receiveSnapshot(
+  PacketBuffer *packet, Client *c, SnapshotWire *wire) {
+  if (!validateSnapshotWire(packet)) {
+    return false;
   }
 
-  /* Return the size of this packet */
-  return *msgPtr;
-}
+  decodeSnapshotWire(packet, wire);
 
-static uint32_t deserializeSnapshot(
-  Client *c, GloState *game, uint32_t *msgPtr) {
-  /* Place holder value to be filled in after function is called */
-  c->flags.predictionError = deserializeByte(msgBuffer, msgPtr);
+  countSequence(&c->stats, wire->snapshotNumber);
 
-  uint32_t newClientsCount = deserializeUint32(msgBuffer, msgPtr);
+  /* Duplicated, or overtaken by a newer snapshot: anything in it is either
+     out of date or in the newer one too (events are repeated) */
+  if (wire->snapshotNumber <= c->lastSnapshotNumber) {
+    c->staleSnapshots++;
+    return false;
+  }
 
-  for (int i = 0; i < newClientsCount; ++i) {
-    uint32_t id = deserializeUint32(msgBuffer, msgPtr);
+  float serverTime = wire->serverTime;
+  addTimeSample(&c->timeSync, wire->pingEcho, wire->holdTime, serverTime);
 
-    if (id != game->controlled) {
-      printf("New player joined!\n");
-      Player *p = spawnPlayer(game, id);
-      p->snapshotStart = 0;
-      p->snapshotEnd = 0;
-      p->progress = 0.0f;
-      p->flags.justJoined = 1;
-      p->flags.isInitialized = 1;
-      
-      (void)p;
-    }
+  /* The server's side of the link: its commands loss and queue */
+  NetStats *stats = &c->stats;
+  stats->snapshots++;
+  stats->lossOut = (float)wire->commandLoss / 100.0f;
+  stats->inputQueue = wire->inputQueue;
+  addTransitSample(stats, getTime() - serverTime);
+
+  if (wire->predictionError) {
+    stats->corrections++;
   }
 
-  uint32_t disconnects = deserializeUint32(msgBuffer, msgPtr);
-  for (int i = 0; i < disconnects; ++i) {
-    int id = deserializeUint32(msgBuffer, msgPtr);
-    game->players[id].flags.isInitialized = 0;
-    printf("Player disconnected!\n");
+  /* Acks for the server's rate control */
+  c->lastSnapshotNumber = wire->snapshotNumber;
+  c->snapshotsReceived++;
+  c->snapshotBytesReceived += packet->size;
+
+  /* Measure how often snapshots come in to pick the interpolation delay */
+  if (serverTime > c->lastSnapshotServerTime) {
+    if (c->lastSnapshotServerTime > 0.0f) {
+      c->snapshotInterval = lerp(
+        c->snapshotInterval, serverTime - c->lastSnapshotServerTime, 0.1f);
+    }
+
+    c->lastSnapshotServerTime = serverTime;
   }
 
-  /* Players[] */
-  game->playerCount = deserializeUint32(msgBuffer, msgPtr);
-  for (int i = 0; i < game->playerCount; ++i) {
-    Player *currentPlayer = &game->players[i];
+  return true;
+}
 
-    int currentID = (int)deserializeUint32(msgBuffer, msgPtr);
+/* Main thread: the game side of a snapshot received by the network
+   thread, with c's clock as of that snapshot */
+static void applySnapshot(
+  Client *c, GloState *game, const SnapshotWire *wire) {
+  c->flags.predictionError = wire->predictionError;
+  float serverTime = wire->serverTime;
+
+  /* Events[] - oldest first. If the oldest is past the next one we need,
+     some expired or fell out of the snapshots we got before this one.
+     Trails are just lost, every remote player gets put back where the
+     snapshot has them (one may have left and another joined in between) */
+  uint32_t appliedSequence = c->eventSequence;
+  bool isResync = wire->eventsCount &&
+    wire->events[0].sequence > appliedSequence + 1;
+
+  if (isResync) {
+    printf("Missed events, resyncing players\n");
+  }
 
-    if (currentID == INVALID_CLIENT_ID) {
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeFloat32(msgBuffer, msgPtr);
-      deserializeUint32(msgBuffer, msgPtr);
+  for (int i = 0; i < wire->eventsCount; ++i) {
+    const EventWire *eventWire = &wire->events[i];
+    ServerEvent event = {
+      .sequence = eventWire->sequence,
+      .time = eventWire->time,
+      .type = eventWire->type,
+      .player = eventWire->player,
+      .wStart = {.x = eventWire->startX, .y = eventWire->startY},
+      .wEnd = {.x = eventWire->endX, .y = eventWire->endY}
+    };
+
+    if (event.sequence > appliedSequence) {
+      applyEvent(c, game, &event);
+      c->eventSequence = MAX(c->eventSequence, event.sequence);
     }
-    else {
-      Player *player = &game->players[currentID];
-      if (currentID != game->controlled) {
-        /* This isn't us - we add a snapshot! */
-        PlayerSnapshot snapshot;
+  }
 
-        snapshot.position.x = deserializeFloat32(msgBuffer, msgPtr);
-        snapshot.position.y = deserializeFloat32(msgBuffer, msgPtr);
-        snapshot.orientation = deserializeFloat32(msgBuffer, msgPtr);
+  /* Players[] - who is in the game, whether or not we saw the events
+     (slot i is player i). Past the end is nobody */
+  for (int i = (int)wire->playersCount; i < game->playerCount; ++i) {
+    if (i != game->controlled) {
+      game->players[i].flags.isInitialized = 0;
+    }
+  }
 
-        /* Push the snapshot! */
-        player->snapshots[player->snapshotEnd] = snapshot;
-        player->snapshotEnd = (player->snapshotEnd + 1)%MAX_PLAYER_SNAPSHOTS;
+  float renderTime = getInterpolationTime(c);
+  game->playerCount = (int)wire->playersCount;
+  for (int i = 0; i < wire->playersCount; ++i) {
+    const PlayerWire *playerWire = &wire->players[i];
 
-        if (player->flags.justJoined) {
-          player->position = snapshot.position;
-          player->orientation = snapshot.orientation;
-          player->flags.justJoined = 0;
-        }
+    if (playerWire->id == INVALID_CLIENT_ID) {
+      if (i != game->controlled && game->players[i].flags.isInitialized) {
+        printf("Player disconnected!\n");
+        game->players[i].flags.isInitialized = 0;
+      }
+
+      continue;
+    }
 
-        /* We don't realy care about speed for remote players */
-        player->speed = deserializeFloat32(msgBuffer, msgPtr);
-        player->health = (int)deserializeUint32(msgBuffer, msgPtr);
+    Player *player = &game->players[playerWire->id];
+    if (playerWire->id != game->controlled) {
+      if (!player->flags.isInitialized || isResync) {
+        joinPlayer(game, playerWire->id);
       }
-      else if (c->flags.predictionError) {
-        /* We need to force these new positions on controlled player */
-        printf("Player moved incorrectly!\n");
-        player->position.x = deserializeFloat32(msgBuffer, msgPtr);
-        player->position.y = deserializeFloat32(msgBuffer, msgPtr);
-        player->orientation = deserializeFloat32(msgBuffer, msgPtr);
-        player->speed = deserializeFloat32(msgBuffer, msgPtr);
-        player->health = deserializeUint32(msgBuffer, msgPtr);
-
-        /* Reset the command stack */
-        c->commandCount = 0;
+
+      /* This isn't us - we add a snapshot! */
+      PlayerHistory *history = &game->playerHistories[playerWire->id];
+      PlayerSnapshot snapshot;
+
+      snapshot.position.x = playerWire->positionX;
+      snapshot.position.y = playerWire->positionY;
+      snapshot.orientation = playerWire->orientation;
+      snapshot.serverTime = serverTime;
+
+      /* Interpolation only needs the newest snapshot at or before the
+         render time. If the newest one we have and this one both are (a
+         burst came in at once), this one replaces it */
+      uint32_t newest =
+        (history->snapshotEnd + MAX_PLAYER_SNAPSHOTS - 1)%MAX_PLAYER_SNAPSHOTS;
+
+      if (history->snapshotEnd != history->snapshotStart &&
+          history->snapshots[newest].serverTime <= renderTime &&
+          snapshot.serverTime <= renderTime) {
+        history->snapshots[newest] = snapshot;
       }
       else {
-        for (int d = 0; d < 5; ++d) {
-          deserializeFloat32(msgBuffer, msgPtr);
-        }
+        /* Push the snapshot! */
+        history->snapshots[history->snapshotEnd] = snapshot;
+        history->snapshotEnd = (history->snapshotEnd + 1)%MAX_PLAYER_SNAPSHOTS;
       }
-    }
-  }
-
-  float currentTime = getTime();
-  uint32_t newTrailsCount = deserializeUint32(msgBuffer, msgPtr);
-  for (int i = 0; i < newTrailsCount; ++i) {
-    Vec2 wStart, wEnd;
-    float timeStart;
-
-    wStart.x = deserializeFloat32(msgBuffer, msgPtr);
-    wStart.y = deserializeFloat32(msgBuffer, msgPtr);
-    wEnd.x = deserializeFloat32(msgBuffer, msgPtr);
-    wEnd.y = deserializeFloat32(msgBuffer, msgPtr);
 
-    /* We serialize the time difference */
-    float d = deserializeFloat32(msgBuffer, msgPtr);
-    // timeStart = currentTime - d;
-    timeStart = getTime();
+      if (history->snapshotEnd == history->snapshotStart) {
+        /* Ring is full - drop the oldest */
+        history->snapshotStart =
+          (history->snapshotStart + 1)%MAX_PLAYER_SNAPSHOTS;
+      }
 
-    int shooter = (int)deserializeUint32(msgBuffer, msgPtr);
+      if (player->flags.justJoined) {
+        player->position = snapshot.position;
+        player->orientation = snapshot.orientation;
+        player->flags.justJoined = 0;
+      }
 
-    if (shooter != game->controlled) {
-      createBulletTrail(game, wStart, wEnd, timeStart, shooter);
+      /* We don't realy care about speed for remote players */
+      player->speed = playerWire->speed;
+      player->health = (int)playerWire->health;
+    }
+    else if (c->flags.predictionError) {
+      /* We need to force these new positions on controlled player */
+      printf("Player moved incorrectly!\n");
+      player->position.x = playerWire->positionX;
+      player->position.y = playerWire->positionY;
+      player->orientation = playerWire->orientation;
+      player->speed = playerWire->speed;
+      player->health = (int)playerWire->health;
+
+      /* The commands the server hadn't simulated yet still have to be
+         applied on top */
+      c->simulatedSequence = wire->simulatedCommand;
+      c->flags.needsReplay = 1;
     }
   }
-
-  /* Return the size of this packet */
-  return *msgPtr;
 }
 
-static void broadcastPacket(Client *c, uint8_t *msg, uint32_t size) {
+static void broadcastPacket(Client *c, const PacketBuffer *packet) {
   struct sockaddr_in addr = {};
   addr.sin_family = AF_INET;
   addr.sin_port = htons(MAIN_SOCKET_PORT_SERVER);
   addr.sin_addr.s_addr = INADDR_BROADCAST;
-  sendPacket(c->mainSocket, &addr, (char *)msg, size);
+  sendPacket(c->mainSocket, &addr, packet);
 }
 
-static void sendPacketToServer(Client *c, uint8_t *msg, uint32_t size) {
+static void sendPacketToServer(Client *c, const PacketBuffer *packet) {
   struct sockaddr_in addr = {};
   addr.sin_family = AF_INET;
   addr.sin_port = htons(MAIN_SOCKET_PORT_SERVER);
   addr.sin_addr.s_addr = c->serverAddr;
-  sendPacket(c->mainSocket, &addr, (char *)msg, size);
+
+  if (sendPacket(c->mainSocket, &addr, packet)) {
+    countPacketOut(&c->stats, packet->size);
+  }
 }
 
 /*****************************************************************************/
 /*                                   Client                                  */
 /*****************************************************************************/
+/* Only has to be different from the last run's */
+static uint32_t createSession() {
+  uint32_t session = 0;
+
+  FILE *random = fopen("/dev/urandom", "rb");
+  if (!random || fread(&session, sizeof(session), 1, random) != 1) {
+    session = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+  }
+
+  if (random) {
+    fclose(random);
+  }
+
+  return session;
+}
+
 Client createClient(uint16_t mainPort) {
   Client c = {
+    .session = createSession(),
     .mainSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP),
     .commandCount = 0,
-    .lastCommandsSend = 0.0f
+    .lastCommandsSend = 0.0f,
+    .snapshotInterval = SNAPSHOT_PACKET_INTERVAL,
+    .packetPool = createPacketPool(CLIENT_PACKET_BUFFERS),
+    .buffers = (ClientBuffers *)calloc(1, sizeof(ClientBuffers))
   };
 
   if (c.mainSocket < 0) {
@@ -576,107 +1033,916 @@ Client createClient(uint16_t mainPort) {
   return c;
 }
 
-void waitForGameState(Client *c, GloState *game, const char *ip) {
-  /* Send a connection request to server */
-  uint32_t msgSize = 0;
+/* Sends a packet which is nothing but a header */
+static void sendHeaderToServer(Client *c, int packetType) {
+  PacketBuffer *packet = acquirePacketBuffer(c->packetPool);
+  serializePacketHeader(packet, c, packetType);
+  sendPacketToServer(c, packet);
+  releasePacketBuffer(c->packetPool, packet);
+
+  c->lastSendTime = getTime();
+}
+
+/* Cookie is 0 on the first try, then whatever the server challenged with */
+static void sendDiscover(Client *c, uint32_t cookie, bool broadcast) {
+  PacketBuffer *packet = acquirePacketBuffer(c->packetPool);
+
   PacketHeader header = {.packetType = PT_DISCOVER};
-  serializeUint32(header.bytes, msgBuffer, &msgSize);
+  serializeUint32(header.bytes, packet);
 
-  if (strlen(ip) > 0) {
-    printf("Sending to ip address: %s\n", ip);
-    c->serverAddr = strToIpv4(ip, MAIN_SOCKET_PORT_SERVER, IPPROTO_UDP);
-    sendPacketToServer(c, msgBuffer, msgSize);
+  DiscoverWire wire = {
+    .pingTime = getTime(), .cookie = cookie, .session = c->session
+  };
+  encodeDiscoverWire(packet, &wire);
+
+  if (broadcast) {
+    broadcastPacket(c, packet);
   }
   else {
-    broadcastPacket(c, msgBuffer, msgSize);
+    sendPacketToServer(c, packet);
   }
 
-  for (int recvCount = 0; recvCount < 40; ++recvCount) {
-    usleep(5);
+  releasePacketBuffer(c->packetPool, packet);
+}
 
-    struct sockaddr_in addr = {};
-    int size = receivePacket(
-      c->mainSocket, (char *)msgBuffer, MSG_BUFFER_SIZE, &addr);
+static void sendInfoQuery(Client *c, uint32_t address, bool broadcast) {
+  PacketBuffer *packet = acquirePacketBuffer(c->packetPool);
 
-    if (size > 0) {
-      printf("Received game state: ready to play!\n");
-      c->serverAddr = addr.sin_addr.s_addr;
+  PacketHeader header = {.packetType = PT_INFO_QUERY};
+  serializeUint32(header.bytes, packet);
 
-      c->flags.isConnected = 1;
+  InfoQueryWire wire = {};
+  encodeInfoQueryWire(packet, &wire);
 
-      PacketHeader header = {};
-      uint32_t msgPtr = deserializePacketHeader(&header);
+  if (broadcast) {
+    broadcastPacket(c, packet);
+  }
+  else {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MAIN_SOCKET_PORT_SERVER);
+    addr.sin_addr.s_addr = address;
+    sendPacket(c->mainSocket, &addr, packet);
+  }
 
-      assert(header.packetType == PT_CONNECT);
-      deserializeConnect(c, game, &msgPtr);
+  releasePacketBuffer(c->packetPool, packet);
+}
 
-      break;
+/* An info reply, unless the server already answered */
+static void addServerInfo(
+  ServerInfo *servers, int *serverCount, PacketBuffer *packet,
+  uint32_t address, float rtt) {
+  if (!validateInfoWire(packet)) {
+    return;
+  }
+
+  InfoWire wire;
+  decodeInfoWire(packet, &wire);
+
+  /* Listed twice, or reachable through more than one interface */
+  for (int i = 0; i < *serverCount; ++i) {
+    if (servers[i].address == address) {
+      return;
     }
   }
-}
 
-void pushGameCommands(Client *c, const GameCommands *commands) {
-  if (c->commandCount < MAX_COMMANDS) {
-    c->commandStack[c->commandCount++] = *commands;
+  if (*serverCount < MAX_BROWSED_SERVERS) {
+    ServerInfo *server = &servers[(*serverCount)++];
+    server->address = address;
+    server->rtt = rtt;
+    server->playerCount = wire.playerCount;
+    server->capacity = wire.capacity;
+    server->load = (float)wire.load / 100.0f;
   }
 }
 
-void tickClient(Client *c, GloState *game) {
-  if (c->flags.isConnected) {
-    /* Receive all the packets the server sent */
-    for (int i = 0; i < 5 /* May increase in future */; ++i) {
-      struct sockaddr_in addr = {};
-      int size = receivePacket(
-        c->mainSocket, (char *)msgBuffer, MSG_BUFFER_SIZE, &addr);
-
-      if (size > 0) {
-        PacketHeader header = {};
-        uint32_t msgPtr = deserializePacketHeader(&header);
-
-        switch (header.packetType) {
-        case PT_SNAPSHOT: {
-          deserializeSnapshot(c, game, &msgPtr);
-        } break;
-
-          /* Other stuff... */
-        }
-      }
-    }
+/* Lowest rtt, with penalties for being busy. -1 if they are all full */
+static int pickServer(const ServerInfo *servers, int serverCount) {
+  int best = -1;
+  float bestScore = 0.0f;
 
-    float currentTime = getTime();
-    if (currentTime - c->lastCommandsSend > COMMANDS_PACKET_INTERVAL) {
-      c->lastCommandsSend = currentTime;
+  for (int i = 0; i < serverCount; ++i) {
+    const ServerInfo *server = &servers[i];
 
-      uint32_t msgPtr = serializePacketHeader(c, PT_COMMANDS);
+    if (server->playerCount >= server->capacity) {
+      continue;
+    }
 
-      /* Set the client's predicted state for serialization purporses */
-      Player *p = &game->players[c->id];
-      c->predicted.position = p->position;
-      c->predicted.orientation = p->orientation;
-      c->predicted.speed = p->speed;
+    float score = server->rtt +
+      BROWSE_PLAYERS_PENALTY * server->playerCount / server->capacity +
+      BROWSE_LOAD_PENALTY * server->load;
 
-      /* Flush all the commands in the command stack and send the packet */
-      uint32_t byteCount = serializeCommands(c, &msgPtr);
-      if (!gSimulatePacketLoss) {
-        sendPacketToServer(c, msgBuffer, byteCount);
-      }
-      else {
-        printf("PACKET LOSS\n");
+    if (best == -1 || score < bestScore) {
+      best = i;
+      bestScore = score;
+    }
+  }
+
+  return best;
+}
+
+/*****************************************************************************/
+/*                                 Connecting                                */
+/*****************************************************************************/
+/* Looks the names up with getaddrinfo, which can take seconds. Freed by
+   whichever of the thread and the connector lets go of it last */
+typedef struct Resolver {
+  char names[256];
+
+  uint32_t addresses[MAX_BROWSED_SERVERS];
+  int addressCount;
+
+  atomic_bool isDone;
+  atomic_int references;
+} Resolver;
+
+struct Connector {
+  enum ConnectState state;
+  float startTime;
+  float timeout;
+
+  /* What the user asked for, for the status */
+  char names[256];
+  Resolver *resolver;
+
+  /* Browsing: queries go to these, or to the LAN if there are none. The
+     replies are collected until browseEnd */
+  uint32_t addresses[MAX_BROWSED_SERVERS];
+  int addressCount;
+  ServerInfo servers[MAX_BROWSED_SERVERS];
+  int serverCount;
+  float queryTime;
+  float browseEnd;
+  float browseTime;
+
+  /* Discovering: sent again at nextSendTime, each time retryInterval
+     later than the time before. To the LAN while serverAddress is 0 */
+  uint32_t serverAddress;
+  uint32_t cookie;
+  int attempts;
+  float nextSendTime;
+  float retryInterval;
+
+  char failure[96];
+};
+
+static void releaseResolver(Resolver *resolver) {
+  if (atomic_fetch_sub(&resolver->references, 1) == 1) {
+    free(resolver);
+  }
+}
+
+static void *runResolver(void *data) {
+  Resolver *resolver = (Resolver *)data;
+
+  char *state = NULL;
+  for (char *name = strtok_r(resolver->names, ",", &state); name;
+       name = strtok_r(NULL, ",", &state)) {
+    uint32_t address = strToIpv4(name, MAIN_SOCKET_PORT_SERVER, IPPROTO_UDP);
+
+    if (address && resolver->addressCount < MAX_BROWSED_SERVERS) {
+      resolver->addresses[resolver->addressCount++] = address;
+    }
+  }
+
+  atomic_store(&resolver->isDone, true);
+  releaseResolver(resolver);
+
+  return NULL;
+}
+
+static void failConnecting(Connector *connector, const char *reason) {
+  snprintf(connector->failure, sizeof(connector->failure), "%s", reason);
+  connector->state = CS_FAILED;
+  printf("%s\n", reason);
+}
+
+static void sendInfoQueries(Connector *connector, Client *c) {
+  connector->queryTime = getTime();
+  connector->browseEnd = connector->queryTime + connector->browseTime;
+
+  if (connector->addressCount > 0) {
+    for (int i = 0; i < connector->addressCount; ++i) {
+      sendInfoQuery(c, connector->addresses[i], false);
+    }
+  }
+  else {
+    sendInfoQuery(c, 0, true);
+  }
+}
+
+/* To the LAN if address is 0 */
+static void startDiscovering(
+  Connector *connector, Client *c, uint32_t address) {
+  c->serverAddr = address;
+
+  connector->state = CS_DISCOVERING;
+  connector->serverAddress = address;
+  connector->retryInterval = CONNECT_RETRY_INTERVAL;
+  /* Sent on the next tick */
+  connector->nextSendTime = getTime();
+}
+
+/* Nobody answered: ask again and wait longer (slow links), up to
+   CONNECT_MAX_RETRY_INTERVAL. On the LAN, maybe an older server which
+   doesn't know about info queries */
+static void finishBrowsing(Connector *connector, Client *c) {
+  if (connector->serverCount == 0) {
+    if (connector->addressCount == 0) {
+      startDiscovering(connector, c, 0);
+    }
+    else {
+      connector->browseTime = MIN(
+        connector->browseTime * 2.0f, CONNECT_MAX_RETRY_INTERVAL);
+      sendInfoQueries(connector, c);
+    }
+
+    return;
+  }
+
+  int best = pickServer(connector->servers, connector->serverCount);
+
+  for (int i = 0; i < connector->serverCount; ++i) {
+    const ServerInfo *server = &connector->servers[i];
+    struct in_addr address = {.s_addr = server->address};
+    printf(
+      "%sServer %s: %.1fms, %u/%u players, %.0f%% load\n",
+      i == best ? "* " : "  ", inet_ntoa(address), server->rtt * 1000.0f,
+      server->playerCount, server->capacity, server->load * 100.0f);
+  }
+
+  if (best == -1) {
+    failConnecting(connector, "Every server is full");
+  }
+  else {
+    startDiscovering(connector, c, connector->servers[best].address);
+  }
+}
+
+static void finishResolving(Connector *connector, Client *c) {
+  Resolver *resolver = connector->resolver;
+  memcpy(
+    connector->addresses, resolver->addresses,
+    sizeof(uint32_t) * resolver->addressCount);
+  connector->addressCount = resolver->addressCount;
+
+  releaseResolver(resolver);
+  connector->resolver = NULL;
+
+  if (connector->addressCount == 0) {
+    char reason[sizeof(connector->failure)];
+    snprintf(reason, sizeof(reason), "Unable to resolve %s", connector->names);
+    failConnecting(connector, reason);
+  }
+  else if (connector->addressCount == 1) {
+    startDiscovering(connector, c, connector->addresses[0]);
+  }
+  else {
+    connector->state = CS_BROWSING;
+    sendInfoQueries(connector, c);
+  }
+}
+
+static void receiveConnectPackets(
+  Connector *connector, Client *c, GloState *game) {
+  PacketBuffer *packet = acquirePacketBuffer(c->packetPool);
+  struct sockaddr_in addr = {};
+
+  while (connector->state == CS_BROWSING ||
+         connector->state == CS_DISCOVERING) {
+    if (receivePacket(c->mainSocket, packet, &addr) <= 0) {
+      break;
+    }
+
+    /* Once there is a server, nobody else gets to challenge, refuse or
+       connect us. Only a LAN broadcast takes whoever answers first */
+    if (connector->state == CS_DISCOVERING &&
+        (ntohs(addr.sin_port) != MAIN_SOCKET_PORT_SERVER ||
+         (connector->serverAddress &&
+          addr.sin_addr.s_addr != connector->serverAddress))) {
+      continue;
+    }
+
+    PacketHeader header = {};
+    deserializePacketHeader(packet, &header);
+
+    if (connector->state == CS_BROWSING) {
+      if (header.packetType == PT_INFO) {
+        addServerInfo(
+          connector->servers, &connector->serverCount, packet,
+          addr.sin_addr.s_addr, getTime() - connector->queryTime);
+      }
+    }
+    else if (header.packetType == PT_CHALLENGE &&
+             validateChallengeWire(packet)) {
+      /* Prove that we can receive at the address we send from */
+      ChallengeWire challenge;
+      decodeChallengeWire(packet, &challenge);
+
+      c->serverAddr = addr.sin_addr.s_addr;
+      connector->serverAddress = addr.sin_addr.s_addr;
+      connector->cookie = challenge.cookie;
+      sendDiscover(c, connector->cookie, false);
+    }
+    else if (header.packetType == PT_SERVER_FULL) {
+      failConnecting(connector, "Server is full!");
+    }
+    else if (header.packetType == PT_CONNECT &&
+             deserializeConnect(packet, c, game)) {
+      printf("Received game state: ready to play!\n");
+      c->serverAddr = addr.sin_addr.s_addr;
+
+      c->flags.isConnected = 1;
+      c->lastReceiveTime = c->lastSendTime = getTime();
+      connector->state = CS_CONNECTED;
+    }
+  }
+
+  releasePacketBuffer(c->packetPool, packet);
+}
+
+Connector *beginConnecting(Client *c, const char *ip, float timeout) {
+  Connector *connector = (Connector *)calloc(1, sizeof(Connector));
+  connector->startTime = getTime();
+  connector->timeout = timeout;
+  connector->browseTime = BROWSE_TIME;
+  snprintf(connector->names, sizeof(connector->names), "%s", ip);
+
+  if (strlen(ip) == 0) {
+    connector->state = CS_BROWSING;
+    sendInfoQueries(connector, c);
+
+    return connector;
+  }
+
+  if (!strchr(ip, ',')) {
+    printf("Sending to ip address: %s\n", ip);
+  }
+
+  Resolver *resolver = (Resolver *)calloc(1, sizeof(Resolver));
+  snprintf(resolver->names, sizeof(resolver->names), "%s", ip);
+  atomic_init(&resolver->isDone, false);
+  atomic_init(&resolver->references, 2);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, runResolver, resolver)) {
+    /* Look them up here then */
+    runResolver(resolver);
+  }
+  else {
+    pthread_detach(thread);
+  }
+
+  connector->state = CS_RESOLVING;
+  connector->resolver = resolver;
+
+  return connector;
+}
+
+enum ConnectState tickConnecting(
+  Connector *connector, Client *c, GloState *game) {
+  if (connector->state == CS_RESOLVING &&
+      atomic_load(&connector->resolver->isDone)) {
+    finishResolving(connector, c);
+  }
+
+  receiveConnectPackets(connector, c, game);
+
+  float currentTime = getTime();
+
+  if (connector->state == CS_BROWSING && currentTime >= connector->browseEnd) {
+    finishBrowsing(connector, c);
+  }
+
+  if (connector->state == CS_DISCOVERING &&
+      currentTime >= connector->nextSendTime) {
+    sendDiscover(c, connector->cookie, connector->serverAddress == 0);
+    connector->attempts++;
+    connector->nextSendTime = currentTime + connector->retryInterval;
+    connector->retryInterval = MIN(
+      connector->retryInterval * 2.0f, CONNECT_MAX_RETRY_INTERVAL);
+  }
+
+  if (connector->state != CS_CONNECTED && connector->state != CS_FAILED &&
+      currentTime - connector->startTime >= connector->timeout) {
+    char reason[sizeof(connector->failure)];
+    snprintf(
+      reason, sizeof(reason), "No answer after %.1fs", connector->timeout);
+    failConnecting(connector, reason);
+  }
+
+  return connector->state;
+}
+
+void getConnectingStatus(
+  const Connector *connector, char *status, size_t size) {
+  float elapsed = getTime() - connector->startTime;
+
+  switch (connector->state) {
+  case CS_RESOLVING: {
+    snprintf(status, size, "resolving %s...", connector->names);
+    break;
+  }
+
+  case CS_BROWSING: {
+    snprintf(
+      status, size, "looking for servers (%d answered)...",
+      connector->serverCount);
+    break;
+  }
+
+  case CS_DISCOVERING: {
+    if (connector->serverAddress == 0) {
+      snprintf(
+        status, size, "connecting on the LAN (try %d, %.0fs)...",
+        connector->attempts, elapsed);
+    }
+    else {
+      struct in_addr address = {.s_addr = connector->serverAddress};
+      snprintf(
+        status, size, "connecting to %s (try %d, %.0fs)...",
+        inet_ntoa(address), connector->attempts, elapsed);
+    }
+    break;
+  }
+
+  case CS_CONNECTED: {
+    snprintf(status, size, "connected");
+    break;
+  }
+
+  case CS_FAILED: {
+    snprintf(status, size, "%s", connector->failure);
+    break;
+  }
+  }
+}
+
+void endConnecting(Connector *connector) {
+  /* The lookup may still be going, it frees the resolver then */
+  if (connector->resolver) {
+    releaseResolver(connector->resolver);
+  }
+
+  free(connector);
+}
+
+void pushGameCommands(
+  Client *c, const GameCommands *commands, const Player *predicted) {
+  NetThread *thread = c->netThread;
+
+  if (!thread) {
+    return;
+  }
+
+  /* Full means the thread is a whole history of commands behind: the
+     command is lost, without using up a sequence */
+  ClientCommand *command = (ClientCommand *)reserveSpscSlot(thread->commands);
+
+  if (command) {
+    c->commandSequence++;
+    c->buffers->commandHistory[c->commandSequence % MAX_INPUT_COMMANDS] =
+      *commands;
+
+    command->commands = *commands;
+    command->sequence = c->commandSequence;
+    command->predictedPosition = predicted->position;
+    command->predictedOrientation = predicted->orientation;
+    command->predictedSpeed = predicted->speed;
+    commitSpscSlot(thread->commands);
+
+    /* A full pipe already has a wake up in it */
+    char wake = 0;
+    write(thread->wakeFds[1], &wake, 1);
+  }
+}
+
+int getReplayCommands(Client *c, GameCommands commands[MAX_INPUT_COMMANDS]) {
+  if (!c->flags.needsReplay) {
+    return 0;
+  }
+
+  c->flags.needsReplay = 0;
+
+  /* Older than the history goes back: the next check corrects us again */
+  uint32_t count = MIN(
+    c->commandSequence - c->simulatedSequence, MAX_INPUT_COMMANDS);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t sequence = c->commandSequence - count + 1 + i;
+    commands[i] = c->buffers->commandHistory[sequence % MAX_INPUT_COMMANDS];
+  }
+
+  return (int)count;
+}
+
+void tickClient(Client *c, GloState *game) {
+  NetThread *thread = c->netThread;
+
+  if (!thread) {
+    return;
+  }
+
+  ClientSnapshot *snapshot;
+  while ((snapshot = (ClientSnapshot *)peekSpscSlot(thread->snapshots))) {
+    c->timeSync = snapshot->timeSync;
+    c->snapshotInterval = snapshot->snapshotInterval;
+    c->stats = snapshot->stats;
+
+    applySnapshot(c, game, &snapshot->wire);
+    releaseSpscSlot(thread->snapshots);
+  }
+
+  c->flags.isConnected = atomic_load_explicit(
+    &thread->isConnected, memory_order_acquire);
+}
+
+/*****************************************************************************/
+/*                               Network thread                              */
+/*****************************************************************************/
+/* Everything which comes in from the server is handled here as soon as it
+   arrives: snapshots get decoded and queued for the main thread, with the
+   clock and the stats as they are after them */
+static void receiveFromServer(NetThread *thread, PacketBuffer *packet) {
+  Client *c = &thread->client;
+
+  /* Receive all the packets the server sent */
+  while (true) {
+    struct sockaddr_in addr = {};
+    int size = receivePacket(c->mainSocket, packet, &addr);
+
+    if (size <= 0) {
+      break;
+    }
+
+    if (addr.sin_addr.s_addr == c->serverAddr) {
+      PacketHeader header = {};
+      deserializePacketHeader(packet, &header);
+
+      c->lastReceiveTime = getTime();
+      countPacketIn(&c->stats, packet->size);
+
+      switch (header.packetType) {
+      case PT_SNAPSHOT: {
+        /* A full ring means the main thread is stalled. Snapshots after
+           this one carry the same players and repeat its events */
+        ClientSnapshot *snapshot =
+          (ClientSnapshot *)reserveSpscSlot(thread->snapshots);
+        SnapshotWire *wire = snapshot ? &snapshot->wire : &thread->dropped;
+
+        if (receiveSnapshot(packet, c, wire) && snapshot) {
+          snapshot->timeSync = c->timeSync;
+          snapshot->snapshotInterval = c->snapshotInterval;
+          snapshot->stats = c->stats;
+          commitSpscSlot(thread->snapshots);
+        }
+      } break;
+
+      case PT_KEEPALIVE: {
+        /* The server hasn't heard from us in a while */
+        sendHeaderToServer(c, PT_KEEPALIVE);
+      } break;
+
+        /* Other stuff... */
       }
     }
   }
 }
 
+static void sendCommands(Client *c, PacketBuffer *packet, float currentTime) {
+  c->lastCommandsSend = currentTime;
+
+  resetPacketBuffer(packet);
+  serializePacketHeader(packet, c, PT_COMMANDS);
+
+  /* Flush all the commands in the command stack and send the packet */
+  serializeCommands(packet, c);
+  if (!atomic_load_explicit(&gSimulatePacketLoss, memory_order_relaxed)) {
+    sendPacketToServer(c, packet);
+  }
+  else {
+    printf("PACKET LOSS\n");
+  }
+
+  c->lastSendTime = currentTime;
+}
+
+/* Moves the commands the main thread pushed onto the command stack.
+   Returns whether there were any. A full stack gets sent first (packet is
+   used for that), so that sequences stay in step with the commands */
+static bool takeCommands(NetThread *thread, PacketBuffer *packet) {
+  Client *c = &thread->client;
+  ClientCommand *command;
+  bool hasCommands = false;
+
+  while ((command = (ClientCommand *)peekSpscSlot(thread->commands))) {
+    if (c->commandCount == MAX_COMMANDS) {
+      sendCommands(c, packet, getTime());
+    }
+
+    c->buffers->commandStack[c->commandCount++] = command->commands;
+
+    /* Where the player is predicted to be after the newest command */
+    c->commandSequence = command->sequence;
+    c->predicted.position = command->predictedPosition;
+    c->predicted.orientation = command->predictedOrientation;
+    c->predicted.speed = command->predictedSpeed;
+
+    releaseSpscSlot(thread->commands);
+    hasCommands = true;
+  }
+
+  return hasCommands;
+}
+
+/* Sleeps in poll until the server sends something, the main thread pushes
+   commands (or asks us to stop) or a commands packet is due anyway. New
+   commands go out right away, without waiting for a frame */
+static void *runNetThread(void *data) {
+  NetThread *thread = (NetThread *)data;
+  Client *c = &thread->client;
+  PacketBuffer *packet = acquirePacketBuffer(c->packetPool);
+
+  while (atomic_load_explicit(&thread->isRunning, memory_order_acquire)) {
+    float untilCommands =
+      COMMANDS_PACKET_INTERVAL - (getTime() - c->lastCommandsSend);
+    int timeout = MAX(0, (int)(untilCommands * 1000.0f) + 1);
+
+    struct pollfd fds[2] = {
+      {.fd = c->mainSocket, .events = POLLIN},
+      {.fd = thread->wakeFds[0], .events = POLLIN}
+    };
+    poll(fds, 2, timeout);
+
+    char wakes[64];
+    while (read(thread->wakeFds[0], wakes, sizeof(wakes)) > 0);
+
+    receiveFromServer(thread, packet);
+    bool hasCommands = takeCommands(thread, packet);
+
+    float currentTime = getTime();
+
+    c->stats.rtt = c->timeSync.rtt;
+    updateNetStats(&c->stats, currentTime);
+
+    if (currentTime - c->lastReceiveTime > CLIENT_TIMEOUT) {
+      printf("Lost connection to server!\n");
+      c->flags.isConnected = 0;
+      atomic_store_explicit(&thread->isConnected, false, memory_order_release);
+      break;
+    }
+
+    if (hasCommands ||
+        currentTime - c->lastCommandsSend > COMMANDS_PACKET_INTERVAL) {
+      sendCommands(c, packet, currentTime);
+    }
+
+    if (currentTime - c->lastSendTime > KEEPALIVE_INTERVAL) {
+      sendHeaderToServer(c, PT_KEEPALIVE);
+    }
+  }
+
+  releasePacketBuffer(c->packetPool, packet);
+
+  return NULL;
+}
+
+void startNetThread(Client *c) {
+  if (!c->flags.isConnected || c->netThread) {
+    return;
+  }
+
+  NetThread *thread = (NetThread *)aligned_alloc(
+    CACHE_LINE_SIZE, sizeof(NetThread));
+  memset(thread, 0, sizeof(NetThread));
+
+  /* The thread's copy has its own command stack, ours keeps the history
+     of what got predicted */
+  thread->client = *c;
+  thread->client.buffers = (ClientBuffers *)calloc(1, sizeof(ClientBuffers));
+
+  thread->snapshots = createSpscRing(
+    NET_THREAD_SNAPSHOTS, sizeof(ClientSnapshot));
+  thread->commands = createSpscRing(
+    NET_THREAD_COMMANDS, sizeof(ClientCommand));
+
+  if (pipe(thread->wakeFds) < 0) {
+    fprintf(stderr, "Failed to create the network thread's pipe: %d\n", errno);
+    exit(-1);
+  }
+
+  setSocketBlockingState(thread->wakeFds[0], 0);
+  setSocketBlockingState(thread->wakeFds[1], 0);
+
+  atomic_init(&thread->isRunning, true);
+  atomic_init(&thread->isConnected, true);
+
+  if (pthread_create(&thread->thread, NULL, runNetThread, thread)) {
+    fprintf(stderr, "Failed to start the network thread\n");
+    exit(-1);
+  }
+
+  c->netThread = thread;
+}
+
+static void stopNetThread(Client *c) {
+  NetThread *thread = c->netThread;
+
+  if (!thread) {
+    return;
+  }
+
+  atomic_store_explicit(&thread->isRunning, false, memory_order_release);
+  char wake = 0;
+  write(thread->wakeFds[1], &wake, 1);
+  pthread_join(thread->thread, NULL);
+
+  close(thread->wakeFds[0]);
+  close(thread->wakeFds[1]);
+  destroySpscRing(thread->snapshots);
+  destroySpscRing(thread->commands);
+  free(thread->client.buffers);
+  free(thread);
+
+  c->netThread = NULL;
+}
+
 void disconnectFromServer(Client *c) {
-  uint32_t msgSize = 0;
-  PacketHeader header = {.packetType = PT_DISCONNECT, .clientID = c->id};
-  serializeUint32(header.bytes, msgBuffer, &msgSize);
+  /* The socket is ours again */
+  stopNetThread(c);
+
   /* And we're done! */
-  sendPacketToServer(c, msgBuffer, msgSize);
+  sendHeaderToServer(c, PT_DISCONNECT);
 }
 
 void destroyClient(Client *c) {
-  
+  stopNetThread(c);
+  destroyPacketPool(c->packetPool);
+  free(c->buffers);
+}
+
+/*****************************************************************************/
+/*                             Admission control                             */
+/*****************************************************************************/
+static uint32_t hashWords(const uint32_t *words, int count) {
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  const uint8_t *bytes = (const uint8_t *)words;
+  for (int i = 0; i < count * sizeof(uint32_t); ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/* Cookies are only as good as the key is unguessable: no key, no server */
+static void createChallengeKey(uint64_t key[2]) {
+  size_t read = 0;
+
+  FILE *random = fopen("/dev/urandom", "rb");
+  if (random) {
+    read = fread(key, sizeof(uint64_t), 2, random);
+    fclose(random);
+  }
+
+  if (read != 2) {
+    fprintf(stderr, "Failed to read a challenge key from /dev/urandom\n");
+    exit(-1);
+  }
+}
+
+#define SIP_ROTATE(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static void sipRound(uint64_t v[4]) {
+  v[0] += v[1]; v[1] = SIP_ROTATE(v[1], 13); v[1] ^= v[0];
+  v[0] = SIP_ROTATE(v[0], 32);
+  v[2] += v[3]; v[3] = SIP_ROTATE(v[3], 16); v[3] ^= v[2];
+  v[0] += v[3]; v[3] = SIP_ROTATE(v[3], 21); v[3] ^= v[0];
+  v[2] += v[1]; v[1] = SIP_ROTATE(v[1], 17); v[1] ^= v[2];
+  v[2] = SIP_ROTATE(v[2], 32);
+}
+
+/* SipHash-2-4: a keyed hash which can't be inverted or forged without the
+   key, short inputs are what it's made for */
+static uint64_t sipHash(const uint64_t key[2], const uint8_t *bytes, int size) {
+  uint64_t v[4] = {
+    key[0] ^ 0x736f6d6570736575ull, key[1] ^ 0x646f72616e646f6dull,
+    key[0] ^ 0x6c7967656e657261ull, key[1] ^ 0x7465646279746573ull
+  };
+
+  /* Whole little endian words, then the tail with the size on top */
+  int end = size - size % 8;
+  for (int i = 0; i < end; i += 8) {
+    uint64_t m = 0;
+    for (int j = 0; j < 8; ++j) {
+      m |= (uint64_t)bytes[i + j] << (8 * j);
+    }
+
+    v[3] ^= m;
+    sipRound(v);
+    sipRound(v);
+    v[0] ^= m;
+  }
+
+  uint64_t m = (uint64_t)size << 56;
+  for (int j = 0; j < size % 8; ++j) {
+    m |= (uint64_t)bytes[end + j] << (8 * j);
+  }
+
+  v[3] ^= m;
+  sipRound(v);
+  sipRound(v);
+  v[0] ^= m;
+
+  v[2] ^= 0xff;
+  for (int i = 0; i < 4; ++i) {
+    sipRound(v);
+  }
+
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/* Stateless: the cookie can be checked again without having stored it.
+   Never 0 as that means "no cookie" */
+static uint32_t makeChallengeCookie(
+  const Server *s, uint32_t address, uint16_t port, uint32_t epoch) {
+  uint8_t bytes[10];
+  memcpy(&bytes[0], &address, sizeof(address));
+  memcpy(&bytes[4], &port, sizeof(port));
+  memcpy(&bytes[6], &epoch, sizeof(epoch));
+
+  return (uint32_t)sipHash(s->challengeKey, bytes, sizeof(bytes)) | 1;
+}
+
+static bool checkChallengeCookie(
+  const Server *s, uint32_t address, uint16_t port, uint32_t cookie) {
+  uint32_t epoch = (uint32_t)(getTime() / CHALLENGE_LIFETIME);
+
+  /* Accept the previous epoch too so cookies don't die on a boundary */
+  return cookie == makeChallengeCookie(s, address, port, epoch) ||
+    cookie == makeChallengeCookie(s, address, port, epoch - 1);
+}
+
+/* Token bucket per source address. Returns false if the packet has to be
+   dropped */
+static bool admitSource(Server *s, uint32_t address) {
+  float currentTime = getTime();
+
+  uint32_t start = hashWords(&address, 1) % MAX_SOURCE_BUCKETS;
+  SourceBucket *bucket = NULL, *oldest = NULL;
+
+  for (int i = 0; i < SOURCE_BUCKET_PROBES; ++i) {
+    SourceBucket *current = &s->sourceBuckets[(start + i) % MAX_SOURCE_BUCKETS];
+
+    if (current->address == address) {
+      bucket = current;
+      break;
+    }
+
+    if (!oldest || current->lastRefill < oldest->lastRefill) {
+      oldest = current;
+    }
+  }
+
+  if (!bucket) {
+    /* Take over the bucket of whoever we heard from least recently */
+    bucket = oldest;
+    bucket->address = address;
+    bucket->tokens = SOURCE_PACKET_BURST;
+    bucket->lastRefill = currentTime;
+  }
+
+  bucket->tokens = MIN(
+    SOURCE_PACKET_BURST,
+    bucket->tokens + (currentTime - bucket->lastRefill) * SOURCE_PACKET_RATE);
+  bucket->lastRefill = currentTime;
+
+  if (bucket->tokens < 1.0f) {
+    s->droppedPackets++;
+    return false;
+  }
+
+  bucket->tokens -= 1.0f;
+  return true;
+}
+
+/* For the challenge and server full replies: never bigger than the
+   discover packet so they can't be used for amplification */
+static void sendControlPacket(
+  Server *s, struct sockaddr_in *addr, int packetType, uint32_t cookie) {
+  PacketBuffer *packet = acquirePacketBuffer(s->packetPool);
+
+  PacketHeader header = {.packetType = packetType};
+  serializeUint32(header.bytes, packet);
+
+  if (packetType == PT_CHALLENGE) {
+    ChallengeWire wire = {.cookie = cookie};
+    encodeChallengeWire(packet, &wire);
+  }
+
+  sendServerPacket(s, addr, packet);
+  releasePacketBuffer(s->packetPool, packet);
 }
 
 /*****************************************************************************/
@@ -699,10 +1965,49 @@ static int addClient(Server *server) {
   setBit(&server->clientOccupation, clientIdx, 1);
 
   memset(client, 0, sizeof(Client));
+  client->buffers = &server->clientBuffers[clientIdx];
 
   return clientIdx;
 }
 
+/* Index of the client sending from this address/port, -1 if none */
+static int findClient(Server *server, uint32_t address, uint16_t port) {
+  for (int i = 0; i < server->clientCount; ++i) {
+    Client *c = &server->clients[i];
+
+    if (c->id != INVALID_CLIENT_ID &&
+        c->clientAddr == address && c->clientPort == port) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* The client a packet claims to come from, if the sender really is it */
+static Client *getSendingClient(
+  Server *server, PacketHeader header, struct sockaddr_in *addr) {
+  int id = header.clientID;
+
+  if (id >= MAX_PLAYER_COUNT || !getBit(&server->clientOccupation, id)) {
+    return NULL;
+  }
+
+  Client *c = &server->clients[id];
+  if (c->id != id ||
+      c->clientAddr != addr->sin_addr.s_addr ||
+      c->clientPort != ntohs(addr->sin_port)) {
+    return NULL;
+  }
+
+  return c;
+}
+
+static bool isServerFull(Server *server) {
+  return server->freeClientCount == 0 &&
+    server->clientCount == MAX_PLAYER_COUNT;
+}
+
 static void freeClient(Server *server, int idx) {
   server->clients[idx].flags.isConnected = 0;
   server->clients[idx].id = INVALID_CLIENT_ID;
@@ -717,9 +2022,27 @@ static void freeClient(Server *server, int idx) {
   }
 }
 
-Server createServer() {
+ServerConfig defaultServerConfig() {
+  ServerConfig config = {
+    .minSnapshotInterval = MIN_SNAPSHOT_INTERVAL,
+    .maxSnapshotInterval = MAX_SNAPSHOT_INTERVAL,
+    .maxSnapshotBytesPerSecond = MAX_SNAPSHOT_BYTES_PER_SECOND,
+    .keepaliveInterval = KEEPALIVE_INTERVAL,
+    .clientTimeout = CLIENT_TIMEOUT,
+    .useIoUring = true,
+    .jobThreads = 0,
+    .metricsPort = METRICS_PORT,
+    .thumbnailInterval = 0.0f,
+    .thumbnailPath = "thumbnail.png"
+  };
+
+  return config;
+}
+
+Server createServer(const ServerConfig *config) {
   Server s = {
     .mainSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP),
+    .config = *config
   };
 
   if (s.mainSocket < 0) {
@@ -741,112 +2064,553 @@ Server createServer() {
   setSocketBlockingState(s.mainSocket, 0);
 
   s.clientOccupation = createBitvec(MAX_PLAYER_COUNT);
-  s.lastSnapshotSend = 0.0f;
+  createChallengeKey(s.challengeKey);
+  s.packetPool = createPacketPool(SERVER_PACKET_BUFFERS);
+  s.clientBuffers = (ClientBuffers *)calloc(
+    MAX_PLAYER_COUNT, sizeof(ClientBuffers));
+
+  if (config->useIoUring) {
+    s.ring = createUdpRing(s.mainSocket);
+  }
+
+  s.jobPool = createJobPool(config->jobThreads);
+  s.snapshotHeaders = (PacketBuffer *)calloc(
+    MAX_PLAYER_COUNT, sizeof(PacketBuffer));
+  printf("Spreading ticks over %d threads\n", getJobPoolThreads(s.jobPool));
+
+  /* Serialized on the first tick */
+  s.infoReplyTime = -INFO_REPLY_INTERVAL;
 
   return s;
 }
 
-static void sendSnapshotToClient(Server *s, Client *c, uint32_t size) {
-  uint32_t headerSize = sizeof(PacketHeader);
-  /* Just change the byte saying that prediction correction is needed */
-  serializeByte(
-    (unsigned char)c->flags.predictionError,
-    msgBuffer, &headerSize);
+void pushServerEvent(Server *s, ServerEvent event) {
+  event.sequence = ++s->eventSequence;
+
+  if (s->eventCount == MAX_SERVER_EVENTS) {
+    /* Drop the oldest */
+    s->eventStart = (s->eventStart + 1) % MAX_SERVER_EVENTS;
+    s->eventCount--;
+  }
+
+  s->events[(s->eventStart + s->eventCount++) % MAX_SERVER_EVENTS] = event;
+}
+
+/* Commands of this client to simulate this tick, normally one. None while
+   the queue fills up to the de-jitter depth, two when catching up on a
+   depth which turned out bigger than needed. Call once per tick */
+int popInputCommands(Client *c, InputCommand commands[2]) {
+  int count = 1;
+
+  /* If the queue never got low over a whole window, we're adding more
+     delay than the jitter needs */
+  c->inputWindowMin = MIN(c->inputWindowMin, c->inputCount);
+
+  if (++c->inputWindowTicks == INPUT_DEPTH_WINDOW) {
+    if (!c->isBufferingInput && c->inputWindowMin > 1 &&
+        c->inputDepth > INPUT_DEPTH_MIN) {
+      c->inputDepth--;
+      count = 2;
+    }
 
+    c->inputWindowTicks = 0;
+    c->inputWindowMin = MAX_INPUT_COMMANDS;
+  }
+
+  if (c->isBufferingInput) {
+    if (c->inputCount < c->inputDepth) {
+      return 0;
+    }
+
+    c->isBufferingInput = false;
+  }
+
+  if (!c->inputCount) {
+    /* Underrun - input comes in later than the depth allowed for */
+    c->inputUnderruns++;
+    c->inputDepth = MIN(c->inputDepth + INPUT_DEPTH_STEP, INPUT_DEPTH_MAX);
+    c->isBufferingInput = true;
+    return 0;
+  }
+
+  count = MIN(count, c->inputCount);
+
+  for (int i = 0; i < count; ++i) {
+    commands[i] = c->buffers->inputs[c->inputStart];
+    c->inputStart = (c->inputStart + 1) % MAX_INPUT_COMMANDS;
+    c->inputCount--;
+
+    c->simulatedSequence = commands[i].sequence;
+  }
+
+  return count;
+}
+
+static void expireServerEvents(Server *s, float currentTime) {
+  /* Long enough for the slowest client to get them twice */
+  float retention = 2.0f * s->config.maxSnapshotInterval;
+
+  while (s->eventCount &&
+         currentTime - s->events[s->eventStart].time > retention) {
+    s->eventStart = (s->eventStart + 1) % MAX_SERVER_EVENTS;
+    s->eventCount--;
+  }
+}
+
+static struct sockaddr_in getClientAddress(const Client *c) {
   struct sockaddr_in addr = {};
   addr.sin_family = AF_INET;
   addr.sin_port = htons(c->clientPort);
   addr.sin_addr.s_addr = c->clientAddr;
 
-  sendPacket(s->mainSocket, &addr, (char *)msgBuffer, size);
+  return addr;
+}
+
+static int sendPacketToClient(
+  Server *s, Client *c, const PacketBuffer *packet) {
+  struct sockaddr_in addr = getClientAddress(c);
+  return sendServerPacket(s, &addr, packet);
+}
+
+/* What only this client gets of a snapshot, sent in front of the body */
+static void encodeSnapshotHeader(Client *c, PacketBuffer *header) {
+  serializePacketHeader(header, c, PT_SNAPSHOT);
+
+  SnapshotHeaderWire wire = {
+    /* Whether prediction correction is needed */
+    .predictionError = c->flags.predictionError,
+
+    /* Number the client acks back for loss estimation */
+    .snapshotNumber = ++c->snapshotsSent,
+
+    /* The players are where this command left them */
+    .simulatedCommand = c->simulatedSequence,
+
+    /* How the client's commands are doing, for its debug overlay */
+    .commandLoss = (uint8_t)(c->stats.lossIn * 100.0f + 0.5f),
+    .inputQueue = (uint8_t)MIN(c->inputCount, UINT8_MAX),
+
+    /* Echo the last ping once and say how long we held on to it */
+    .pingEcho = c->pingTime,
+    .holdTime = getTime() - c->pingReceiveTime
+  };
+
+  c->pingTime = NO_PING;
+
+  encodeSnapshotHeaderWire(header, &wire);
+}
+
+static void sendSnapshotToClient(
+  Server *s, Client *c, const PacketBuffer *header, const PacketBuffer *body) {
+  struct sockaddr_in addr = getClientAddress(c);
+  if (sendServerPacketParts(s, &addr, header, body)) {
+    c->snapshotBytesSent += header->size + body->size;
+    countPacketOut(&c->stats, header->size + body->size);
+    c->stats.snapshots++;
+  }
+}
+
+static void updateClientStats(Client *c, float currentTime) {
+  /* Snapshot loss is measured from the acks */
+  c->stats.lossOut = c->snapshotLoss;
+  updateNetStats(&c->stats, currentTime);
+}
+
+typedef struct SnapshotJob {
+  Server *server;
+  const PacketBuffer *body;
+  float currentTime;
+} SnapshotJob;
+
+/* A client's part of a tick, on the job pool: its stats, and its
+   snapshot header if it is due one. Without io_uring the snapshot goes
+   out from here too (sendmsg doesn't mind being called from threads) */
+static void prepareClientTick(void *data, int index) {
+  SnapshotJob *job = (SnapshotJob *)data;
+  Server *s = job->server;
+  Client *c = &s->clients[index];
+  PacketBuffer *header = &s->snapshotHeaders[index];
+
+  resetPacketBuffer(header);
+
+  if (c->id == INVALID_CLIENT_ID) {
+    return;
+  }
+
+  updateClientStats(c, job->currentTime);
+
+  if (job->currentTime >= c->nextSnapshotTime) {
+    encodeSnapshotHeader(c, header);
+
+    /* Don't try to catch up if we fell behind */
+    c->nextSnapshotTime = MAX(
+      c->nextSnapshotTime + c->snapshotInterval, job->currentTime);
+
+    if (!s->ring) {
+      sendSnapshotToClient(s, c, header, job->body);
+      resetPacketBuffer(header);
+    }
+  }
+}
+
+/* What info queries get answered with, serialized ahead of time */
+static void refreshInfoReply(Server *s, float currentTime) {
+  PacketBuffer *packet = &s->infoReply;
+  resetPacketBuffer(packet);
+
+  PacketHeader header = {.packetType = PT_INFO};
+  serializeUint32(header.bytes, packet);
+
+  InfoWire wire = {
+    .capacity = MAX_PLAYER_COUNT,
+    .load = (uint8_t)clamp(s->simulationLoad * 100.0f, 0.0f, 255.0f)
+  };
+
+  for (int i = 0; i < s->clientCount; ++i) {
+    wire.playerCount += s->clients[i].id != INVALID_CLIENT_ID;
+  }
+
+  encodeInfoWire(packet, &wire);
+
+  s->infoReplyTime = currentTime;
+}
+
+/* Snapshot bodies go back to the pool once io_uring is done sending them */
+static void releaseSentBodies(Server *s) {
+  uint32_t kept = 0;
+
+  for (uint32_t i = 0; i < s->sentBodyCount; ++i) {
+    PacketBuffer *body = s->sentBodies[i];
+
+    if (s->ring && isUdpRingSending(s->ring, body)) {
+      s->sentBodies[kept++] = body;
+    }
+    else {
+      releasePacketBuffer(s->packetPool, body);
+    }
+  }
+
+  s->sentBodyCount = kept;
+}
+
+static void handleDiscover(
+  Server *server, GloState *game,
+  struct sockaddr_in *addr, PacketBuffer *packet) {
+  uint32_t address = addr->sin_addr.s_addr;
+  uint16_t port = ntohs(addr->sin_port);
+
+  if (!admitSource(server, address)) {
+    return;
+  }
+
+  if (!validateDiscoverWire(packet)) {
+    server->droppedPackets++;
+    return;
+  }
+
+  DiscoverWire discover;
+  decodeDiscoverWire(packet, &discover);
+  uint32_t cookie = discover.cookie;
+
+  /* A client retrying doesn't get another slot - just the connect again.
+     One which restarted (another session) would have its new commands
+     taken for repeats of the old ones, so its old slot goes away, but only
+     once it has answered a challenge like a new client */
+  int id = findClient(server, address, port);
+  bool isRestart = id != -1 && server->clients[id].session != discover.session;
+
+  if (id == -1 && isServerFull(server)) {
+    sendControlPacket(server, addr, PT_SERVER_FULL, 0);
+    server->fullRepliesSent++;
+    return;
+  }
+
+  if (id == -1 || isRestart) {
+    if (!checkChallengeCookie(server, address, port, cookie)) {
+      uint32_t epoch = (uint32_t)(getTime() / CHALLENGE_LIFETIME);
+      sendControlPacket(
+        server, addr, PT_CHALLENGE,
+        makeChallengeCookie(server, address, port, epoch));
+      server->challengesSent++;
+      return;
+    }
+  }
+
+  /* Connecting is the expensive part - the client retries if we skip it */
+  if (server->admissionsThisTick >= MAX_ADMISSIONS_PER_TICK) {
+    server->droppedPackets++;
+    return;
+  }
+
+  server->admissionsThisTick++;
+
+  if (isRestart) {
+    printf("Client restarted (%d) - dropped its old slot\n", (int)port);
+    evictClient(server, game, id);
+    id = -1;
+  }
+
+  Client *c = NULL;
+
+  if (id == -1) {
+    /* Create a new client and send a handshake back */
+    id = addClient(server);
+
+    /* Initialize client information */
+    c = &server->clients[id];
+    c->id = id;
+    c->clientAddr = address;
+    c->clientPort = port;
+    c->session = discover.session;
+    c->flags.isConnected = 1;
+
+    /* Start at the default rate, acks will tune it from there */
+    c->snapshotInterval = clamp(
+      SNAPSHOT_PACKET_INTERVAL,
+      server->config.minSnapshotInterval,
+      server->config.maxSnapshotInterval);
+
+    ServerEvent join = {
+      .time = getTime(), .type = ET_JOIN, .player = id
+    };
+    pushServerEvent(server, join);
+
+    /* Commands wait in the queue until there are enough of them */
+    c->inputDepth = INPUT_DEPTH_DEFAULT;
+    c->isBufferingInput = true;
+    c->inputWindowMin = MAX_INPUT_COMMANDS;
+
+    spawnPlayer(game, id);
+  }
+  else {
+    c = &server->clients[id];
+  }
+
+  c->pingTime = discover.pingTime;
+  c->pingReceiveTime = getTime();
+  c->lastReceiveTime = c->pingReceiveTime;
+
+  /* Create connect packet */
+  PacketBuffer *connect = acquirePacketBuffer(server->packetPool);
+  serializePacketHeader(connect, c, PT_CONNECT);
+  serializeConnect(connect, server, c, game);
+
+  /* Send back to client that just sent this message */
+  sendServerPacket(server, addr, connect);
+  releasePacketBuffer(server->packetPool, connect);
+
+  printf(
+    "Received discover packet (%d) - sent connection packet\n",
+    (int)c->clientPort);
+}
+
+/* Frees the slot, removes the player and tells everyone about it */
+void evictClient(Server *server, GloState *game, int id) {
+  ServerEvent disconnect = {
+    .time = getTime(), .type = ET_DISCONNECT, .player = id
+  };
+  pushServerEvent(server, disconnect);
+
+  game->players[id].flags.isInitialized = 0;
+  freeClient(server, id);
+}
+
+/* Pokes clients which went quiet and evicts the ones which stayed quiet */
+static void checkClientTimeouts(
+  Server *server, GloState *game, float currentTime) {
+  for (int i = 0; i < server->clientCount; ++i) {
+    Client *c = &server->clients[i];
+
+    if (c->id == INVALID_CLIENT_ID) {
+      continue;
+    }
+
+    float silence = currentTime - c->lastReceiveTime;
+
+    if (silence > server->config.clientTimeout) {
+      printf("Client %d timed out\n", c->id);
+      server->timeoutCount++;
+      evictClient(server, game, c->id);
+    }
+    else if (silence > server->config.keepaliveInterval &&
+             currentTime - c->lastKeepaliveSend >
+             server->config.keepaliveInterval) {
+      PacketBuffer *packet = acquirePacketBuffer(server->packetPool);
+      serializePacketHeader(packet, c, PT_KEEPALIVE);
+      if (sendPacketToClient(server, c, packet)) {
+        countPacketOut(&c->stats, packet->size);
+      }
+      releasePacketBuffer(server->packetPool, packet);
+
+      c->lastKeepaliveSend = currentTime;
+    }
+  }
 }
 
 void tickServer(Server *server, GloState *game) {
-  /* Send out the game state to all clients */
+  /* Send out the game state to the clients which are due a snapshot. The
+     snapshot is only serialized if at least one of them is */
   float currentTime = getTime();
-  if (currentTime - server->lastSnapshotSend >= SNAPSHOT_PACKET_INTERVAL) {
-    server->lastSnapshotSend = currentTime;
+  PacketBuffer *body = NULL;
 
-    uint32_t msgPtr = serializePacketHeader(&server->clients[0], PT_SNAPSHOT);
-    serializeSnapshot(server, game, &msgPtr);
+  for (int i = 0; i < server->clientCount; ++i) {
+    Client *c = &server->clients[i];
 
-    game->newTrailsCount = 0;
+    if (c->id != INVALID_CLIENT_ID && currentTime >= c->nextSnapshotTime) {
+      body = acquirePacketBuffer(server->packetPool);
+      serializeSnapshot(body, server, game);
+      server->lastSnapshotSize =
+        PACKET_MAX_SIZE(SnapshotHeaderWire) + body->size;
+      break;
+    }
+  }
 
+  /* Most passes of the loop have no snapshot to send, the pool is only
+     woken up when there is one */
+  if (body) {
+    SnapshotJob job = {
+      .server = server, .body = body, .currentTime = currentTime
+    };
+    parallelFor(
+      server->jobPool, server->clientCount, prepareClientTick, &job);
+  }
+  else {
     for (int i = 0; i < server->clientCount; ++i) {
-      Client *c = &server->clients[i];
+      if (server->clients[i].id != INVALID_CLIENT_ID) {
+        updateClientStats(&server->clients[i], currentTime);
+      }
+    }
+  }
 
-      if (c->id != INVALID_CLIENT_ID) {
-        /* Send out game state */
-        sendSnapshotToClient(server, c, msgPtr);
+  /* io_uring only takes sends from this thread */
+  if (server->ring && body) {
+    for (int i = 0; i < server->clientCount; ++i) {
+      if (server->snapshotHeaders[i].size) {
+        sendSnapshotToClient(
+          server, &server->clients[i], &server->snapshotHeaders[i], body);
       }
     }
+  }
 
-    server->newDisconnects = 0;
-    server->newClientCount = 0;
+  if (body) {
+    /* sendServerPacketParts leaves room for it if the ring is using it */
+    if (server->ring && isUdpRingSending(server->ring, body)) {
+      server->sentBodies[server->sentBodyCount++] = body;
+    }
+    else {
+      releasePacketBuffer(server->packetPool, body);
+    }
+  }
+
+  expireServerEvents(server, currentTime);
+  checkClientTimeouts(server, game, currentTime);
+
+  if (currentTime - server->infoReplyTime >= INFO_REPLY_INTERVAL) {
+    refreshInfoReply(server, currentTime);
+  }
+
+  /* Hand the sends so far to the kernel and pick up what came in since
+     last tick - a single syscall with io_uring */
+  if (server->ring) {
+    flushUdpRing(server->ring);
+    releaseSentBodies(server);
   }
 
   /* Receive packets from the clients */
-  for (int i = 0; i < MAX_PLAYER_COUNT; ++i) {
+  server->admissionsThisTick = 0;
+
+  PacketBuffer *packet = acquirePacketBuffer(server->packetPool);
+
+  for (int i = 0; i < MAX_PACKETS_PER_TICK; ++i) {
     struct sockaddr_in addr;
 
-    int32_t byteCount = receivePacket(
-      server->mainSocket, (char *)msgBuffer, MSG_BUFFER_SIZE, &addr);
+    int32_t byteCount = receiveServerPacket(server, packet, &addr);
 
     if (byteCount > 0) {
       PacketHeader header = {};
-      uint32_t msgCounter = deserializePacketHeader(&header);
+      deserializePacketHeader(packet, &header);
 
       switch (header.packetType) {
       case PT_DISCOVER: {
-        /* Create a new client and send a handshake back */
-        int id = addClient(server);
-
-        /* Initialize client information */
-        Client *c = &server->clients[id];
-        c->id = id;
-        c->clientAddr = addr.sin_addr.s_addr;
-        c->clientPort = ntohs(addr.sin_port);
-        c->flags.isConnected = 1;
-
-        server->newClientStack[server->newClientCount++] = (unsigned char)id;
-
-        /* Initialize predicted data */
-        Player *p = spawnPlayer(game, id);
-        c->predicted.position = p->position;
-        c->predicted.orientation = p->orientation;
-        c->predicted.speed = p->speed;
-
-        /* Create connect packet */
-        uint32_t msgPtr = serializePacketHeader(c, PT_CONNECT);
-        uint32_t size = serializeConnect(server, c, game, &msgPtr);
-
-        /* Send back to client that just sent this message */
-        sendPacket(server->mainSocket, &addr, (char *)msgBuffer, size);
-
-        printf(
-          "Received discover packet (%d) - sent connection packet\n",
-          (int)c->clientPort);
+        handleDiscover(server, game, &addr, packet);
+      } break;
+
+      case PT_INFO_QUERY: {
+        if (!admitSource(server, addr.sin_addr.s_addr)) {
+          break;
+        }
+
+        if (validateInfoQueryWire(packet)) {
+          sendServerPacket(server, &addr, &server->infoReply);
+          server->infoRepliesSent++;
+        }
+        else {
+          server->droppedPackets++;
+        }
       } break;
 
       case PT_COMMANDS: {
-        int clientID = header.clientID;
+        Client *c = getSendingClient(server, header, &addr);
 
-        uint32_t size = deserializeCommands(
-          &server->clients[clientID], &msgCounter);
+        if (!c) {
+          /* Unknown sender - only costs them tokens */
+          admitSource(server, addr.sin_addr.s_addr);
+        }
+        else if (deserializeCommands(packet, server, c)) {
+          c->lastReceiveTime = getTime();
+          countPacketIn(&c->stats, (uint32_t)byteCount);
+        }
+        else {
+          /* Malformed - none of it was applied */
+          server->droppedPackets++;
+        }
       } break;
 
       case PT_DISCONNECT: {
-        server->newDisconnectStack[server->newDisconnects++] = header.clientID;
-        freeClient(server, header.clientID);
+        Client *c = getSendingClient(server, header, &addr);
+
+        if (c) {
+          printf("Disconnected\n");
+          evictClient(server, game, c->id);
+        }
+        else {
+          admitSource(server, addr.sin_addr.s_addr);
+        }
+      } break;
+
+      case PT_KEEPALIVE: {
+        Client *c = getSendingClient(server, header, &addr);
+
+        if (c) {
+          c->lastReceiveTime = getTime();
+          countPacketIn(&c->stats, (uint32_t)byteCount);
+        }
+        else {
+          admitSource(server, addr.sin_addr.s_addr);
+        }
+      } break;
+
+      default: {
+        admitSource(server, addr.sin_addr.s_addr);
       } break;
       }
     }
   }
 
+  releasePacketBuffer(server->packetPool, packet);
+
   /* Sleep for 5 milliseconds */
   usleep(5);
 }
 
 void destroyServer(Server *s) {
+  if (s->ring) {
+    destroyUdpRing(s->ring);
+  }
+
   shutdown(s->mainSocket, SHUT_RDWR);
+  destroyJobPool(s->jobPool);
+  destroyPacketPool(s->packetPool);
+  free(s->snapshotHeaders);
+  free(s->clientBuffers);
 }
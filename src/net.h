@@ -1,27 +1,345 @@
 #ifndef _NET_H_
 #define _NET_H_
 
+#include <stddef.h>
+
 #include "glo.h"
+#include "jobs.h"
+#include "uring.h"
+#include "packet.h"
 
+/* Commands come at SIMULATION_RATE and go out as soon as they are pushed,
+   so a commands packet normally carries a frame's worth of them. The rest
+   is room for packets which couldn't be sent */
 #define MAX_COMMANDS 30
+/* Commands packets also carry this many of the commands sent before them
+   (18 ticks of input) so that lost packets don't lose any input */
+#define COMMAND_REDUNDANCY 18
+/* Shots in a commands packet - recoil keeps it far below this */
+#define MAX_COMMAND_SHOTS 4
+
+/* Server side input queue: commands are simulated one per tick, after
+   holding on to inputDepth of them to absorb arrival jitter. The depth
+   starts at a packet's worth plus two, grows on underruns and shrinks
+   when the queue never got low during a window of ticks */
+#define MAX_INPUT_COMMANDS 64
+#define INPUT_DEPTH_DEFAULT 8
+#define INPUT_DEPTH_MIN 2
+#define INPUT_DEPTH_MAX 30
+#define INPUT_DEPTH_STEP 2
+#define INPUT_DEPTH_WINDOW 60
 
-/* Time separating two command packets send */
+/* Server browser: replies are collected for BROWSE_TIME. A server's score
+   is its rtt plus these penalties (seconds) when full / using its whole
+   tick budget - the lowest score gets picked */
+#define BROWSE_TIME 0.25f
+#define MAX_BROWSED_SERVERS 16
+#define BROWSE_PLAYERS_PENALTY 0.05f
+#define BROWSE_LOAD_PENALTY 0.1f
+/* Connecting: discovers are sent again after CONNECT_RETRY_INTERVAL,
+   twice as long after each try up to CONNECT_MAX_RETRY_INTERVAL. Unless
+   told otherwise, the client gives up after CONNECT_TIMEOUT */
+#define CONNECT_RETRY_INTERVAL 0.1f
+#define CONNECT_MAX_RETRY_INTERVAL 1.0f
+#define CONNECT_TIMEOUT 10.0f
+/* The server re-serializes its info reply this often */
+#define INFO_REPLY_INTERVAL 1.0f
+
+/* Longest time between two commands packets (pings and acks go out even
+   without new commands) */
 #define COMMANDS_PACKET_INTERVAL 0.1f
 #define SNAPSHOT_PACKET_INTERVAL 0.15f
 #define MAIN_SOCKET_PORT_CLIENT 6000
 #define MAIN_SOCKET_PORT_SERVER 5999
 #define INVALID_CLIENT_ID 0x42
 
+/* Client network thread: snapshots it can have decoded ahead of the main
+   thread, and commands the main thread can push ahead of it */
+#define NET_THREAD_SNAPSHOTS 16
+#define NET_THREAD_COMMANDS MAX_INPUT_COMMANDS
+
+/* Packet buffers each side can have in use at the same time */
+#define CLIENT_PACKET_BUFFERS 4
+#define SERVER_PACKET_BUFFERS 12
+/* Snapshot bodies the server can keep around for io_uring to send from
+   (taken out of SERVER_PACKET_BUFFERS) */
+#define MAX_SENT_SNAPSHOT_BODIES 4
+
+/* Clock synchronization: number of ping samples the filter keeps around */
+#define TIME_SYNC_SAMPLES 8
+/* Round trips longer than this are never used to estimate the offset */
+#define TIME_SYNC_MAX_RTT 1.0f
+/* How fast the offset slews towards a new estimate (avoids sudden jumps) */
+#define TIME_SYNC_SLEW 0.2f
+/* Sentinel for "no ping to echo" */
+#define NO_PING (-1.0f)
+
+/* Snapshot rate control: defaults for the configurable bounds */
+#define MIN_SNAPSHOT_INTERVAL 0.05f
+#define MAX_SNAPSHOT_INTERVAL 0.3f
+#define MAX_SNAPSHOT_BYTES_PER_SECOND 32000
+/* Additive speed up per clean ack, multiplicative back off on loss */
+#define SNAPSHOT_INTERVAL_STEP 0.005f
+#define SNAPSHOT_INTERVAL_BACKOFF 1.5f
+/* Smoothed loss above which we back off / below which we speed up */
+#define SNAPSHOT_LOSS_BACKOFF 0.05f
+#define SNAPSHOT_LOSS_PROBE 0.01f
+/* Client side: how many snapshot intervals remote players are rendered
+   in the past */
+#define INTERPOLATION_DELAY_SNAPSHOTS 2.0f
+
+/* Joins, disconnects and trails are kept around on the server so that
+   clients on slow snapshot rates still get them */
+#define MAX_SERVER_EVENTS 128
+#define MAX_SNAPSHOT_EVENTS 32
+
+/* Admission control for discover packets and unknown senders: a token
+   bucket per source address and a cap on connects handled per tick */
+#define MAX_SOURCE_BUCKETS 64
+#define SOURCE_BUCKET_PROBES 8
+#define SOURCE_PACKET_RATE 4.0f
+#define SOURCE_PACKET_BURST 8.0f
+#define MAX_ADMISSIONS_PER_TICK 4
+/* Seconds a challenge cookie stays valid for (at least) */
+#define CHALLENGE_LIFETIME 5.0f
+/* Defaults for how long a peer can stay silent before we poke it with a
+   keepalive, and before it is considered gone */
+#define KEEPALIVE_INTERVAL 1.0f
+#define CLIENT_TIMEOUT 10.0f
+
+/* Upper bound on the packets read per server tick */
+#define MAX_PACKETS_PER_TICK 64
+
+/* Network quality: loss and rates are measured over windows this long,
+   rtt is smoothed with the same gain as the clock filter's and jitter is
+   the RFC 3550 interarrival jitter */
+#define NET_STATS_WINDOW 1.0f
+#define NET_STATS_RTT_GAIN 0.125f
+#define NET_STATS_JITTER_GAIN (1.0f / 16.0f)
+/* Local port of the server's metrics endpoint */
+#define METRICS_PORT 5998
+
+typedef struct SourceBucket {
+  uint32_t address;
+  float tokens;
+  float lastRefill;
+} SourceBucket;
+
+enum EventType {
+  ET_JOIN, ET_DISCONNECT, ET_TRAIL, ET_COUNT
+};
+
+typedef struct ServerEvent {
+  /* Increases by one with every event - clients skip what they've seen */
+  uint32_t sequence;
+
+  /* Server time at which it happened (start time for trails) */
+  float time;
+
+  uint8_t type;
+  /* Player that joined / left / shot */
+  uint8_t player;
+
+  /* Only for trails */
+  Vec2 wStart;
+  Vec2 wEnd;
+} ServerEvent;
+
+/* A command waiting on the server to be simulated */
+typedef struct InputCommand {
+  GameCommands commands;
+  uint32_t sequence;
+
+  /* The newest command of a packet comes with where the client predicted
+     it would be after it - checked once the server gets there too */
+  bool hasPrediction;
+  Vec2 predictedPosition;
+} InputCommand;
+
+/* A server which answered an info query */
+typedef struct ServerInfo {
+  uint32_t address;
+  float rtt;
+
+  uint32_t playerCount;
+  uint32_t capacity;
+
+  /* Share of the tick budget its simulation uses */
+  float load;
+} ServerInfo;
+
+typedef struct TimeSyncSample {
+  float offset;
+  float rtt;
+} TimeSyncSample;
+
+/* NTP-style estimate of the server clock relative to the local clock */
+typedef struct TimeSync {
+  /* serverTime = localTime + offset */
+  float offset;
+
+  /* Smoothed round trip time and lowest one in the sample window */
+  float rtt;
+  float minRtt;
+
+  uint32_t sampleCount;
+  uint32_t sampleHead;
+  TimeSyncSample samples[TIME_SYNC_SAMPLES];
+
+  uint8_t isSynced;
+} TimeSync;
+
+/* Numbers about a connection, for operators (server program) and the
+   debug overlay (client program) */
+typedef struct NetStats {
+  /* Round trip time and its jitter, seconds */
+  float rtt;
+  float jitter;
+
+  /* Receive time minus the sender's stamp. Off by the clock offset, which
+     cancels out between two of them */
+  float lastTransit;
+  bool hasTransit;
+
+  /* Share of the packets lost on their way to us / from us */
+  float lossIn;
+  float lossOut;
+
+  /* Totals since the connection was made */
+  uint64_t packetsIn;
+  uint64_t packetsOut;
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+
+  /* Snapshots sent (server program) or received (client program), and
+     predictions the server had to correct */
+  uint32_t snapshots;
+  uint32_t corrections;
+
+  /* Per second, over the last window */
+  float bytesInRate;
+  float bytesOutRate;
+  float snapshotRate;
+  float correctionRate;
+
+  /* When the window started and the totals back then */
+  float windowStart;
+  uint64_t windowBytesIn;
+  uint64_t windowBytesOut;
+  uint32_t windowSnapshots;
+  uint32_t windowCorrections;
+
+  /* Loss in: highest sequence number the other side stamped its packets
+     with, what it was when the window started and how many came since */
+  uint32_t highestSequence;
+  uint32_t windowSequence;
+  uint32_t windowReceived;
+
+  /* Used by the client program: commands queued on the server */
+  uint32_t inputQueue;
+} NetStats;
+
+/* The big per client arrays. They live out of Client so that the loops
+   over the clients don't drag them through the cache: only pushing,
+   sending, queuing and simulating commands touches them */
+typedef struct ClientBuffers {
+  union {
+    /* Client program */
+    struct {
+      GameCommands commandStack[MAX_COMMANDS];
+
+      /* Commands by sequence number, to replay the ones the server hadn't
+         simulated yet on top of a correction */
+      GameCommands commandHistory[MAX_INPUT_COMMANDS];
+
+      /* The last commands sent, oldest first */
+      GameCommands sentCommands[COMMAND_REDUNDANCY];
+    };
+
+    /* Server program: commands waiting to be simulated */
+    InputCommand inputs[MAX_INPUT_COMMANDS];
+  };
+} ClientBuffers;
+
+/* The client program's network thread (net.c) */
+typedef struct NetThread NetThread;
+/* The client program's connection attempt (net.c) */
+typedef struct Connector Connector;
+
+/* The first cache line has everything the server looks at for every
+   client every tick (see the static assert below). The rest is only read
+   when a packet comes in or goes out */
 typedef struct Client {
   /* Index into the clients array */
-  int id;
+  _Alignas(CACHE_LINE_SIZE) int id;
+
+  /* Used by the server program */
+  uint32_t clientAddr;
+
+  ClientBuffers *buffers;
+
+  /* Used by the server program */
+  uint16_t clientPort;
+
+  struct {
+    uint8_t isConnected: 1;
+    uint8_t predictionError: 1;
+    uint8_t needsReplay: 1;
+    uint8_t pad: 5;
+  } flags;
+
+  /* Time between two snapshots. The server adapts it per client, the
+     client measures it to know how far behind to interpolate */
+  float snapshotInterval;
+
+  /* Used by the server program: when the next snapshot is due */
+  float nextSnapshotTime;
+
+  /* Last time we heard from the other side (server or client, depending
+     on the program) and last keepalive we sent */
+  float lastReceiveTime;
+  float lastKeepaliveSend;
+
+  /* Used by the server program: commands waiting to be simulated, in
+     buffers->inputs */
+  uint32_t inputStart;
+  uint32_t inputCount;
+
+  /* De-jitter: commands to have queued before simulating any, whether we
+     are waiting for that many and the lowest the queue got lately */
+  uint32_t inputDepth;
+  bool isBufferingInput;
+  uint32_t inputWindowTicks;
+  uint32_t inputWindowMin;
+
+  /* Newest command the server simulated (server program), or the one a
+     correction from the server was made at (client program) */
+  uint32_t simulatedSequence;
 
   /* Used to receive world state and send commands (or vice-versa) */
   int mainSocket;
   uint16_t mainSocketPort;
 
+  /* Buffers to read and write packets with (client program only) */
+  PacketPool *packetPool;
+
+  /* Client program: owns the socket from startNetThread on */
+  NetThread *netThread;
+
+  /* Commands pushed but not sent yet, in buffers->commandStack */
   uint32_t commandCount;
-  GameCommands commandStack[MAX_COMMANDS];
+
+  /* Sequence number of the newest command pushed (client program) or
+     queued (server program) */
+  uint32_t commandSequence;
+
+  /* Ticks the queue ran dry, packets which didn't fit in it */
+  uint32_t inputUnderruns;
+  uint32_t inputOverruns;
+
+  /* Used by the client program: how many of buffers->sentCommands there
+     are */
+  uint32_t sentCommandCount;
 
   /* Predicted state after all the commands were executed */
   struct {
@@ -33,27 +351,109 @@ typedef struct Client {
   /* Used by the client program */
   uint32_t serverAddr;
 
-  /* Used by the server program */
-  uint32_t clientAddr;
-  uint16_t clientPort;
+  /* New for every run of the client program, so that the server can tell
+     a client which restarted on the same address and port from one which
+     is only retrying its DISCOVER */
+  uint32_t session;
 
-  /* Time we last sent a commands packet */
+  /* Time we last sent a commands packet, and anything at all */
   float lastCommandsSend;
+  float lastSendTime;
 
-  struct {
-    uint8_t isConnected: 1;
-    uint8_t predictionError: 1;
-    uint8_t pad: 6;
-  } flags;
+  /* Used by the client program: number of the last commands packet (the
+     server measures loss with it) */
+  uint32_t commandsPacketsSent;
+
+  /* Used by the client program to map server time onto the local clock */
+  TimeSync timeSync;
+
+  /* Used by the server program: last ping the client sent (client clock)
+     and when we received it (server clock) */
+  float pingTime;
+  float pingReceiveTime;
+
+  /* Used by the client program: acks for the server's rate control. Only
+     snapshots newer than lastSnapshotNumber count, the others (duplicated
+     or overtaken on the way) are dropped as stale */
+  uint32_t lastSnapshotNumber;
+  uint32_t snapshotsReceived;
+  uint32_t snapshotBytesReceived;
+  uint32_t staleSnapshots;
+  float lastSnapshotServerTime;
+
+  /* Highest event sequence applied so far */
+  uint32_t eventSequence;
+
+  /* Used by the server program: what we sent and what the client acked */
+  uint32_t snapshotsSent;
+  uint32_t snapshotBytesSent;
+  uint32_t ackedSnapshotNumber;
+  uint32_t ackedSnapshots;
+  uint32_t ackedBytes;
+  float lastAckTime;
+
+  /* Smoothed snapshot loss and estimated bandwidth (bytes per second) */
+  float snapshotLoss;
+  float bandwidth;
+
+  NetStats stats;
 } Client;
 
+_Static_assert(offsetof(Client, simulatedSequence) + sizeof(uint32_t) <=
+               CACHE_LINE_SIZE,
+               "Client fields used every tick have to fit in a cache line");
+
+typedef struct ServerConfig {
+  /* Bounds for the per client snapshot interval */
+  float minSnapshotInterval;
+  float maxSnapshotInterval;
+
+  /* Snapshot byte rate a single client is never sent more than */
+  uint32_t maxSnapshotBytesPerSecond;
+
+  /* Silence after which a client gets keepalives / gets evicted */
+  float keepaliveInterval;
+  float clientTimeout;
+
+  /* Whether to use the io_uring socket backend if it was built in */
+  bool useIoUring;
+
+  /* Threads the per client work of a tick is spread over, counting the
+     server's own, 0 for one per CPU */
+  int jobThreads;
+
+  /* Port of the metrics endpoint on 127.0.0.1, 0 for none */
+  uint16_t metricsPort;
+
+  /* How often to render the whole map to thumbnailPath (PNG, software
+     renderer), 0 for never */
+  float thumbnailInterval;
+  const char *thumbnailPath;
+} ServerConfig;
+
 typedef struct Server {
+  ServerConfig config;
+
+  /* Buffers to read and write packets with */
+  PacketPool *packetPool;
+
   /* Main socket through which the server will send and receive messages */
   int mainSocket;
 
+  /* io_uring backend for the main socket, NULL when it isn't in use */
+  UdpRing *ring;
+
+  /* Runs the per client parts of a tick (the game loop's too) */
+  JobPool *jobPool;
+
+  /* Snapshot header of each client, encoded on the job pool. Empty for
+     the clients which aren't due one */
+  PacketBuffer *snapshotHeaders;
+
   /* Keeps track of all the active clients */
   int clientCount;
   Client clients[MAX_PLAYER_COUNT];
+  ClientBuffers *clientBuffers;
 
   /* Keeps track of the indices at which clients have been freed from above */
   int freeClientCount;
@@ -64,18 +464,49 @@ typedef struct Server {
   /* Stack of free client indices */
   unsigned char freeClients[MAX_BULLET_TRAILS];
 
-  /* Stack of new client indices to send in the next snapshot */
-  uint32_t newClientCount;
-  unsigned char newClientStack[MAX_PLAYER_COUNT];
+  /* Ring of recent events, sent in every snapshot until they expire */
+  uint32_t eventSequence;
+  uint32_t eventStart;
+  uint32_t eventCount;
+  ServerEvent events[MAX_SERVER_EVENTS];
+
+  /* Size of the last serialized snapshot (for the byte budget) */
+  uint32_t lastSnapshotSize;
+
+  /* Answer to info queries, re-serialized every INFO_REPLY_INTERVAL so
+     that queries never touch the game state */
+  PacketBuffer infoReply;
+  float infoReplyTime;
+
+  /* Share of the tick budget the simulation uses (set by the game loop) */
+  float simulationLoad;
+
+  /* Snapshot bodies io_uring still sends from, released once it's done */
+  uint32_t sentBodyCount;
+  PacketBuffer *sentBodies[MAX_SENT_SNAPSHOT_BODIES];
 
-  uint32_t newDisconnects;
-  unsigned char newDisconnectStack[MAX_PLAYER_COUNT];
+  /* Admission control */
+  /* SipHash key the challenge cookies are made with */
+  uint64_t challengeKey[2];
+  uint32_t admissionsThisTick;
+  SourceBucket sourceBuckets[MAX_SOURCE_BUCKETS];
 
-  float lastSnapshotSend;
+  uint32_t droppedPackets;
+  uint32_t challengesSent;
+  uint32_t fullRepliesSent;
+  uint32_t infoRepliesSent;
+
+  /* Clients evicted because they went silent */
+  uint32_t timeoutCount;
 } Server;
 
 enum PacketType {
-  PT_DISCOVER, PT_CONNECT, PT_COMMANDS, PT_SNAPSHOT, PT_DISCONNECT
+  PT_DISCOVER, PT_CONNECT, PT_COMMANDS, PT_SNAPSHOT, PT_DISCONNECT,
+  PT_CHALLENGE, PT_SERVER_FULL, PT_KEEPALIVE, PT_INFO_QUERY, PT_INFO
+};
+
+enum ConnectState {
+  CS_RESOLVING, CS_BROWSING, CS_DISCOVERING, CS_CONNECTED, CS_FAILED
 };
 
 /* For protocol, see the readme */
@@ -93,17 +524,49 @@ typedef union PacketHeader {
 /*                                   Client                                  */
 /*****************************************************************************/
 Client createClient(uint16_t mainPort);
-void waitForGameState(Client *c, GloState *game, const char *ip);
-void pushGameCommands(Client *c, const GameCommands *commands);
+
+/* Connecting without blocking: names are looked up on a thread of their
+   own, the rest happens in tickConnecting, which returns where it got to.
+   ip is one address, several separated by commas or empty for the LAN.
+   With several candidates, the best of those answering info queries gets
+   picked. Fails after timeout seconds without getting the game state */
+Connector *beginConnecting(Client *c, const char *ip, float timeout);
+enum ConnectState tickConnecting(
+  Connector *connector, Client *c, GloState *game);
+/* What it is doing (or why it failed), for the window title */
+void getConnectingStatus(
+  const Connector *connector, char *status, size_t size);
+void endConnecting(Connector *connector);
+
+/* Once connected: from then on the socket is read and written by a thread
+   of its own. It sends commands as soon as they are pushed, and decodes
+   snapshots as soon as they arrive, for tickClient to apply */
+void startNetThread(Client *c);
+/* predicted is the controlled player after the command, sent along with
+   the newest command for the server to check */
+void pushGameCommands(
+  Client *c, const GameCommands *commands, const Player *predicted);
+/* Applies the snapshots the network thread received since the last call */
 void tickClient(Client *c, GloState *game);
 void disconnectFromServer(Client *c);
+float getServerTime(const Client *c);
+float serverToLocalTime(const Client *c, float serverTime);
+float getInterpolationTime(const Client *c);
 void destroyClient(Client *);
 
 /*****************************************************************************/
 /*                                   Server                                  */
 /*****************************************************************************/
-Server createServer();
+ServerConfig defaultServerConfig();
+Server createServer(const ServerConfig *config);
+void pushServerEvent(Server *s, ServerEvent event);
 void tickServer(Server *s, GloState *game);
+void evictClient(Server *s, GloState *game, int id);
+int popInputCommands(Client *c, InputCommand commands[2]);
+
+/* After a correction: the commands to predict again, oldest first (client
+   program). Returns how many */
+int getReplayCommands(Client *c, GameCommands commands[MAX_INPUT_COMMANDS]);
 void destroyServer(Server *s);
 
 #endif
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "packet.h"
+
+/*****************************************************************************/
+/*                                    Pool                                   */
+/*****************************************************************************/
+PacketPool *createPacketPool(uint32_t bufferCount) {
+  PacketPool *pool = (PacketPool *)malloc(sizeof(PacketPool));
+  atomic_flag_clear(&pool->lock);
+
+  pool->bufferCount = bufferCount;
+  pool->freeCount = bufferCount;
+  pool->buffers = (PacketBuffer *)malloc(sizeof(PacketBuffer) * bufferCount);
+  pool->freeBuffers = (PacketBuffer **)malloc(
+    sizeof(PacketBuffer *) * bufferCount);
+
+  for (int i = 0; i < bufferCount; ++i) {
+    pool->freeBuffers[i] = &pool->buffers[i];
+  }
+
+  return pool;
+}
+
+void destroyPacketPool(PacketPool *pool) {
+  free(pool->freeBuffers);
+  free(pool->buffers);
+  free(pool);
+}
+
+static void lockPool(PacketPool *pool) {
+  while (atomic_flag_test_and_set_explicit(&pool->lock, memory_order_acquire));
+}
+
+static void unlockPool(PacketPool *pool) {
+  atomic_flag_clear_explicit(&pool->lock, memory_order_release);
+}
+
+PacketBuffer *acquirePacketBuffer(PacketPool *pool) {
+  PacketBuffer *buffer = NULL;
+
+  lockPool(pool);
+  if (pool->freeCount) {
+    buffer = pool->freeBuffers[--pool->freeCount];
+  }
+  unlockPool(pool);
+
+  /* Pools are sized for the most buffers ever held at once, so this is a
+     buffer which never got released */
+  if (!buffer) {
+    fprintf(stderr, "Packet pool ran out of its %u buffers\n",
+            pool->bufferCount);
+    exit(-1);
+  }
+
+  resetPacketBuffer(buffer);
+
+  return buffer;
+}
+
+void releasePacketBuffer(PacketPool *pool, PacketBuffer *buffer) {
+  bool isOverflowing;
+
+  lockPool(pool);
+  isOverflowing = pool->freeCount == pool->bufferCount;
+  if (!isOverflowing) {
+    pool->freeBuffers[pool->freeCount++] = buffer;
+  }
+  unlockPool(pool);
+
+  if (isOverflowing) {
+    fprintf(stderr, "Packet buffer released twice (pool of %u)\n",
+            pool->bufferCount);
+    exit(-1);
+  }
+}
+
+void resetPacketBuffer(PacketBuffer *buffer) {
+  buffer->size = 0;
+  buffer->cursor = 0;
+  buffer->failed = false;
+}
+
+/*****************************************************************************/
+/*                               Serialization                               */
+/*****************************************************************************/
+/* Returns where to write count bytes, NULL if they don't fit */
+static uint8_t *reserveWrite(PacketBuffer *buffer, uint32_t count) {
+  if (buffer->size + count > PACKET_BUFFER_SIZE) {
+    buffer->failed = true;
+    return NULL;
+  }
+
+  uint8_t *dst = &buffer->data[buffer->size];
+  buffer->size += count;
+  return dst;
+}
+
+/* Returns where to read count bytes from, NULL if there aren't enough */
+static const uint8_t *reserveRead(PacketBuffer *buffer, uint32_t count) {
+  if (buffer->cursor + count > buffer->size) {
+    buffer->failed = true;
+    return NULL;
+  }
+
+  const uint8_t *src = &buffer->data[buffer->cursor];
+  buffer->cursor += count;
+  return src;
+}
+
+void serializeByte(unsigned char b, PacketBuffer *buffer) {
+  uint8_t *dst = reserveWrite(buffer, 1);
+  if (dst) {
+    *dst = b;
+  }
+}
+
+unsigned char deserializeByte(PacketBuffer *buffer) {
+  const uint8_t *src = reserveRead(buffer, 1);
+  return src ? *src : 0;
+}
+
+void serializeUint16(uint16_t u16, PacketBuffer *buffer) {
+  uint8_t *dst = reserveWrite(buffer, 2);
+  if (dst) {
+    dst[0] = (uint8_t)u16;
+    dst[1] = (uint8_t)(u16 >> 8);
+  }
+}
+
+uint16_t deserializeUint16(PacketBuffer *buffer) {
+  const uint8_t *src = reserveRead(buffer, 2);
+  if (!src) {
+    return 0;
+  }
+
+  return (uint16_t)(src[0] | (src[1] << 8));
+}
+
+void serializeUint32(uint32_t u32, PacketBuffer *buffer) {
+  uint8_t *dst = reserveWrite(buffer, 4);
+  if (dst) {
+    /* Little endian on the wire, whatever the host is */
+    dst[0] = (uint8_t)u32;
+    dst[1] = (uint8_t)(u32 >> 8);
+    dst[2] = (uint8_t)(u32 >> 16);
+    dst[3] = (uint8_t)(u32 >> 24);
+  }
+}
+
+uint32_t deserializeUint32(PacketBuffer *buffer) {
+  const uint8_t *src = reserveRead(buffer, 4);
+  if (!src) {
+    return 0;
+  }
+
+  return (uint32_t)src[0] |
+    ((uint32_t)src[1] << 8) |
+    ((uint32_t)src[2] << 16) |
+    ((uint32_t)src[3] << 24);
+}
+
+void serializeFloat32(float f32, PacketBuffer *buffer) {
+  uint32_t u32;
+  memcpy(&u32, &f32, sizeof(u32));
+  serializeUint32(u32, buffer);
+}
+
+float deserializeFloat32(PacketBuffer *buffer) {
+  uint32_t u32 = deserializeUint32(buffer);
+  float f32;
+  memcpy(&f32, &u32, sizeof(f32));
+  return f32;
+}
+
+void serializeBytes(const uint8_t *bytes, uint32_t size, PacketBuffer *buffer) {
+  uint8_t *dst = reserveWrite(buffer, size);
+  if (dst) {
+    memcpy(dst, bytes, size);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Biggest datagram we ever send or accept - stays under a typical MTU */
+#define PACKET_BUFFER_SIZE 1400
+
+/* A datagram being written or read. Writes append at size, reads advance
+   cursor. Neither ever goes past the end of the data: if a write doesn't
+   fit or a read runs out of bytes, failed gets set instead */
+typedef struct PacketBuffer {
+  uint32_t size;
+  uint32_t cursor;
+  bool failed;
+
+  uint8_t data[PACKET_BUFFER_SIZE];
+} PacketBuffer;
+
+/* Fixed set of buffers which can be handed out from any thread */
+typedef struct PacketPool {
+  atomic_flag lock;
+
+  uint32_t bufferCount;
+  uint32_t freeCount;
+  PacketBuffer **freeBuffers;
+  PacketBuffer *buffers;
+} PacketPool;
+
+PacketPool *createPacketPool(uint32_t bufferCount);
+void destroyPacketPool(PacketPool *pool);
+/* Returns an empty buffer. Running out of them (or releasing more than
+   were acquired) is a bug and exits with a message */
+PacketBuffer *acquirePacketBuffer(PacketPool *pool);
+void releasePacketBuffer(PacketPool *pool, PacketBuffer *buffer);
+void resetPacketBuffer(PacketBuffer *buffer);
+
+/*****************************************************************************/
+/*                               Serialization                               */
+/*****************************************************************************/
+void serializeByte(unsigned char b, PacketBuffer *buffer);
+void serializeFloat32(float f32, PacketBuffer *buffer);
+void serializeUint16(uint16_t u16, PacketBuffer *buffer);
+void serializeUint32(uint32_t u32, PacketBuffer *buffer);
+void serializeBytes(const uint8_t *bytes, uint32_t size, PacketBuffer *buffer);
+
+unsigned char deserializeByte(PacketBuffer *buffer);
+float deserializeFloat32(PacketBuffer *buffer);
+uint16_t deserializeUint16(PacketBuffer *buffer);
+uint32_t deserializeUint32(PacketBuffer *buffer);
+
+#endif
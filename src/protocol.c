@@ -0,0 +1,199 @@
+#include <math.h>
+
+#include "math.h"
+#include "protocol.h"
+
+#define ANGLE_STEPS 65536.0f
+#define TAU 6.28318530718f
+
+/*****************************************************************************/
+/*                           Field kind validation                           */
+/*****************************************************************************/
+/* These only look at the bytes: cursor is advanced but the packet isn't
+   touched, so a packet can be validated and then decoded as usual */
+static bool peekBytes(
+  const PacketBuffer *packet, uint32_t *cursor, uint32_t count,
+  const uint8_t **bytes) {
+  if (*cursor + count > packet->size) {
+    return false;
+  }
+
+  *bytes = &packet->data[*cursor];
+  *cursor += count;
+  return true;
+}
+
+static bool peekByte(
+  const PacketBuffer *packet, uint32_t *cursor, uint8_t *value) {
+  const uint8_t *bytes;
+  if (!peekBytes(packet, cursor, 1, &bytes)) {
+    return false;
+  }
+
+  *value = bytes[0];
+  return true;
+}
+
+static bool peekUint32(
+  const PacketBuffer *packet, uint32_t *cursor, uint32_t *value) {
+  const uint8_t *bytes;
+  if (!peekBytes(packet, cursor, 4, &bytes)) {
+    return false;
+  }
+
+  *value = (uint32_t)bytes[0] |
+    ((uint32_t)bytes[1] << 8) |
+    ((uint32_t)bytes[2] << 16) |
+    ((uint32_t)bytes[3] << 24);
+  return true;
+}
+
+static bool checkByte(const PacketBuffer *packet, uint32_t *cursor) {
+  uint8_t value;
+  return peekByte(packet, cursor, &value);
+}
+
+static bool checkUint32(const PacketBuffer *packet, uint32_t *cursor) {
+  uint32_t value;
+  return peekUint32(packet, cursor, &value);
+}
+
+static bool checkFloat32(const PacketBuffer *packet, uint32_t *cursor) {
+  uint32_t bits;
+  /* All exponent bits set is either infinity or NaN */
+  return peekUint32(packet, cursor, &bits) &&
+    (bits & 0x7f800000) != 0x7f800000;
+}
+
+static bool checkPlayerID(const PacketBuffer *packet, uint32_t *cursor) {
+  uint8_t id;
+  return peekByte(packet, cursor, &id) && id < MAX_PLAYER_COUNT;
+}
+
+static bool checkPlayerSlot(const PacketBuffer *packet, uint32_t *cursor) {
+  uint8_t id;
+  return peekByte(packet, cursor, &id) &&
+    (id < MAX_PLAYER_COUNT || id == INVALID_CLIENT_ID);
+}
+
+static bool checkAngle(const PacketBuffer *packet, uint32_t *cursor) {
+  const uint8_t *bytes;
+  return peekBytes(packet, cursor, 2, &bytes);
+}
+
+static bool checkActions(const PacketBuffer *packet, uint32_t *cursor) {
+  /* Everything but the padding */
+  GameCommands defined = {};
+  defined.actions.bytes = ~0u;
+  defined.actions.pad = 0;
+
+  uint8_t actions;
+  return peekByte(packet, cursor, &actions) &&
+    (actions & ~defined.actions.bytes) == 0;
+}
+
+static bool checkEventType(const PacketBuffer *packet, uint32_t *cursor) {
+  uint8_t type;
+  return peekByte(packet, cursor, &type) && type < ET_COUNT;
+}
+
+static void serializeAngle(float radians, PacketBuffer *packet) {
+  float turns = radians / TAU;
+  turns -= floorf(turns);
+  /* Rounding up to a full turn wraps around to 0 */
+  serializeUint16((uint16_t)(uint32_t)(turns * ANGLE_STEPS + 0.5f), packet);
+}
+
+static float deserializeAngle(PacketBuffer *packet) {
+  return (float)deserializeUint16(packet) / ANGLE_STEPS * TAU;
+}
+
+/*****************************************************************************/
+/*                            Generated functions                            */
+/*****************************************************************************/
+#define WIRE_CHECK_U8 checkByte
+#define WIRE_CHECK_U32 checkUint32
+#define WIRE_CHECK_F32 checkFloat32
+#define WIRE_CHECK_ANGLE checkAngle
+#define WIRE_CHECK_ACTIONS checkActions
+#define WIRE_CHECK_PLAYER_ID checkPlayerID
+#define WIRE_CHECK_PLAYER_SLOT checkPlayerSlot
+#define WIRE_CHECK_EVENT_TYPE checkEventType
+
+#define WIRE_WRITE_U8 serializeByte
+#define WIRE_WRITE_U32 serializeUint32
+#define WIRE_WRITE_F32 serializeFloat32
+#define WIRE_WRITE_ANGLE serializeAngle
+#define WIRE_WRITE_ACTIONS serializeByte
+#define WIRE_WRITE_PLAYER_ID serializeByte
+#define WIRE_WRITE_PLAYER_SLOT serializeByte
+#define WIRE_WRITE_EVENT_TYPE serializeByte
+
+#define WIRE_READ_U8 deserializeByte
+#define WIRE_READ_U32 deserializeUint32
+#define WIRE_READ_F32 deserializeFloat32
+#define WIRE_READ_ANGLE deserializeAngle
+#define WIRE_READ_ACTIONS deserializeByte
+#define WIRE_READ_PLAYER_ID deserializeByte
+#define WIRE_READ_PLAYER_SLOT deserializeByte
+#define WIRE_READ_EVENT_TYPE deserializeByte
+
+#define ENCODE_SCALAR(kind, name) WIRE_WRITE_##kind(wire->name, packet);
+#define ENCODE_ARRAY(Element, name, max) {                      \
+    uint32_t count = MIN(wire->name##Count, (max));             \
+    serializeUint32(count, packet);                             \
+    for (uint32_t e = 0; e < count; ++e) {                      \
+      encode##Element(packet, &wire->name[e]);                  \
+    }                                                           \
+  }
+
+#define VALIDATE_SCALAR(kind, name)             \
+  if (!WIRE_CHECK_##kind(packet, cursor)) {     \
+    return false;                               \
+  }
+#define VALIDATE_ARRAY(Element, name, max) {                            \
+    uint32_t count;                                                     \
+    if (!peekUint32(packet, cursor, &count) || count > (max)) {         \
+      return false;                                                     \
+    }                                                                   \
+    for (uint32_t e = 0; e < count; ++e) {                              \
+      if (!validate##Element##Fields(packet, cursor)) {                 \
+        return false;                                                   \
+      }                                                                 \
+    }                                                                   \
+  }
+
+#define DECODE_SCALAR(kind, name) wire->name = WIRE_READ_##kind(packet);
+#define DECODE_ARRAY(Element, name, max) {                      \
+    uint32_t count = deserializeUint32(packet);                 \
+    wire->name##Count = MIN(count, (max));                      \
+    for (uint32_t e = 0; e < wire->name##Count; ++e) {          \
+      decode##Element(packet, &wire->name[e]);                  \
+    }                                                           \
+  }
+
+/* validateNameFields checks a Name in the middle of a packet, validateName
+   checks that the rest of the packet is a Name and nothing else */
+#define DEFINE_WIRE_SCHEMA(Name, FIELDS)                                \
+  void encode##Name(PacketBuffer *packet, const Name *wire) {           \
+    FIELDS(ENCODE_SCALAR, ENCODE_ARRAY)                                 \
+  }                                                                     \
+                                                                        \
+  static bool validate##Name##Fields(                                   \
+    const PacketBuffer *packet, uint32_t *cursor) {                     \
+    FIELDS(VALIDATE_SCALAR, VALIDATE_ARRAY)                             \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  bool validate##Name(const PacketBuffer *packet) {                     \
+    uint32_t cursor = packet->cursor;                                   \
+    return !packet->failed &&                                           \
+      validate##Name##Fields(packet, &cursor) &&                        \
+      cursor == packet->size;                                           \
+  }                                                                     \
+                                                                        \
+  void decode##Name(PacketBuffer *packet, Name *wire) {                 \
+    FIELDS(DECODE_SCALAR, DECODE_ARRAY)                                 \
+  }
+
+PROTOCOL_SCHEMAS(DEFINE_WIRE_SCHEMA)
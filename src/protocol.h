@@ -0,0 +1,209 @@
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdbool.h>
+
+#include "net.h"
+#include "packet.h"
+
+/*****************************************************************************/
+/*                                Field kinds                                */
+/*****************************************************************************/
+/* Every field of a packet has one of these kinds. A kind says what C type
+   the field has once decoded, how many bytes it takes on the wire and what
+   values are allowed (see validate* in protocol.c):
+
+   - U8, U32: anything goes
+   - F32: no NaNs or infinities
+   - ANGLE: radians, quantized to 16 bits (decodes to [0, 2pi))
+   - ACTIONS: the GameCommands action bits, nothing undefined set
+   - PLAYER_ID: index into the players array
+   - PLAYER_SLOT: same, or INVALID_CLIENT_ID for a free slot
+   - EVENT_TYPE: one of EventType */
+#define WIRE_TYPE_U8 uint8_t
+#define WIRE_TYPE_U32 uint32_t
+#define WIRE_TYPE_F32 float
+#define WIRE_TYPE_ANGLE float
+#define WIRE_TYPE_ACTIONS uint8_t
+#define WIRE_TYPE_PLAYER_ID uint8_t
+#define WIRE_TYPE_PLAYER_SLOT uint8_t
+#define WIRE_TYPE_EVENT_TYPE uint8_t
+
+#define WIRE_SIZE_U8 1
+#define WIRE_SIZE_U32 4
+#define WIRE_SIZE_F32 4
+#define WIRE_SIZE_ANGLE 2
+#define WIRE_SIZE_ACTIONS 1
+#define WIRE_SIZE_PLAYER_ID 1
+#define WIRE_SIZE_PLAYER_SLOT 1
+#define WIRE_SIZE_EVENT_TYPE 1
+
+/* Arrays are a count (4 bytes) followed by up to max elements */
+#define WIRE_SIZE_COUNT 4
+
+/*****************************************************************************/
+/*                                  Schemas                                  */
+/*****************************************************************************/
+/* Each schema lists its fields once as SCALAR(kind, name) or
+   ARRAY(ElementSchema, name, maxCount). Everything else (structs, encoder,
+   decoder, validator and max size) gets generated from these. Changing the
+   wire format means changing these lists and nothing else. */
+
+#define PLAYER_WIRE(SCALAR, ARRAY)              \
+  SCALAR(PLAYER_SLOT, id)                       \
+  SCALAR(F32, positionX)                        \
+  SCALAR(F32, positionY)                        \
+  SCALAR(F32, orientation)                      \
+  SCALAR(F32, speed)                            \
+  SCALAR(U32, health)
+
+#define EVENT_WIRE(SCALAR, ARRAY)               \
+  SCALAR(EVENT_TYPE, type)                      \
+  SCALAR(U32, sequence)                         \
+  SCALAR(PLAYER_ID, player)                     \
+  SCALAR(F32, startX)                           \
+  SCALAR(F32, startY)                           \
+  SCALAR(F32, endX)                             \
+  SCALAR(F32, endY)                             \
+  SCALAR(F32, time)
+
+/* Commands are all SIMULATION_DT long and their sequence numbers follow
+   from their position, so that a command is only 3 bytes. Shots are rare
+   and go separately, pointing at the command which shot */
+#define COMMAND_WIRE(SCALAR, ARRAY)             \
+  SCALAR(ACTIONS, actions)                      \
+  SCALAR(ANGLE, orientation)
+
+#define SHOT_WIRE(SCALAR, ARRAY)                \
+  SCALAR(U8, command)                           \
+  SCALAR(F32, targetX)                          \
+  SCALAR(F32, targetY)
+
+#define DISCOVER_WIRE(SCALAR, ARRAY)            \
+  SCALAR(F32, pingTime)                         \
+  SCALAR(U32, cookie)                           \
+  SCALAR(U32, session)
+
+#define CHALLENGE_WIRE(SCALAR, ARRAY)           \
+  SCALAR(U32, cookie)
+
+/* Server browser. The query is only padding: it has to be at least as big
+   as the reply so that spoofed queries amplify nothing */
+#define INFO_QUERY_WIRE(SCALAR, ARRAY)          \
+  SCALAR(U32, padding)
+
+/* load is the share of the tick budget the simulation uses, in percent */
+#define INFO_WIRE(SCALAR, ARRAY)                \
+  SCALAR(U8, playerCount)                       \
+  SCALAR(U8, capacity)                          \
+  SCALAR(U8, load)
+
+#define CONNECT_WIRE(SCALAR, ARRAY)             \
+  SCALAR(F32, pingEcho)                         \
+  SCALAR(F32, holdTime)                         \
+  SCALAR(F32, serverTime)                       \
+  SCALAR(PLAYER_ID, clientID)                   \
+  SCALAR(U32, eventSequence)                    \
+  ARRAY(PlayerWire, players, MAX_PLAYER_COUNT)
+
+#define COMMANDS_WIRE(SCALAR, ARRAY)            \
+  SCALAR(F32, pingTime)                         \
+  SCALAR(F32, serverTimestamp)                  \
+  SCALAR(U32, lastSnapshotNumber)               \
+  SCALAR(U32, snapshotsReceived)                \
+  SCALAR(U32, snapshotBytesReceived)            \
+  SCALAR(F32, predictedX)                       \
+  SCALAR(F32, predictedY)                       \
+  SCALAR(F32, predictedOrientation)             \
+  SCALAR(F32, predictedSpeed)                   \
+  SCALAR(U32, packetNumber)                     \
+  SCALAR(U32, newestCommand)                    \
+  ARRAY(CommandWire, commands, MAX_COMMANDS + COMMAND_REDUNDANCY) \
+  ARRAY(ShotWire, shots, MAX_COMMAND_SHOTS)
+
+/* The server writes the client specific part of a snapshot in front of a
+   body which is the same for everyone. Clients read them as one packet */
+#define SNAPSHOT_HEADER_WIRE(SCALAR, ARRAY)     \
+  SCALAR(U8, predictionError)                   \
+  SCALAR(U32, snapshotNumber)                   \
+  SCALAR(U32, simulatedCommand)                 \
+  SCALAR(U8, commandLoss)                       \
+  SCALAR(U8, inputQueue)                        \
+  SCALAR(F32, pingEcho)                         \
+  SCALAR(F32, holdTime)
+
+#define SNAPSHOT_BODY_WIRE(SCALAR, ARRAY)       \
+  SCALAR(F32, serverTime)                       \
+  ARRAY(EventWire, events, MAX_SNAPSHOT_EVENTS) \
+  ARRAY(PlayerWire, players, MAX_PLAYER_COUNT)
+
+#define SNAPSHOT_WIRE(SCALAR, ARRAY)            \
+  SNAPSHOT_HEADER_WIRE(SCALAR, ARRAY)           \
+  SNAPSHOT_BODY_WIRE(SCALAR, ARRAY)
+
+/* Elements have to come before the schemas with arrays of them */
+#define PROTOCOL_SCHEMAS(SCHEMA)                \
+  SCHEMA(PlayerWire, PLAYER_WIRE)               \
+  SCHEMA(EventWire, EVENT_WIRE)                 \
+  SCHEMA(CommandWire, COMMAND_WIRE)             \
+  SCHEMA(ShotWire, SHOT_WIRE)                   \
+  SCHEMA(DiscoverWire, DISCOVER_WIRE)           \
+  SCHEMA(ChallengeWire, CHALLENGE_WIRE)         \
+  SCHEMA(InfoQueryWire, INFO_QUERY_WIRE)        \
+  SCHEMA(InfoWire, INFO_WIRE)                   \
+  SCHEMA(ConnectWire, CONNECT_WIRE)             \
+  SCHEMA(CommandsWire, COMMANDS_WIRE)           \
+  SCHEMA(SnapshotHeaderWire, SNAPSHOT_HEADER_WIRE) \
+  SCHEMA(SnapshotBodyWire, SNAPSHOT_BODY_WIRE)  \
+  SCHEMA(SnapshotWire, SNAPSHOT_WIRE)
+
+/*****************************************************************************/
+/*                              Generated types                              */
+/*****************************************************************************/
+#define WIRE_STRUCT_SCALAR(kind, name) WIRE_TYPE_##kind name;
+#define WIRE_STRUCT_ARRAY(Element, name, max) \
+  uint32_t name##Count;                       \
+  Element name[max];
+
+#define WIRE_MAX_SIZE_SCALAR(kind, name) + WIRE_SIZE_##kind
+#define WIRE_MAX_SIZE_ARRAY(Element, name, max) \
+  + WIRE_SIZE_COUNT + (max) * Element##MaxSize
+
+/* For each schema Name: the decoded struct, NameMaxSize (biggest the
+   encoding can get) and the functions:
+
+   - encodeName: appends the fields to the packet
+   - validateName: one pass over the rest of the packet without touching
+     anything, true if decodeName is going to get exactly a valid Name
+   - decodeName: reads the fields (only call it on validated packets,
+     though it never writes out of bounds either way) */
+#define DECLARE_WIRE_SCHEMA(Name, FIELDS)                                   \
+  typedef struct Name {                                                     \
+    FIELDS(WIRE_STRUCT_SCALAR, WIRE_STRUCT_ARRAY)                           \
+  } Name;                                                                   \
+                                                                            \
+  enum { Name##MaxSize = 0 FIELDS(WIRE_MAX_SIZE_SCALAR, WIRE_MAX_SIZE_ARRAY) }; \
+                                                                            \
+  void encode##Name(PacketBuffer *packet, const Name *wire);                \
+  bool validate##Name(const PacketBuffer *packet);                          \
+  void decode##Name(PacketBuffer *packet, Name *wire);
+
+PROTOCOL_SCHEMAS(DECLARE_WIRE_SCHEMA)
+
+/* Biggest packet of each type (header included) has to fit in a buffer */
+#define PACKET_MAX_SIZE(Name) (sizeof(PacketHeader) + Name##MaxSize)
+
+_Static_assert(PACKET_MAX_SIZE(DiscoverWire) <= PACKET_BUFFER_SIZE,
+               "DISCOVER doesn't fit in a packet buffer");
+_Static_assert(PACKET_MAX_SIZE(ChallengeWire) <= PACKET_MAX_SIZE(DiscoverWire),
+               "CHALLENGE can't be bigger than DISCOVER (amplification)");
+_Static_assert(PACKET_MAX_SIZE(InfoWire) <= PACKET_MAX_SIZE(InfoQueryWire),
+               "INFO can't be bigger than INFO_QUERY (amplification)");
+_Static_assert(PACKET_MAX_SIZE(ConnectWire) <= PACKET_BUFFER_SIZE,
+               "CONNECT doesn't fit in a packet buffer");
+_Static_assert(PACKET_MAX_SIZE(CommandsWire) <= PACKET_BUFFER_SIZE,
+               "COMMANDS doesn't fit in a packet buffer");
+_Static_assert(PACKET_MAX_SIZE(SnapshotWire) <= PACKET_BUFFER_SIZE,
+               "SNAPSHOT doesn't fit in a packet buffer");
+
+#endif
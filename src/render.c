@@ -1,30 +1,27 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <sys/stat.h>
 #include <GL/glew.h>
 
 #include "io.h"
 #include "glo.h"
+#include "trace.h"
 #include "render.h"
-
-/* Utility function to read a text file from a given path. */
-static char *readTextFile(const char *path) {
-  FILE *file = fopen(path, "r");
-  if (!file) {
-    fprintf(stderr, "Unable to find file: %s\n", path);
-    exit(-1);
-  }
-
-  /* Get file size */
-  fseek(file, 0L, SEEK_END);
-  uint32_t fileSize = ftell(file);
-  char *data = malloc(sizeof(char) * (fileSize + 1));
-  rewind(file);
-  fread(data, sizeof(char), fileSize, file);
-  data[fileSize] = 0;
-  return data;
-}
+/* DRAW_VERT_SOURCE, DRAW_FRAG_SOURCE... generated by make */
+#include "shaders.h"
+
+/* Start of a program cache file, the driver's binary follows */
+typedef struct ProgramCacheHeader {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t length;
+  uint32_t pad;
+  uint64_t key;
+} ProgramCacheHeader;
 
 /* Utility function to check the status of an OpenGL shader. */
 static bool checkCompileStatus(
@@ -64,132 +61,892 @@ static void compileShader(uint32_t shader, const char *source) {
   }
 }
 
+/* Copies what draw.frag reads of the uniform data: the header with the
+   players (next to each other) and the trails in use. The rest of the
+   block is left as it was */
+static void copyUniformRanges(uint8_t *dst, const UniformData *data) {
+  /* The controlled player gets read even if it's past playerCount */
+  int playerCount = MIN(
+    MAX(data->playerCount, data->controlledPlayer + 1), MAX_PLAYER_COUNT);
+  int trailCount = data->bulletTrailCount;
+
+  memcpy(
+    dst, data,
+    offsetof(UniformData, wPlayerProp) + sizeof(Vec4) * playerCount);
+  memcpy(
+    dst + offsetof(UniformData, trailTimes), data->trailTimes,
+    sizeof(Vec4) * ((trailCount + 3) / 4));
+  memcpy(
+    dst + offsetof(UniformData, wTrails), data->wTrails,
+    sizeof(Vec4) * trailCount);
+}
+
+/* The copy about to be written may still be read by a frame the GPU
+   hasn't finished. That only happens if the GPU is UNIFORM_BUFFER_FRAMES
+   frames behind, so the wait shows up in the trace on its own */
+static void waitForUniformSlot(
+  RenderData *renderData, uint32_t slot, Tracer *tracer) {
+  GLsync fence = renderData->uniformFences[slot];
+
+  if (!fence) {
+    return;
+  }
+
+  if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+    beginTraceZone(tracer, "uniform wait");
+    glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UNIFORM_WAIT_TIMEOUT);
+    endTraceZone(tracer);
+  }
+
+  glDeleteSync(fence);
+  renderData->uniformFences[slot] = NULL;
+}
+
 /* Gets called every frame to update the data the shader gets access to. */
-static void updateUniformBuffer(RenderData *renderData) {
-  glBindBuffer(GL_UNIFORM_BUFFER, renderData->uniformBuffer);
-  GLvoid* p = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-  memcpy(p, &renderData->uniformData, sizeof(UniformData));
-  glUnmapBuffer(GL_UNIFORM_BUFFER);
+static void updateUniformBuffer(RenderData *renderData, Tracer *tracer) {
+  uint32_t slot = renderData->uniformFrame % UNIFORM_BUFFER_FRAMES;
+  uint32_t offset = slot * renderData->uniformSlotSize;
+
+  waitForUniformSlot(renderData, slot, tracer);
+
+  if (renderData->isUniformBufferPersistent) {
+    /* Coherent, the GPU sees the writes without a flush */
+    copyUniformRanges(
+      renderData->uniformMapping + offset, &renderData->uniformData);
+  }
+  else {
+    /* Unsynchronized: the fence already made sure the GPU is done */
+    glBindBuffer(GL_UNIFORM_BUFFER, renderData->uniformBuffer);
+    uint8_t *p = glMapBufferRange(
+      GL_UNIFORM_BUFFER, offset, sizeof(UniformData),
+      GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    copyUniformRanges(p, &renderData->uniformData);
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+
+  glBindBufferRange(
+    GL_UNIFORM_BUFFER, SCENE_DATA_BINDING,
+    renderData->uniformBuffer, offset, sizeof(UniformData));
 }
 
-RenderData *createRenderData(const DrawContext *ctx) {
-  RenderData *renderData = (RenderData *)malloc(sizeof(RenderData));
-  memset(renderData, 0, sizeof(RenderData));
+/* After the draw which reads the current copy */
+static void fenceUniformSlot(RenderData *renderData) {
+  uint32_t slot = renderData->uniformFrame % UNIFORM_BUFFER_FRAMES;
 
-  /* We need to create a vao for Macos */
-  uint32_t vao;
-  glGenVertexArrays(1, &vao);
-  glBindVertexArray(vao);
+  renderData->uniformFences[slot] =
+    glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  renderData->uniformFrame++;
+}
+
+/*****************************************************************************/
+/*                               Program cache                               */
+/*****************************************************************************/
+/* FNV-1a */
+static uint64_t hashString(uint64_t hash, const char *str) {
+  for (; str && *str; ++str) {
+    hash ^= (uint8_t)*str;
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+/* A binary only loads into the driver which made it, and is only good for
+   the sources it was made from */
+static uint64_t getProgramKey(const char *vertSource, const char *fragSource) {
+  uint64_t key = 14695981039346656037ull;
+  key = hashString(key, (const char *)glGetString(GL_VENDOR));
+  key = hashString(key, (const char *)glGetString(GL_RENDERER));
+  key = hashString(key, (const char *)glGetString(GL_VERSION));
+  key = hashString(key, vertSource);
+  key = hashString(key, fragSource);
+
+  return key;
+}
+
+/* $XDG_CACHE_HOME/glo, or ~/.cache/glo. Returns false without either */
+static bool getProgramCachePath(
+  const char *name, uint64_t key, char *path, size_t size) {
+  const char *cacheHome = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[256];
+
+  if (cacheHome && *cacheHome) {
+    snprintf(dir, sizeof(dir), "%s", cacheHome);
+  }
+  else if (home && *home) {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  }
+  else {
+    return false;
+  }
+
+  /* Either of them may not be there yet */
+  mkdir(dir, 0755);
+  strncat(dir, "/glo", sizeof(dir) - strlen(dir) - 1);
+  mkdir(dir, 0755);
+
+  snprintf(
+    path, size, "%s/%s-%016llx.bin", dir, name, (unsigned long long)key);
+
+  return true;
+}
+
+/* Returns false if there is no usable binary, the program is then left
+   for compiling */
+static bool loadProgramBinary(
+  uint32_t program, const char *path, uint64_t key) {
+  FILE *file = fopen(path, "rb");
+
+  if (!file) {
+    return false;
+  }
+
+  ProgramCacheHeader header;
+  void *binary = NULL;
+  bool isLoaded = false;
+
+  if (fread(&header, sizeof(header), 1, file) == 1 &&
+      header.magic == PROGRAM_CACHE_MAGIC && header.key == key &&
+      header.length <= MAX_PROGRAM_BINARY_SIZE) {
+    binary = malloc(header.length);
+
+    if (fread(binary, header.length, 1, file) == 1) {
+      glProgramBinary(program, header.format, binary, header.length);
+
+      /* Drivers refuse binaries they don't like (after updates) */
+      int32_t status = GL_FALSE;
+      glGetProgramiv(program, GL_LINK_STATUS, &status);
+      isLoaded = status == GL_TRUE;
+    }
+  }
+
+  free(binary);
+  fclose(file);
+
+  return isLoaded;
+}
+
+/* Block bindings aren't part of the binary, they get set after loading */
+static void bindSceneData(uint32_t program) {
+  uint32_t blockIdx = glGetUniformBlockIndex(program, "SceneData");
+
+  if (blockIdx != GL_INVALID_INDEX) {
+    glUniformBlockBinding(program, blockIdx, SCENE_DATA_BINDING);
+  }
+}
+
+/* Written next to the cache file first, so that a crash never leaves half
+   of one behind */
+static void saveProgramBinary(
+  uint32_t program, const char *path, uint64_t key) {
+  int32_t length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+
+  if (length <= 0 || length > MAX_PROGRAM_BINARY_SIZE) {
+    return;
+  }
+
+  ProgramCacheHeader header = {
+    .magic = PROGRAM_CACHE_MAGIC, .length = (uint32_t)length, .key = key
+  };
+
+  void *binary = malloc(length);
+  glGetProgramBinary(program, length, NULL, &header.format, binary);
+
+  char tmpPath[512];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+  FILE *file = fopen(tmpPath, "wb");
+
+  if (file) {
+    bool isWritten =
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(binary, length, 1, file) == 1;
+    isWritten = !fclose(file) && isWritten;
+
+    if (!isWritten || rename(tmpPath, path)) {
+      remove(tmpPath);
+    }
+  }
+
+  free(binary);
+}
+
+/* From the cache when there is a binary for this driver, compiled from
+   the embedded sources otherwise. Its SceneData block reads the uniform
+   buffer at SCENE_DATA_BINDING */
+static uint32_t createProgram(
+  const char *name, const char *vertSource, const char *fragSource) {
+  float start = getTime();
+  uint32_t program = glCreateProgram();
+
+  /* Some drivers have the entry points but no formats (Macos) */
+  bool hasBinaries = GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary;
+  if (hasBinaries) {
+    int32_t formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    hasBinaries = formatCount > 0;
+  }
+
+  uint64_t key = 0;
+  char path[512];
+  bool hasCache = hasBinaries && getProgramCachePath(
+    name, key = getProgramKey(vertSource, fragSource), path, sizeof(path));
+
+  if (hasCache && loadProgramBinary(program, path, key)) {
+    printf(
+      "Loaded the %s program from %s (%.1fms)\n",
+      name, path, (getTime() - start) * 1000.0f);
+    bindSceneData(program);
+    return program;
+  }
 
-  /* Create the shader which renders the scene */
   uint32_t vsh = glCreateShader(GL_VERTEX_SHADER);
   uint32_t fsh = glCreateShader(GL_FRAGMENT_SHADER);
-  char *vshs = readTextFile("draw.vert");
-  char *fshs = readTextFile("draw.frag");
 
-  compileShader(vsh, vshs);
-  compileShader(fsh, fshs);
-  free(vshs); free(fshs);
+  compileShader(vsh, vertSource);
+  compileShader(fsh, fragSource);
 
-  renderData->shader = glCreateProgram();
-  glAttachShader(renderData->shader, vsh);
-  glAttachShader(renderData->shader, fsh);
+  glAttachShader(program, vsh);
+  glAttachShader(program, fsh);
 
-  glLinkProgram(renderData->shader);
+  if (hasCache) {
+    glProgramParameteri(
+      program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+
+  glLinkProgram(program);
 
   if (!checkCompileStatus(
-        renderData->shader, glGetProgramiv,
+        program, glGetProgramiv,
         glGetProgramInfoLog, GL_LINK_STATUS)) {
     fprintf(stderr, "Unable to link shader\n");
     exit(-1);
   }
 
+  glDetachShader(program, vsh);
+  glDetachShader(program, fsh);
+  glDeleteShader(vsh);
+  glDeleteShader(fsh);
+
+  printf(
+    "Compiled the %s program (%.1fms)\n",
+    name, (getTime() - start) * 1000.0f);
+
+  if (hasCache) {
+    saveProgramBinary(program, path, key);
+  }
+
+  bindSceneData(program);
+  return program;
+}
+
+/*****************************************************************************/
+/*                            Instanced rendering                            */
+/*****************************************************************************/
+/* Same order as the modes in entities.vert */
+enum EntityPass {
+  EP_LIGHT_NEAR, EP_LIGHT_FAR, EP_BEAM_NEAR, EP_BEAM_FAR, EP_PLAYERS
+};
+
+static const char *const RENDER_MODE_NAMES[RM_COUNT] = {
+  "scene", "instanced"
+};
+
+enum RenderMode parseRenderMode(const char *name) {
+  for (int i = 0; i < RM_COUNT; ++i) {
+    if (!strcmp(name, RENDER_MODE_NAMES[i])) {
+      return (enum RenderMode)i;
+    }
+  }
+
+  return RM_COUNT;
+}
+
+const char *getRenderModeName(enum RenderMode mode) {
+  return mode < RM_COUNT ? RENDER_MODE_NAMES[mode] : "unknown";
+}
+
+static void createInstancedPrograms(RenderData *renderData) {
+  uint32_t entities = createProgram(
+    "entities", ENTITIES_VERT_SOURCE, ENTITIES_FRAG_SOURCE);
+  uint32_t composite = createProgram(
+    "composite", DRAW_VERT_SOURCE, COMPOSITE_FRAG_SOURCE);
+
+  glUseProgram(entities);
+  glUniform1f(
+    glGetUniformLocation(entities, "uNearRadius"), ENTITY_NEAR_RADIUS);
+  renderData->entityModeLocation = glGetUniformLocation(entities, "uMode");
+
+  /* Texture units, in the order render binds them */
+  glUseProgram(composite);
+  glUniform1i(glGetUniformLocation(composite, "uLight"), 0);
+  glUniform1i(glGetUniformLocation(composite, "uBeam"), 1);
+  glUniform1i(glGetUniformLocation(composite, "uMask"), 2);
+  glUniform1i(glGetUniformLocation(composite, "uFarLight"), 3);
+  glUniform1i(glGetUniformLocation(composite, "uFarBeam"), 4);
+  renderData->farSizeLocation = glGetUniformLocation(composite, "uFarSize");
+
+  glUseProgram(0);
+
+  renderData->entityProgram = entities;
+  renderData->compositeProgram = composite;
+}
+
+static void allocateEntityTexture(
+  uint32_t texture, GLenum internalFormat, GLenum format,
+  int width, int height, GLenum filter) {
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(
+    GL_TEXTURE_2D, 0, internalFormat, width, height, 0,
+    format, GL_FLOAT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+static void attachEntityTextures(
+  uint32_t framebuffer, const uint32_t *textures, int count) {
+  static const GLenum ATTACHMENTS[] = {
+    GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1
+  };
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+  for (int i = 0; i < count; ++i) {
+    glFramebufferTexture2D(
+      GL_FRAMEBUFFER, ATTACHMENTS[i], GL_TEXTURE_2D, textures[i], 0);
+  }
+
+  glDrawBuffers(count, ATTACHMENTS);
+}
+
+/* Sized for the largest scale, like sceneTexture */
+static void updateEntityTargets(
+  RenderData *renderData, const DrawContext *ctx) {
+  float maxScale = renderData->scaleConfig.maxScale;
+  int width = (int)ceilf((float)ctx->width * maxScale);
+  int height = (int)ceilf((float)ctx->height * maxScale);
+
+  if (width == renderData->entityTextureWidth &&
+      height == renderData->entityTextureHeight) {
+    return;
+  }
+
+  if (!renderData->lightFramebuffer) {
+    glGenFramebuffers(1, &renderData->lightFramebuffer);
+    glGenFramebuffers(1, &renderData->beamFramebuffer);
+    glGenFramebuffers(1, &renderData->farLightFramebuffer);
+    glGenFramebuffers(1, &renderData->farBeamFramebuffer);
+    glGenTextures(1, &renderData->lightTexture);
+    glGenTextures(1, &renderData->beamTexture);
+    glGenTextures(1, &renderData->maskTexture);
+    glGenTextures(1, &renderData->farLightTexture);
+    glGenTextures(1, &renderData->farBeamTexture);
+  }
+
+  int farWidth = (width + FAR_FIELD_DOWNSCALE - 1) / FAR_FIELD_DOWNSCALE;
+  int farHeight = (height + FAR_FIELD_DOWNSCALE - 1) / FAR_FIELD_DOWNSCALE;
+
+  /* Read texel for texel, apart from the far field which gets stretched */
+  allocateEntityTexture(
+    renderData->lightTexture, GL_R32F, GL_RED, width, height, GL_NEAREST);
+  allocateEntityTexture(
+    renderData->beamTexture, GL_R32F, GL_RED, width, height, GL_NEAREST);
+  allocateEntityTexture(
+    renderData->maskTexture, GL_RG8, GL_RG, width, height, GL_NEAREST);
+  allocateEntityTexture(
+    renderData->farLightTexture, GL_R32F, GL_RED,
+    farWidth, farHeight, GL_LINEAR);
+  allocateEntityTexture(
+    renderData->farBeamTexture, GL_R32F, GL_RED,
+    farWidth, farHeight, GL_LINEAR);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  uint32_t beamTargets[] = {
+    renderData->beamTexture, renderData->maskTexture
+  };
+
+  attachEntityTextures(
+    renderData->lightFramebuffer, &renderData->lightTexture, 1);
+  attachEntityTextures(renderData->beamFramebuffer, beamTargets, 2);
+  attachEntityTextures(
+    renderData->farLightFramebuffer, &renderData->farLightTexture, 1);
+  attachEntityTextures(
+    renderData->farBeamFramebuffer, &renderData->farBeamTexture, 1);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  renderData->entityTextureWidth = width;
+  renderData->entityTextureHeight = height;
+}
+
+static void drawEntityPass(
+  RenderData *renderData, enum EntityPass pass, int instanceCount) {
+  if (instanceCount > 0) {
+    glUniform1i(renderData->entityModeLocation, pass);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instanceCount);
+  }
+}
+
+/* Draws what draw.frag would into the bound framebuffer (width by height
+   pixels). Lights add up, so the near and far parts of all of them get
+   blended additively. Only the closest beam lights a pixel, and the
+   closest of each part is the closest overall: those take the maximum */
+static void drawInstancedScene(
+  RenderData *renderData, const DrawContext *ctx, int width, int height) {
+  const UniformData *data = &renderData->uniformData;
+  int32_t target = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+
+  updateEntityTargets(renderData, ctx);
+
+  int farWidth = (width + FAR_FIELD_DOWNSCALE - 1) / FAR_FIELD_DOWNSCALE;
+  int farHeight = (height + FAR_FIELD_DOWNSCALE - 1) / FAR_FIELD_DOWNSCALE;
+  /* The controlled player is drawn even past playerCount */
+  int playerCount = MIN(
+    MAX(data->playerCount, data->controlledPlayer + 1), MAX_PLAYER_COUNT);
+  int trailCount = data->bulletTrailCount;
+
+  glUseProgram(renderData->entityProgram);
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE);
+
+  glViewport(0, 0, farWidth, farHeight);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, renderData->farLightFramebuffer);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glBlendEquation(GL_FUNC_ADD);
+  drawEntityPass(renderData, EP_LIGHT_FAR, trailCount);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, renderData->farBeamFramebuffer);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glBlendEquation(GL_MAX);
+  drawEntityPass(renderData, EP_BEAM_FAR, trailCount);
+
+  glViewport(0, 0, width, height);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, renderData->lightFramebuffer);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glBlendEquation(GL_FUNC_ADD);
+  drawEntityPass(renderData, EP_LIGHT_NEAR, trailCount);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, renderData->beamFramebuffer);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glBlendEquation(GL_MAX);
+  drawEntityPass(renderData, EP_BEAM_NEAR, trailCount);
+  drawEntityPass(renderData, EP_PLAYERS, playerCount);
+
+  glBlendEquation(GL_FUNC_ADD);
+  glDisable(GL_BLEND);
+
+  /* Back to where the scene goes */
+  glBindFramebuffer(GL_FRAMEBUFFER, (uint32_t)target);
+
+  uint32_t textures[] = {
+    renderData->lightTexture, renderData->beamTexture,
+    renderData->maskTexture, renderData->farLightTexture,
+    renderData->farBeamTexture
+  };
+
+  for (int i = 0; i < 5; ++i) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+  }
+
+  glUseProgram(renderData->compositeProgram);
+  glUniform2f(
+    renderData->farSizeLocation, (float)farWidth, (float)farHeight);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+  for (int i = 4; i >= 0; --i) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+}
+
+RenderData *createRenderData(
+  const DrawContext *ctx, RenderScaleConfig scaleConfig,
+  enum RenderMode mode) {
+  RenderData *renderData = (RenderData *)malloc(sizeof(RenderData));
+  memset(renderData, 0, sizeof(RenderData));
+
+  scaleConfig.maxScale = clamp(
+    scaleConfig.maxScale, RENDER_SCALE_STEP, MAX_RENDER_SCALE);
+  scaleConfig.minScale = clamp(
+    scaleConfig.minScale, RENDER_SCALE_STEP, scaleConfig.maxScale);
+  renderData->scaleConfig = scaleConfig;
+  renderData->renderScale = clamp(
+    1.0f, scaleConfig.minScale, scaleConfig.maxScale);
+
+  /* Same requirement as the tracer's GPU zones */
+  if (GLEW_VERSION_3_3 || GLEW_ARB_timer_query) {
+    glGenQueries(
+      RENDER_SCALE_FRAMES * 2, &renderData->scaleQueries[0][0]);
+  }
+  else {
+    printf("No GL timer queries - timing the scene on the CPU\n");
+    renderData->isSceneTimedOnCpu = true;
+  }
+
+  /* We need to create a vao for Macos */
+  uint32_t vao;
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+
+  /* Create the shader which renders the scene */
+  renderData->shader = createProgram(
+    "draw", DRAW_VERT_SOURCE, DRAW_FRAG_SOURCE);
+
+  /* And the ones for instanced rendering, both modes can be switched to */
+  renderData->mode = mode;
+  createInstancedPrograms(renderData);
+
   /* Create uniform buffer in which we will store the scene information */
-  renderData->uniformBlockIdx = glGetUniformBlockIndex(
-    renderData->shader, "SceneData");
+  /* Copies have to start at a multiple of the offset alignment */
+  int32_t alignment = 256;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  renderData->uniformSlotSize =
+    (sizeof(UniformData) + alignment - 1) / alignment * alignment;
+
+  uint32_t bufferSize = renderData->uniformSlotSize * UNIFORM_BUFFER_FRAMES;
 
-  static const float GRID_SIZE = 6.0f;
-  renderData->uniformData.wGridScale = GRID_SIZE;
-  renderData->uniformData.wMapStart = vec2(-GRID_SIZE*4.0f, -GRID_SIZE*4.0f);
-  renderData->uniformData.wMapEnd = vec2(GRID_SIZE*4.0f,GRID_SIZE*4.0f);
   glGenBuffers(1, &renderData->uniformBuffer);
   glBindBuffer(GL_UNIFORM_BUFFER, renderData->uniformBuffer);
-  glBufferData(
-    GL_UNIFORM_BUFFER, sizeof(UniformData),
-    &renderData->uniformData, GL_DYNAMIC_DRAW);
 
-  glBindBufferBase(
-    GL_UNIFORM_BUFFER, renderData->uniformBlockIdx,
-    renderData->uniformBuffer);
+  renderData->isUniformBufferPersistent =
+    GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+
+  if (renderData->isUniformBufferPersistent) {
+    GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_UNIFORM_BUFFER, bufferSize, NULL, flags);
+    renderData->uniformMapping = glMapBufferRange(
+      GL_UNIFORM_BUFFER, 0, bufferSize, flags);
+  }
+  else {
+    /* Macos stops at GL 4.1 */
+    glBufferData(GL_UNIFORM_BUFFER, bufferSize, NULL, GL_STREAM_DRAW);
+  }
 
   glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
   return renderData;
 }
 
+void fillRenderView(RenderView *view, const GloState *game) {
+  view->controlled = game->controlled;
+  view->playerCount = game->playerCount;
+
+  /* All of them, the view is centered on the controlled player even
+     before it is counted */
+  for (int i = 0; i < MAX_PLAYER_COUNT; ++i) {
+    const Player *p = &game->players[i];
+    view->players[i].position = p->position;
+    view->players[i].orientation = p->orientation;
+    view->players[i].isInitialized = p->flags.isInitialized;
+  }
+
+  view->trailCount = 0;
+  for (int i = 0; i < game->bulletTrailCount; ++i) {
+    if (getBit(&game->bulletOccupation, i)) {
+      const BulletTrajectory *bullet = &game->bulletTrails[i];
+      RenderTrail *trail = &view->trails[view->trailCount++];
+
+      trail->wStart = bullet->wStart;
+      trail->wEnd = bullet->wEnd;
+      trail->timeStart = bullet->timeStart;
+    }
+  }
+
+  view->gridBoxSize = game->gridBoxSize;
+  view->gridWidth = game->gridWidth;
+}
+
+float getMapViewWidth(const RenderView *view, float aspect) {
+  float mapSize = view->gridBoxSize * view->gridWidth + 4.0f;
+  return mapSize * MAX(aspect, 1.0f);
+}
+
+void fillUniformData(
+  UniformData *data, const RenderView *view,
+  Vec2 wCenter, float wWidth, float aspect, float time) {
+  float wHeight = wWidth / aspect;
+
+  data->invOrtho = invOrtho(
+    vec2(wCenter.x - wWidth/2.0f, wCenter.y - wHeight/2.0f), wWidth, aspect);
+
+  data->controlledPlayer = view->controlled;
+  data->playerCount = view->playerCount;
+
+  for (int i = 0; i < view->playerCount; ++i) {
+    const RenderPlayer *p = &view->players[i];
+    data->wPlayerProp[i].x = p->position.x;
+    data->wPlayerProp[i].y = p->position.y;
+    data->wPlayerProp[i].z = p->orientation;
+
+    if (p->isInitialized) {
+      data->wPlayerProp[i].w = 0.5f;
+    }
+    else {
+      data->wPlayerProp[i].w = 0.0f;
+    }
+  }
+
+  data->time = time;
+  data->maxLazerTime = MAX_LAZER_TIME;
+
+  data->bulletTrailCount = view->trailCount;
+  for (int i = 0; i < view->trailCount; ++i) {
+    const RenderTrail *trail = &view->trails[i];
+
+    data->trailTimes[i / 4].v[i % 4] = trail->timeStart;
+    data->wTrails[i] = vec4(
+      trail->wStart.x, trail->wStart.y, trail->wEnd.x, trail->wEnd.y);
+  }
+
+  data->wGridScale = view->gridBoxSize;
+  float radius = view->gridWidth / 2.0f;
+  data->wMapStart = vec2(
+    -view->gridBoxSize*radius, -view->gridBoxSize*radius);
+  data->wMapEnd = vec2(
+    view->gridBoxSize*radius, view->gridBoxSize*radius);
+}
+
+/*****************************************************************************/
+/*                             Dynamic resolution                            */
+/*****************************************************************************/
+RenderScaleConfig defaultRenderScaleConfig() {
+  RenderScaleConfig config = {
+    .targetGpuTime = DEFAULT_TARGET_GPU_TIME,
+    .minScale = DEFAULT_MIN_RENDER_SCALE,
+    .maxScale = DEFAULT_MAX_RENDER_SCALE
+  };
+
+  return config;
+}
+
+/* Sized for the largest scale, so that changing it never reallocates.
+   Only a window of another size does */
+static void updateSceneTarget(RenderData *renderData, const DrawContext *ctx) {
+  float maxScale = renderData->scaleConfig.maxScale;
+  int width = (int)ceilf((float)ctx->width * maxScale);
+  int height = (int)ceilf((float)ctx->height * maxScale);
+
+  if (width == renderData->sceneTextureWidth &&
+      height == renderData->sceneTextureHeight) {
+    return;
+  }
+
+  if (!renderData->sceneFramebuffer) {
+    glGenFramebuffers(1, &renderData->sceneFramebuffer);
+    glGenTextures(1, &renderData->sceneTexture);
+  }
+
+  glBindTexture(GL_TEXTURE_2D, renderData->sceneTexture);
+  glTexImage2D(
+    GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+    GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, renderData->sceneFramebuffer);
+  glFramebufferTexture2D(
+    GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+    renderData->sceneTexture, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  renderData->sceneTextureWidth = width;
+  renderData->sceneTextureHeight = height;
+}
+
+/* Cost goes with the number of pixels, the square of the scale. Down
+   as soon as the scene is over the target, up only once it is well under
+   it, and not before the last change shows in the timings */
+static void adjustRenderScale(RenderData *renderData, float gpuTime) {
+  const RenderScaleConfig *config = &renderData->scaleConfig;
+
+  if (renderData->gpuTime == 0.0f) {
+    renderData->gpuTime = gpuTime;
+  }
+  else {
+    renderData->gpuTime = lerp(
+      renderData->gpuTime, gpuTime, RENDER_SCALE_GAIN);
+  }
+
+  if (renderData->uniformFrame - renderData->lastScaleChange <
+      2 * RENDER_SCALE_FRAMES) {
+    return;
+  }
+
+  float target = config->targetGpuTime;
+  float scale = renderData->renderScale;
+
+  if (renderData->gpuTime <= target &&
+      renderData->gpuTime >= target * RENDER_SCALE_HEADROOM) {
+    return;
+  }
+
+  float newScale =
+    scale * sqrtf(target * RENDER_SCALE_AIM / renderData->gpuTime);
+  newScale = MIN(newScale, scale + MAX_RENDER_SCALE_RISE);
+  newScale = clamp(newScale, config->minScale, config->maxScale);
+
+  if (fabsf(newScale - scale) < RENDER_SCALE_STEP &&
+      newScale != config->minScale && newScale != config->maxScale) {
+    return;
+  }
+
+  if (newScale != scale) {
+    /* What the smoothed time should become at the new scale */
+    renderData->gpuTime *= (newScale * newScale) / (scale * scale);
+    renderData->renderScale = newScale;
+    renderData->lastScaleChange = renderData->uniformFrame;
+  }
+}
+
+/* The slot's queries were issued RENDER_SCALE_FRAMES frames ago. If they
+   still aren't done, that frame doesn't get counted */
+static void collectScaleQueries(RenderData *renderData, uint32_t slot) {
+  if (!renderData->isScaleQueryPending[slot]) {
+    return;
+  }
+
+  renderData->isScaleQueryPending[slot] = false;
+
+  int32_t isAvailable = 0;
+  glGetQueryObjectiv(
+    renderData->scaleQueries[slot][1], GL_QUERY_RESULT_AVAILABLE,
+    &isAvailable);
+
+  if (isAvailable) {
+    GLuint64 start = 0, end = 0;
+    glGetQueryObjectui64v(
+      renderData->scaleQueries[slot][0], GL_QUERY_RESULT, &start);
+    glGetQueryObjectui64v(
+      renderData->scaleQueries[slot][1], GL_QUERY_RESULT, &end);
+
+    float gpuTime = (float)(end - start) / 1000000.0f;
+    float checkTime = renderData->checkTimes[slot];
+
+    if (checkTime > RENDER_SCALE_CHECK_MIN_TIME &&
+        gpuTime < checkTime * RENDER_SCALE_CHECK_RATIO &&
+        ++renderData->blindScaleQueries == RENDER_SCALE_CHECK_FRAMES / 2) {
+      printf("GL timer queries miss the rendering - timing the scene on the "
+             "CPU\n");
+      renderData->isSceneTimedOnCpu = true;
+    }
+    else if (end > start) {
+      adjustRenderScale(renderData, gpuTime);
+    }
+  }
+
+  renderData->checkTimes[slot] = 0.0f;
+}
+
+/*****************************************************************************/
+/*                                 Rendering                                 */
+/*****************************************************************************/
 void render(
-  const GloState *game,
+  const RenderView *view,
   DrawContext *ctx,
-  RenderData *renderData) {
-  glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-  glClear(GL_COLOR_BUFFER_BIT);
-
+  RenderData *renderData,
+  Tracer *tracer) {
   static float wWidth = 9.0f*5.0f;
 
-  { /* Update the uniform data with game data */
-    const Player *me = &game->players[game->controlled];
+  beginTraceZone(tracer, "uniforms");
 
+  { /* Update the uniform data with the view, around the player */
+    const RenderPlayer *me = &view->players[view->controlled];
     float aspect = (float)ctx->width / (float)ctx->height;
-    float wHeight = wWidth / aspect;
 
-    Vec2 mid = vec2(wWidth/2.0f, wHeight/2.0f);
-
-    renderData->uniformData.invOrtho = invOrtho(
-      vec2(me->position.x-mid.x, me->position.y-mid.y), wWidth,
-      (float)ctx->width/(float)ctx->height);
+    fillUniformData(
+      &renderData->uniformData, view, me->position, wWidth, aspect,
+      getTime());
     ctx->invOrtho = renderData->uniformData.invOrtho;
 
-    renderData->uniformData.controlledPlayer = game->controlled;
-    renderData->uniformData.playerCount = game->playerCount;
-
-    for (int i = 0; i < game->playerCount; ++i) {
-      const Player *p = &game->players[i];
-      renderData->uniformData.wPlayerProp[i].x = p->position.x;
-      renderData->uniformData.wPlayerProp[i].y = p->position.y;
-      renderData->uniformData.wPlayerProp[i].z = p->orientation;
-
-      if (p->flags.isInitialized) {
-        renderData->uniformData.wPlayerProp[i].w = 0.5f;
-      }
-      else {
-        renderData->uniformData.wPlayerProp[i].w = 0.0f;
-      }
-    }
+    updateUniformBuffer(renderData, tracer);
+  }
 
-    renderData->uniformData.time = getTime();
-    renderData->uniformData.maxLazerTime = MAX_LAZER_TIME;
+  endTraceZone(tracer);
 
-    renderData->uniformData.bulletTrailCount = 0;
-    for (int i = 0; i < game->bulletTrailCount; ++i) {
-      if (getBit(&game->bulletOccupation, i)) {
-        renderData->uniformData.bulletTrails[
-          renderData->uniformData.bulletTrailCount] = game->bulletTrails[i];
+  uint32_t slot = renderData->uniformFrame % RENDER_SCALE_FRAMES;
+  bool hasScaleQueries = !renderData->isSceneTimedOnCpu;
+  if (hasScaleQueries) {
+    collectScaleQueries(renderData, slot);
+  }
+
+  /* Full scale goes straight to the window */
+  int sceneWidth = MAX(1, (int)((float)ctx->width * renderData->renderScale));
+  int sceneHeight =
+    MAX(1, (int)((float)ctx->height * renderData->renderScale));
+  bool isScaled = sceneWidth != ctx->width || sceneHeight != ctx->height;
+
+  if (isScaled) {
+    updateSceneTarget(renderData, ctx);
+    glBindFramebuffer(GL_FRAMEBUFFER, renderData->sceneFramebuffer);
+  }
+
+  glViewport(0, 0, sceneWidth, sceneHeight);
+
+  /* All of the scene's passes, so this is its cost */
+  beginGpuTraceZone(tracer, "draw");
+
+  float cpuStart = getTime();
+  if (hasScaleQueries) {
+    glQueryCounter(renderData->scaleQueries[slot][0], GL_TIMESTAMP);
+  }
 
-        renderData->uniformData.bulletTrailCount++;
-      }
+  if (renderData->mode == RM_INSTANCED) {
+    drawInstancedScene(renderData, ctx, sceneWidth, sceneHeight);
+  }
+  else {
+    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glUseProgram(renderData->shader);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  }
+
+  if (hasScaleQueries) {
+    glQueryCounter(renderData->scaleQueries[slot][1], GL_TIMESTAMP);
+    renderData->isScaleQueryPending[slot] = true;
+  }
+
+  if (!hasScaleQueries ||
+      renderData->uniformFrame < RENDER_SCALE_CHECK_FRAMES) {
+    /* Software rasterisers draw on the CPU anyway */
+    glFinish();
+    float cpuTime = (getTime() - cpuStart) * 1000.0f;
+
+    if (hasScaleQueries) {
+      renderData->checkTimes[slot] = cpuTime;
     }
+    else {
+      adjustRenderScale(renderData, cpuTime);
+    }
+  }
+
+  endGpuTraceZone(tracer);
+
+  if (isScaled) {
+    beginGpuTraceZone(tracer, "upscale");
 
-    renderData->uniformData.wGridScale = game->gridBoxSize;
-    float radius = game->gridWidth / 2.0f;
-    renderData->uniformData.wMapStart = vec2(
-      -game->gridBoxSize*radius, -game->gridBoxSize*radius);
-    renderData->uniformData.wMapEnd = vec2(
-      game->gridBoxSize*radius, game->gridBoxSize*radius);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, renderData->sceneFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(
+      0, 0, sceneWidth, sceneHeight, 0, 0, ctx->width, ctx->height,
+      GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    updateUniformBuffer(renderData);
+    endGpuTraceZone(tracer);
   }
 
-  glUseProgram(renderData->shader);
-  glBindBuffer(GL_UNIFORM_BUFFER, renderData->uniformBuffer);
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  glViewport(0, 0, ctx->width, ctx->height);
+
+  fenceUniformSlot(renderData);
 }
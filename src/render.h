@@ -2,13 +2,106 @@
 #define _RENDER_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "glo.h"
 #include "math.h"
 
 typedef struct DrawContext DrawContext;
 typedef struct GloState GloState;
+typedef struct Tracer Tracer;
+
+/* Copies of the uniform block in the uniform buffer: the CPU fills one
+   while the GPU may still be drawing the frames of the other two */
+#define UNIFORM_BUFFER_FRAMES 3
+/* Longest wait for the GPU to let go of a copy (nanoseconds) */
+#define UNIFORM_WAIT_TIMEOUT 100000000ull
+/* Where every program's SceneData block finds the current copy */
+#define SCENE_DATA_BINDING 0
+
+/* Dynamic resolution: the scene pass is timed on the GPU with timestamp
+   queries, read RENDER_SCALE_FRAMES frames later so that it never waits */
+#define RENDER_SCALE_FRAMES 4
+/* The first frames also get finished and timed on the CPU. When most of
+   them took milliseconds there and the queries saw a fraction of that,
+   the driver's queries don't see its rendering */
+#define RENDER_SCALE_CHECK_FRAMES 8
+#define RENDER_SCALE_CHECK_MIN_TIME 1.0f
+#define RENDER_SCALE_CHECK_RATIO 0.25f
+/* Scene pass time (milliseconds) aimed for, and the bounds of the scale
+   (of the window's width and height) it may take to get there */
+#define DEFAULT_TARGET_GPU_TIME 12.0f
+#define DEFAULT_MIN_RENDER_SCALE 0.5f
+#define DEFAULT_MAX_RENDER_SCALE 1.0f
+#define MAX_RENDER_SCALE 2.0f
+/* Smoothing of the measured time, and how close to the target a change
+   of scale aims (a bit under, so that it doesn't flip back and forth) */
+#define RENDER_SCALE_GAIN 0.1f
+#define RENDER_SCALE_AIM 0.9f
+/* Under this fraction of the target it's worth going up again */
+#define RENDER_SCALE_HEADROOM 0.75f
+/* Smallest change of scale, and the largest one up at a time */
+#define RENDER_SCALE_STEP 0.02f
+#define MAX_RENDER_SCALE_RISE 0.1f
+
+/* Instanced rendering: the light of a trail and its beam are split
+   ENTITY_NEAR_RADIUS world units away from it. What is closer gets drawn
+   at full resolution in a quad around the trail, the smooth rest at
+   1/FAR_FIELD_DOWNSCALE of the resolution over the whole view */
+#define ENTITY_NEAR_RADIUS 4.0f
+#define FAR_FIELD_DOWNSCALE 8
+#define DEFAULT_RENDER_MODE RM_INSTANCED
+
+/* Linked programs are cached in ~/.cache/glo (see createProgram) */
+#define PROGRAM_CACHE_MAGIC 0x504f4c47u /* "GLOP" */
+#define MAX_PROGRAM_BINARY_SIZE (16 * 1024 * 1024)
+
+enum RenderMode {
+  /* draw.frag goes through every player and trail for every pixel */
+  RM_SCENE,
+  /* A quad per player and trail (entities.vert/frag), put together by
+     composite.frag. Cost goes with the pixels they cover */
+  RM_INSTANCED,
+  RM_COUNT
+};
+
+typedef struct RenderScaleConfig {
+  /* Milliseconds of GPU time for the scene */
+  float targetGpuTime;
+  float minScale;
+  float maxScale;
+} RenderScaleConfig;
+
+typedef struct RenderPlayer {
+  Vec2 position;
+  float orientation;
+  bool isInitialized;
+} RenderPlayer;
+
+typedef struct RenderTrail {
+  Vec2 wStart;
+  Vec2 wEnd;
+  float timeStart;
+} RenderTrail;
+
+/* What rendering reads of the game, copied out of it by fillRenderView
+   once a simulation step is done. It never changes after that, so the
+   renderer never sees a half updated game */
+typedef struct RenderView {
+  int controlled;
+  int playerCount;
+  RenderPlayer players[MAX_PLAYER_COUNT];
+
+  /* The trails in use, packed */
+  int trailCount;
+  RenderTrail trails[MAX_BULLET_TRAILS];
 
+  float gridBoxSize;
+  float gridWidth;
+} RenderView;
+
+/* Laid out like draw.frag's SceneData block (std140). Only the header and
+   the players and trails in use get uploaded */
 typedef struct UniformData {
 
   /* Inverse orthographic projection to get from pixel space to world space. */
@@ -19,10 +112,6 @@ typedef struct UniformData {
   Vec2 wMapEnd;
 
   float wGridScale;
-
-  /* Will see some padding due to layout std140 */
-  // char pad0[12];
-
   float time;
   float maxLazerTime;
 
@@ -34,25 +123,91 @@ typedef struct UniformData {
 
   char pad[8];
 
-  BulletTrajectory bulletTrails[MAX_BULLET_TRAILS];
-
   /* x,y coordinates; z=orient; w=scale */
   Vec4 wPlayerProp[MAX_PLAYER_COUNT];
 
+  /* Bullet trails without what the shader doesn't need: timeStart of
+     trails 4i to 4i+3 packed in one vector, x,y=start; z,w=end */
+  Vec4 trailTimes[MAX_BULLET_TRAILS / 4];
+  Vec4 wTrails[MAX_BULLET_TRAILS];
+
 } UniformData;
 
 typedef struct RenderData {
+  enum RenderMode mode;
   uint32_t shader;
+
+  /* RM_INSTANCED: the entity passes add up lights and take the maximum of
+     beams and player masks in these textures, the full resolution ones
+     sized like sceneTexture */
+  uint32_t entityProgram;
+  uint32_t compositeProgram;
+  int32_t entityModeLocation;
+  int32_t farSizeLocation;
+  uint32_t lightFramebuffer, beamFramebuffer;
+  uint32_t farLightFramebuffer, farBeamFramebuffer;
+  uint32_t lightTexture, beamTexture, maskTexture;
+  uint32_t farLightTexture, farBeamTexture;
+  int entityTextureWidth, entityTextureHeight;
+
+  /* UNIFORM_BUFFER_FRAMES copies of the block, uniformSlotSize apart */
   uint32_t uniformBuffer;
-  uint32_t uniformBlockIdx;
+  uint32_t uniformSlotSize;
+  uint32_t uniformFrame;
+
+  /* With GL 4.4 (or ARB_buffer_storage) the buffer stays mapped, else
+     each copy gets mapped when it is written */
+  bool isUniformBufferPersistent;
+  uint8_t *uniformMapping;
+
+  /* Signalled once the GPU is done with the frame which used a copy */
+  struct __GLsync *uniformFences[UNIFORM_BUFFER_FRAMES];
+
+  /* Below full scale the scene is drawn into sceneTexture, big enough for
+     maxScale, and stretched over the window */
+  RenderScaleConfig scaleConfig;
+  float renderScale;
+  uint32_t sceneFramebuffer;
+  uint32_t sceneTexture;
+  int sceneTextureWidth, sceneTextureHeight;
+
+  /* Smoothed scene pass time (milliseconds), 0 until there is one */
+  float gpuTime;
+  uint32_t lastScaleChange;
+
+  /* Drivers which only rasterise when flushed (llvmpipe) time the pass as
+     nothing. Without timer queries or with such a driver, the scene is
+     finished and timed on the CPU */
+  bool isSceneTimedOnCpu;
+  uint32_t blindScaleQueries;
+  float checkTimes[RENDER_SCALE_FRAMES];
+  bool isScaleQueryPending[RENDER_SCALE_FRAMES];
+  uint32_t scaleQueries[RENDER_SCALE_FRAMES][2];
 
   UniformData uniformData;
 } RenderData;
 
-RenderData *createRenderData(const struct DrawContext *ctx);
+RenderScaleConfig defaultRenderScaleConfig();
+RenderData *createRenderData(
+  const struct DrawContext *ctx, RenderScaleConfig scaleConfig,
+  enum RenderMode mode);
+
+/* "scene" or "instanced", RM_COUNT for neither */
+enum RenderMode parseRenderMode(const char *name);
+const char *getRenderModeName(enum RenderMode mode);
+
+/* No GL involved in these three, the software renderer takes the same
+   data */
+void fillRenderView(RenderView *view, const GloState *game);
+/* What draw.frag gets to draw the view: wWidth world units around wCenter */
+void fillUniformData(
+  UniformData *data, const RenderView *view,
+  Vec2 wCenter, float wWidth, float aspect, float time);
+/* wWidth which fits the whole map (and a bit around it) */
+float getMapViewWidth(const RenderView *view, float aspect);
 
 void render(
-  const GloState *game, DrawContext *ctx,
-  RenderData *renderData);
+  const RenderView *view, DrawContext *ctx,
+  RenderData *renderData, Tracer *tracer);
 
 #endif
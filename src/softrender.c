@@ -0,0 +1,625 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "softrender.h"
+
+/*****************************************************************************/
+/*                               Vector types                                */
+/*****************************************************************************/
+/* vfloat holds SOFT_LANES pixels worth of a value. Comparisons give masks
+   (all bits set per lane in the SIMD versions, 0/1 in the scalar one)
+   which only vselect and vand take */
+#if defined(__AVX__)
+#include <immintrin.h>
+
+#define SOFT_LANES 8
+typedef __m256 vfloat;
+
+static inline vfloat vset(float x) { return _mm256_set1_ps(x); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+static inline vfloat vdiv(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+static inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a); }
+static inline vfloat vfloor(vfloat a) { return _mm256_floor_ps(a); }
+static inline vfloat vabs(vfloat a) {
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+}
+static inline vfloat vlt(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+}
+static inline vfloat vgt(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+}
+static inline vfloat vle(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a, b, _CMP_LE_OQ);
+}
+static inline vfloat vand(vfloat a, vfloat b) { return _mm256_and_ps(a, b); }
+static inline vfloat vselect(vfloat mask, vfloat a, vfloat b) {
+  return _mm256_blendv_ps(b, a, mask);
+}
+static inline vfloat vramp() {
+  return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+}
+static inline void vstore(float *dst, vfloat a) { _mm256_storeu_ps(dst, a); }
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+#define SOFT_LANES 4
+typedef __m128 vfloat;
+
+static inline vfloat vset(float x) { return _mm_set1_ps(x); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+static inline vfloat vdiv(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+static inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a); }
+static inline vfloat vabs(vfloat a) {
+  return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+}
+static inline vfloat vlt(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+static inline vfloat vgt(vfloat a, vfloat b) { return _mm_cmpgt_ps(a, b); }
+static inline vfloat vle(vfloat a, vfloat b) { return _mm_cmple_ps(a, b); }
+static inline vfloat vand(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+static inline vfloat vselect(vfloat mask, vfloat a, vfloat b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+static inline vfloat vfloor(vfloat a) {
+#ifdef __SSE4_1__
+  return _mm_floor_ps(a);
+#else
+  /* Truncate, then step down where that rounded up (negatives) */
+  vfloat truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+  return _mm_sub_ps(
+    truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a), _mm_set1_ps(1.0f)));
+#endif
+}
+static inline vfloat vramp() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); }
+static inline void vstore(float *dst, vfloat a) { _mm_storeu_ps(dst, a); }
+
+#else
+
+#define SOFT_LANES 1
+typedef float vfloat;
+
+static inline vfloat vset(float x) { return x; }
+static inline vfloat vadd(vfloat a, vfloat b) { return a + b; }
+static inline vfloat vsub(vfloat a, vfloat b) { return a - b; }
+static inline vfloat vmul(vfloat a, vfloat b) { return a * b; }
+static inline vfloat vdiv(vfloat a, vfloat b) { return a / b; }
+static inline vfloat vmin(vfloat a, vfloat b) { return a < b ? a : b; }
+static inline vfloat vmax(vfloat a, vfloat b) { return a > b ? a : b; }
+static inline vfloat vsqrt(vfloat a) { return sqrtf(a); }
+static inline vfloat vfloor(vfloat a) { return floorf(a); }
+static inline vfloat vabs(vfloat a) { return fabsf(a); }
+static inline vfloat vlt(vfloat a, vfloat b) { return a < b; }
+static inline vfloat vgt(vfloat a, vfloat b) { return a > b; }
+static inline vfloat vle(vfloat a, vfloat b) { return a <= b; }
+static inline vfloat vand(vfloat a, vfloat b) { return a * b; }
+static inline vfloat vselect(vfloat mask, vfloat a, vfloat b) {
+  return mask != 0.0f ? a : b;
+}
+static inline vfloat vramp() { return 0.0f; }
+static inline void vstore(float *dst, vfloat a) { *dst = a; }
+
+#endif
+
+/*****************************************************************************/
+/*                                   Scene                                   */
+/*****************************************************************************/
+/* Tone mapping and gamma of calcFinalColor */
+#define SOFT_EXPOSURE 0.06f
+#define SOFT_GAMMA 2.2f
+
+/* Players as sdUnevenCapsule sees them */
+typedef struct SoftPlayer {
+  float x, y;
+  float cosAngle, sinAngle;
+  float scale;
+} SoftPlayer;
+
+/* Trails with the per trail part of lightScene worked out up front */
+typedef struct SoftTrail {
+  /* Where the beam is at (the segment goes from start to end) */
+  float startX, startY;
+  float endX, endY;
+  /* The light at the end is weight * color / distance^2 */
+  float weight;
+  bool isBeam;
+} SoftTrail;
+
+/* draw.frag's uniforms, ready for the pixel loops. All of the scene's
+   lights have the same color, so light is kept as a scalar times it */
+typedef struct SoftScene {
+  /* Pixel (x + 0.5, y + 0.5) is at world (wX + x*wDx, wY - y*wDy) */
+  float wX, wY;
+  float wDx, wDy;
+
+  bool hasControlled;
+  SoftPlayer controlled;
+
+  int playerCount;
+  SoftPlayer players[MAX_PLAYER_COUNT];
+
+  int trailCount;
+  SoftTrail trails[MAX_BULLET_TRAILS];
+
+  float mapStartX, mapStartY;
+  float mapEndX, mapEndY;
+  float gridScale;
+} SoftScene;
+
+static const float LIGHT_COLOR[3] = {1.5f, 1.3f, 0.5f};
+
+static SoftPlayer getSoftPlayer(Vec4 prop) {
+  SoftPlayer player = {
+    .x = prop.x, .y = prop.y,
+    .cosAngle = cosf(prop.z), .sinAngle = sinf(prop.z),
+    .scale = 0.8f * prop.w
+  };
+
+  return player;
+}
+
+static void prepareSoftScene(
+  SoftScene *scene, const UniformData *data, int width, int height) {
+  /* fragCoord goes from -1 to 1 over the image, at the pixel centres */
+  const Mat4 *m = &data->invOrtho;
+  float fragX = -1.0f + 1.0f / (float)width;
+  float fragY = 1.0f - 1.0f / (float)height;
+  scene->wX = m->cols[0].x * fragX + m->cols[3].x;
+  scene->wY = m->cols[1].y * fragY + m->cols[3].y;
+  scene->wDx = m->cols[0].x * 2.0f / (float)width;
+  scene->wDy = m->cols[1].y * 2.0f / (float)height;
+
+  /* Players which aren't there have no size (they'd divide by 0) */
+  int controlled = data->controlledPlayer;
+  scene->hasControlled = controlled >= 0 &&
+    controlled < data->playerCount && data->wPlayerProp[controlled].w > 0.0f;
+
+  if (scene->hasControlled) {
+    scene->controlled = getSoftPlayer(data->wPlayerProp[controlled]);
+  }
+
+  scene->playerCount = 0;
+  for (int i = 0; i < data->playerCount; ++i) {
+    if (i != controlled && data->wPlayerProp[i].w > 0.0f) {
+      scene->players[scene->playerCount++] =
+        getSoftPlayer(data->wPlayerProp[i]);
+    }
+  }
+
+  scene->trailCount = data->bulletTrailCount;
+  for (int i = 0; i < data->bulletTrailCount; ++i) {
+    Vec4 wTrail = data->wTrails[i];
+    float timeStart = data->trailTimes[i / 4].v[i % 4];
+    SoftTrail *trail = &scene->trails[i];
+
+    float progress = (data->time - timeStart) / data->maxLazerTime;
+
+    trail->isBeam = progress < 1.0f;
+    trail->startX = wTrail.x;
+    trail->startY = wTrail.y;
+    trail->endX = wTrail.z;
+    trail->endY = wTrail.w;
+    trail->weight = 2.0f;
+
+    if (trail->isBeam) {
+      trail->startX += progress * (wTrail.z - wTrail.x);
+      trail->startY += progress * (wTrail.w - wTrail.y);
+      trail->weight *= progress;
+    }
+  }
+
+  scene->mapStartX = data->wMapStart.x;
+  scene->mapStartY = data->wMapStart.y;
+  scene->mapEndX = data->wMapEnd.x;
+  scene->mapEndY = data->wMapEnd.y;
+  scene->gridScale = data->wGridScale;
+}
+
+/*****************************************************************************/
+/*                               SDF functions                               */
+/*****************************************************************************/
+static inline vfloat vlength(vfloat x, vfloat y) {
+  return vsqrt(vadd(vmul(x, x), vmul(y, y)));
+}
+
+static inline vfloat sdSegment(
+  vfloat px, vfloat py, float ax, float ay, float bx, float by) {
+  vfloat pax = vsub(px, vset(ax)), pay = vsub(py, vset(ay));
+  float bax = bx - ax, bay = by - ay;
+  float invBaBa = 1.0f / (bax*bax + bay*bay);
+
+  vfloat h = vmul(
+    vadd(vmul(pax, vset(bax)), vmul(pay, vset(bay))), vset(invBaBa));
+  h = vmin(vmax(h, vset(0.0f)), vset(1.0f));
+
+  return vlength(
+    vsub(pax, vmul(vset(bax), h)), vsub(pay, vmul(vset(bay), h)));
+}
+
+/* The player shape of draw.frag (r1 = 0.9, r2 = 0.2, h = 3.2) */
+static inline vfloat sdPlayer(vfloat wx, vfloat wy, const SoftPlayer *p) {
+  static const float R1 = 0.9f, R2 = 0.2f, H = 3.2f;
+  const float b = (R1 - R2) / H;
+  const float a = sqrtf(1.0f - b*b);
+
+  float invScale = 1.0f / p->scale;
+  vfloat dx = vsub(wx, vset(p->x)), dy = vsub(wy, vset(p->y));
+
+  /* rotate(angle) * (wCoord - position) / scale */
+  vfloat px = vmul(
+    vsub(vmul(vset(p->cosAngle), dx), vmul(vset(p->sinAngle), dy)),
+    vset(invScale));
+  vfloat py = vmul(
+    vadd(vmul(vset(p->sinAngle), dx), vmul(vset(p->cosAngle), dy)),
+    vset(invScale));
+
+  px = vabs(px);
+  vfloat k = vadd(vmul(px, vset(-b)), vmul(py, vset(a)));
+
+  vfloat bottom = vsub(vlength(px, py), vset(R1));
+  vfloat top = vsub(vlength(px, vsub(py, vset(H))), vset(R2));
+  vfloat side = vsub(vadd(vmul(px, vset(a)), vmul(py, vset(b))), vset(R1));
+
+  vfloat d = vselect(vgt(k, vset(a*H)), top, side);
+  d = vselect(vlt(k, vset(0.0f)), bottom, d);
+
+  return vmul(d, vset(p->scale));
+}
+
+static inline vfloat vmod(vfloat x, float y) {
+  return vsub(x, vmul(vset(y), vfloor(vdiv(x, vset(y)))));
+}
+
+/* mapGrid: bars every gridScale (the bar's other coordinate is left as it
+   is, mod by 0 in the shader) */
+static inline vfloat mapGrid(vfloat wx, vfloat wy, const SoftScene *scene) {
+  vfloat cx = vmin(
+    vmax(wx, vset(scene->mapStartX - 0.5f)), vset(scene->mapEndX + 0.5f));
+  vfloat cy = vmin(
+    vmax(wy, vset(scene->mapStartY - 0.5f)), vset(scene->mapEndY + 0.5f));
+
+  vfloat vertical = sdSegment(
+    vmod(cx, scene->gridScale), cy,
+    0.0f, scene->mapStartY, 0.0f, scene->mapEndY);
+  vfloat horizontal = sdSegment(
+    cx, vmod(cy, scene->gridScale),
+    scene->mapStartX, 0.0f, scene->mapEndX, 0.0f);
+
+  return vsub(vmin(vertical, horizontal), vset(0.05f));
+}
+
+/*****************************************************************************/
+/*                                  Shading                                  */
+/*****************************************************************************/
+/* Output level k (1 to 255) starts at thresholds[k - 1]: tone mapping an
+   8 bit channel is a search instead of an exp and a pow */
+static void createToneThresholds(float thresholds[256]) {
+  for (int k = 1; k < 256; ++k) {
+    /* Inverse of pow(1 - exp(-c * exposure), 1 / gamma) * 255 = k - 0.5 */
+    double level = ((double)k - 0.5) / 255.0;
+    double linear = pow(level, SOFT_GAMMA);
+    thresholds[k - 1] = (float)(-log(1.0 - linear) / SOFT_EXPOSURE);
+  }
+
+  thresholds[255] = INFINITY;
+}
+
+static inline uint8_t toneMap(const float thresholds[256], float c) {
+  /* Number of thresholds at or below c */
+  uint32_t level = 0;
+  for (uint32_t step = 128; step; step >>= 1) {
+    if (thresholds[level + step - 1] <= c) {
+      level += step;
+    }
+  }
+
+  return (uint8_t)level;
+}
+
+/* main() of draw.frag for SOFT_LANES pixels of a row */
+static void shadePixels(
+  const SoftScene *scene, const float thresholds[256],
+  int x, int y, int count, uint8_t *out) {
+  vfloat wx = vadd(
+    vset(scene->wX + (float)x * scene->wDx),
+    vmul(vramp(), vset(scene->wDx)));
+  vfloat wy = vset(scene->wY - (float)y * scene->wDy);
+
+  /* mapHiddenPlayers */
+  vfloat hidden = vset(1e10f);
+  for (int i = 0; i < scene->playerCount; ++i) {
+    hidden = vmin(hidden, sdPlayer(wx, wy, &scene->players[i]));
+  }
+
+  /* lightScene: light is a multiple of LIGHT_COLOR */
+  vfloat beam = vset(1e10f);
+  vfloat light = vset(0.0f);
+  for (int i = 0; i < scene->trailCount; ++i) {
+    const SoftTrail *trail = &scene->trails[i];
+
+    if (trail->isBeam) {
+      beam = vmin(beam, sdSegment(
+                    wx, wy, trail->startX, trail->startY,
+                    trail->endX, trail->endY));
+    }
+
+    vfloat diffX = vsub(vset(trail->endX), wx);
+    vfloat diffY = vsub(vset(trail->endY), wy);
+    vfloat diff2 = vadd(vmul(diffX, diffX), vmul(diffY, diffY));
+    light = vadd(light, vdiv(vset(trail->weight), diff2));
+  }
+
+  light = vadd(light, vdiv(vset(0.2f), vmul(beam, beam)));
+
+  /* dot(litColor, litColor) > 0.0005 inside a player: 6 times brighter */
+  float color2 = 0.0f;
+  for (int i = 0; i < 3; ++i) {
+    color2 += LIGHT_COLOR[i] * LIGHT_COLOR[i];
+  }
+
+  vfloat isLitPlayer = vand(
+    vgt(vmul(vmul(light, light), vset(color2)), vset(0.0005f)),
+    vle(hidden, vset(0.001f)));
+  light = vselect(isLitPlayer, vmul(light, vset(6.0f)), light);
+
+  /* Flat additions: controlled player and grid */
+  vfloat flat = vset(0.0f);
+
+  if (scene->hasControlled) {
+    vfloat controlled = sdPlayer(wx, wy, &scene->controlled);
+    flat = vselect(vle(controlled, vset(0.001f)), vset(0.2f), flat);
+  }
+
+  vfloat grid = mapGrid(wx, wy, scene);
+  flat = vadd(flat, vselect(vle(grid, vset(0.0001f)), vset(0.5f), vset(0.0f)));
+
+  float lights[SOFT_LANES], flats[SOFT_LANES];
+  vstore(lights, light);
+  vstore(flats, flat);
+
+  for (int i = 0; i < count; ++i) {
+    for (int channel = 0; channel < 3; ++channel) {
+      float c = lights[i] * LIGHT_COLOR[channel] + flats[i];
+      out[i*3 + channel] = toneMap(thresholds, c);
+    }
+  }
+}
+
+/*****************************************************************************/
+/*                                Thread pool                                */
+/*****************************************************************************/
+struct SoftRenderer {
+  /* Tiles are the indices of a parallelFor */
+  JobPool *pool;
+
+  /* The image being rendered */
+  SoftScene scene;
+  SoftImage *image;
+  int tilesX;
+  int tileCount;
+
+  float thresholds[256];
+};
+
+static void renderTile(void *data, int tile) {
+  SoftRenderer *renderer = (SoftRenderer *)data;
+  const SoftScene *scene = &renderer->scene;
+  SoftImage *image = renderer->image;
+
+  int x0 = (tile % renderer->tilesX) * SOFT_TILE_SIZE;
+  int y0 = (tile / renderer->tilesX) * SOFT_TILE_SIZE;
+  int x1 = MIN(x0 + SOFT_TILE_SIZE, image->width);
+  int y1 = MIN(y0 + SOFT_TILE_SIZE, image->height);
+
+  for (int y = y0; y < y1; ++y) {
+    uint8_t *row = image->pixels + (size_t)y * image->width * 3;
+
+    for (int x = x0; x < x1; x += SOFT_LANES) {
+      shadePixels(
+        scene, renderer->thresholds, x, y, MIN(SOFT_LANES, x1 - x),
+        row + x * 3);
+    }
+  }
+}
+
+SoftRenderer *createSoftRenderer(int threadCount) {
+  SoftRenderer *renderer = (SoftRenderer *)calloc(1, sizeof(SoftRenderer));
+  renderer->pool = createJobPool(threadCount);
+
+  createToneThresholds(renderer->thresholds);
+
+  return renderer;
+}
+
+void destroySoftRenderer(SoftRenderer *renderer) {
+  destroyJobPool(renderer->pool);
+  free(renderer);
+}
+
+int getSoftRendererThreads(const SoftRenderer *renderer) {
+  return getJobPoolThreads(renderer->pool);
+}
+
+int getSoftRendererLanes() {
+  return SOFT_LANES;
+}
+
+void softRender(
+  SoftRenderer *renderer, const UniformData *scene, SoftImage *image) {
+  prepareSoftScene(&renderer->scene, scene, image->width, image->height);
+
+  renderer->image = image;
+  renderer->tilesX = (image->width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+  int tilesY = (image->height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+  renderer->tileCount = renderer->tilesX * tilesY;
+
+  parallelFor(renderer->pool, renderer->tileCount, renderTile, renderer);
+}
+
+/*****************************************************************************/
+/*                                   Images                                  */
+/*****************************************************************************/
+SoftImage createSoftImage(int width, int height) {
+  SoftImage image = {
+    .width = width, .height = height,
+    .pixels = (uint8_t *)malloc((size_t)width * height * 3)
+  };
+
+  return image;
+}
+
+void freeSoftImage(SoftImage *image) {
+  free(image->pixels);
+  image->pixels = NULL;
+}
+
+bool writePPM(const SoftImage *image, const char *path) {
+  FILE *file = fopen(path, "wb");
+
+  if (!file) {
+    fprintf(stderr, "Unable to write image to %s\n", path);
+    return false;
+  }
+
+  fprintf(file, "P6\n%d %d\n255\n", image->width, image->height);
+  fwrite(image->pixels, 3, (size_t)image->width * image->height, file);
+
+  bool isWritten = !ferror(file);
+  fclose(file);
+
+  return isWritten;
+}
+
+/* PNG chunks end with a CRC-32 of their type and data */
+static uint32_t updateCrc32(uint32_t crc, const uint8_t *data, size_t size) {
+  static uint32_t table[256];
+  static bool hasTable = false;
+
+  if (!hasTable) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+
+    hasTable = true;
+  }
+
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+static void writeBigEndian(FILE *file, uint32_t value) {
+  uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+  fwrite(bytes, 1, 4, file);
+}
+
+/* A chunk streamed in pieces: begin, data, end */
+static uint32_t beginPngChunk(FILE *file, const char *type, uint32_t size) {
+  writeBigEndian(file, size);
+  fwrite(type, 1, 4, file);
+  return updateCrc32(0xffffffffu, (const uint8_t *)type, 4);
+}
+
+static uint32_t writePngData(
+  FILE *file, uint32_t crc, const uint8_t *data, size_t size) {
+  fwrite(data, 1, size, file);
+  return updateCrc32(crc, data, size);
+}
+
+static void endPngChunk(FILE *file, uint32_t crc) {
+  writeBigEndian(file, crc ^ 0xffffffffu);
+}
+
+bool writePNG(const SoftImage *image, const char *path) {
+  FILE *file = fopen(path, "wb");
+
+  if (!file) {
+    fprintf(stderr, "Unable to write image to %s\n", path);
+    return false;
+  }
+
+  static const uint8_t SIGNATURE[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  fwrite(SIGNATURE, 1, sizeof(SIGNATURE), file);
+
+  /* 8 bit RGB, no interlacing */
+  uint8_t header[13] = {
+    image->width >> 24, image->width >> 16, image->width >> 8, image->width,
+    image->height >> 24, image->height >> 16, image->height >> 8,
+    image->height, 8, 2, 0, 0, 0
+  };
+  uint32_t crc = beginPngChunk(file, "IHDR", sizeof(header));
+  crc = writePngData(file, crc, header, sizeof(header));
+  endPngChunk(file, crc);
+
+  /* The rows, each with its filter byte (0, none) in front */
+  size_t rowSize = (size_t)image->width * 3 + 1;
+  size_t rawSize = rowSize * image->height;
+  uint8_t *raw = (uint8_t *)malloc(rawSize);
+
+  uint32_t adlerA = 1, adlerB = 0;
+  for (int y = 0; y < image->height; ++y) {
+    raw[y * rowSize] = 0;
+    memcpy(
+      &raw[y * rowSize + 1], &image->pixels[(size_t)y * image->width * 3],
+      rowSize - 1);
+  }
+
+  /* Adler-32 of them goes at the end of the zlib stream */
+  for (size_t i = 0; i < rawSize; ++i) {
+    adlerA = (adlerA + raw[i]) % 65521;
+    adlerB = (adlerB + adlerA) % 65521;
+  }
+
+  /* zlib stream made of stored blocks */
+  enum { MAX_STORED_BLOCK = 65535 };
+  size_t blockCount = (rawSize + MAX_STORED_BLOCK - 1) / MAX_STORED_BLOCK;
+  size_t dataSize = 2 + blockCount * 5 + rawSize + 4;
+
+  crc = beginPngChunk(file, "IDAT", (uint32_t)dataSize);
+  static const uint8_t ZLIB_HEADER[2] = {0x78, 0x01};
+  crc = writePngData(file, crc, ZLIB_HEADER, 2);
+
+  for (size_t offset = 0; offset < rawSize; offset += MAX_STORED_BLOCK) {
+    uint16_t size = (uint16_t)MIN(rawSize - offset, MAX_STORED_BLOCK);
+    uint8_t blockHeader[5] = {
+      offset + size == rawSize, size & 0xff, size >> 8,
+      ~size & 0xff, (~size >> 8) & 0xff
+    };
+    crc = writePngData(file, crc, blockHeader, 5);
+    crc = writePngData(file, crc, &raw[offset], size);
+  }
+
+  uint8_t adler[4] = {adlerB >> 8, adlerB & 0xff, adlerA >> 8, adlerA & 0xff};
+  crc = writePngData(file, crc, adler, 4);
+  endPngChunk(file, crc);
+
+  free(raw);
+
+  crc = beginPngChunk(file, "IEND", 0);
+  endPngChunk(file, crc);
+
+  bool isWritten = !ferror(file);
+  fclose(file);
+
+  return isWritten;
+}
@@ -0,0 +1,50 @@
+#ifndef _SOFTRENDER_H_
+#define _SOFTRENDER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "render.h"
+
+/* Images get split into square tiles, the indices of a parallelFor
+   (jobs.h), so at most MAX_JOB_THREADS threads draw them */
+#define SOFT_TILE_SIZE 32
+
+/* Server thumbnails: size, and threads taken from the server for them */
+#define THUMBNAIL_WIDTH 320
+#define THUMBNAIL_HEIGHT 180
+#define THUMBNAIL_THREADS 2
+
+/* 8 bit RGB, rows top to bottom */
+typedef struct SoftImage {
+  int width, height;
+  uint8_t *pixels;
+} SoftImage;
+
+/* CPU version of draw.frag, for when there is no GPU (server thumbnails,
+   previews) and as a reference for the shader. Pixels are shaded 4 or 8
+   at a time with SSE or AVX (whatever the compiler targets, see "make
+   NATIVE=1"), tiles are spread over a pool of threads */
+typedef struct SoftRenderer SoftRenderer;
+
+/* threadCount counts the calling thread, 0 for one per CPU */
+SoftRenderer *createSoftRenderer(int threadCount);
+void destroySoftRenderer(SoftRenderer *renderer);
+int getSoftRendererThreads(const SoftRenderer *renderer);
+/* Pixels shaded at once: 8 with AVX, 4 with SSE, 1 without either */
+int getSoftRendererLanes();
+
+SoftImage createSoftImage(int width, int height);
+void freeSoftImage(SoftImage *image);
+
+/* Draws the scene draw.frag would with these uniforms. A controlled
+   player out of range draws everyone the same (no camera owner) */
+void softRender(
+  SoftRenderer *renderer, const UniformData *scene, SoftImage *image);
+
+/* Return false if the file couldn't be written */
+bool writePPM(const SoftImage *image, const char *path);
+/* Uncompressed (stored deflate blocks), to stay free of zlib */
+bool writePNG(const SoftImage *image, const char *path);
+
+#endif
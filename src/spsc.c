@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+SpscRing *createSpscRing(uint32_t capacity, uint32_t elementSize) {
+  SpscRing *ring = (SpscRing *)aligned_alloc(
+    CACHE_LINE_SIZE, sizeof(SpscRing));
+  memset(ring, 0, sizeof(SpscRing));
+
+  /* Indices wrap with a mask */
+  uint32_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->capacity = size;
+  ring->elementSize = elementSize;
+  ring->elements = (uint8_t *)malloc((size_t)size * elementSize);
+
+  return ring;
+}
+
+void destroySpscRing(SpscRing *ring) {
+  free(ring->elements);
+  free(ring);
+}
+
+/* Indices only ever increase, their difference is the fill level even
+   after they wrap around */
+void *reserveSpscSlot(SpscRing *ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (tail - head == ring->capacity) {
+    return NULL;
+  }
+
+  return ring->elements +
+    (size_t)(tail & (ring->capacity - 1)) * ring->elementSize;
+}
+
+/* Release: the element's contents are visible before the new tail is */
+void commitSpscSlot(SpscRing *ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void *peekSpscSlot(SpscRing *ring) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (head == tail) {
+    return NULL;
+  }
+
+  return ring->elements +
+    (size_t)(head & (ring->capacity - 1)) * ring->elementSize;
+}
+
+/* Release: the producer doesn't overwrite the slot before we're done */
+void releaseSpscSlot(SpscRing *ring) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
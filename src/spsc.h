@@ -0,0 +1,39 @@
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "glo.h"
+
+/* Fixed size elements handed from one thread (the producer) to one other
+   (the consumer) without locks. Elements are written and read in place:
+   reserve a slot, fill it, then commit it. The two indices live on their
+   own cache lines, each only ever written by its own side */
+typedef struct SpscRing {
+  /* Next slot the consumer reads */
+  _Alignas(CACHE_LINE_SIZE) atomic_uint head;
+  /* Next slot the producer writes */
+  _Alignas(CACHE_LINE_SIZE) atomic_uint tail;
+
+  /* Power of two */
+  _Alignas(CACHE_LINE_SIZE) uint32_t capacity;
+  uint32_t elementSize;
+  uint8_t *elements;
+} SpscRing;
+
+SpscRing *createSpscRing(uint32_t capacity, uint32_t elementSize);
+void destroySpscRing(SpscRing *ring);
+
+/* Producer: returns the slot to fill, or NULL if the ring is full. The
+   consumer only sees it once it is committed */
+void *reserveSpscSlot(SpscRing *ring);
+void commitSpscSlot(SpscRing *ring);
+
+/* Consumer: returns the oldest committed element, or NULL if there is
+   none. It stays valid until it is released */
+void *peekSpscSlot(SpscRing *ring);
+void releaseSpscSlot(SpscRing *ring);
+
+#endif
@@ -0,0 +1,340 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/glew.h>
+
+#include "trace.h"
+#include "math.h"
+
+#define FRAME_TIME_BOUND(bound) bound,
+static const float FRAME_TIME_BOUNDS[] = {
+  FRAME_TIME_BUCKETS(FRAME_TIME_BOUND)
+};
+#define FRAME_TIME_BUCKET_COUNT \
+  (sizeof(FRAME_TIME_BOUNDS) / sizeof(FRAME_TIME_BOUNDS[0]) + 1)
+
+typedef struct TraceZone {
+  const char *name;
+  uint64_t start;
+} TraceZone;
+
+/* GPU zones of one frame, waiting for their queries */
+typedef struct GpuTraceFrame {
+  uint32_t frame;
+  uint32_t zoneCount;
+  TraceZone zones[MAX_GPU_TRACE_ZONES];
+  uint32_t queries[MAX_GPU_TRACE_ZONES];
+} GpuTraceFrame;
+
+struct Tracer {
+  struct timespec origin;
+  uint32_t frame;
+
+  /* Ring of finished zones */
+  uint32_t eventStart;
+  uint32_t eventCount;
+  TraceEvent events[MAX_TRACE_EVENTS];
+
+  /* Zones which haven't ended yet */
+  uint32_t depth;
+  TraceZone stack[MAX_TRACE_DEPTH];
+
+  bool hasTimerQueries;
+  bool isGpuZoneOpen;
+  GpuTraceFrame gpuFrames[TRACE_GPU_FRAMES];
+
+  /* Frame times (milliseconds) and how many of them fall in each bucket */
+  uint32_t frameTimeHead;
+  uint32_t frameTimeCount;
+  float frameTimes[FRAME_TIME_HISTORY];
+  uint32_t buckets[FRAME_TIME_BUCKET_COUNT];
+};
+
+uint64_t getTraceTime(const Tracer *t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)(now.tv_sec - t->origin.tv_sec) * 1000000000ull +
+    (uint64_t)(now.tv_nsec - t->origin.tv_nsec);
+}
+
+Tracer *createTracer() {
+  Tracer *t = (Tracer *)calloc(1, sizeof(Tracer));
+  clock_gettime(CLOCK_MONOTONIC, &t->origin);
+
+  /* Mesa's software rasterisers have them too */
+  t->hasTimerQueries = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+
+  if (t->hasTimerQueries) {
+    for (int i = 0; i < TRACE_GPU_FRAMES; ++i) {
+      glGenQueries(MAX_GPU_TRACE_ZONES, t->gpuFrames[i].queries);
+    }
+  }
+  else {
+    printf("No GL timer queries - traces won't have GPU zones\n");
+  }
+
+  return t;
+}
+
+void destroyTracer(Tracer *t) {
+  if (t->hasTimerQueries) {
+    for (int i = 0; i < TRACE_GPU_FRAMES; ++i) {
+      glDeleteQueries(MAX_GPU_TRACE_ZONES, t->gpuFrames[i].queries);
+    }
+  }
+
+  free(t);
+}
+
+static void pushTraceEvent(
+  Tracer *t, const TraceZone *zone, uint64_t duration,
+  uint32_t frame, uint8_t track) {
+  if (t->eventCount == MAX_TRACE_EVENTS) {
+    /* Drop the oldest */
+    t->eventStart = (t->eventStart + 1) % MAX_TRACE_EVENTS;
+    t->eventCount--;
+  }
+
+  TraceEvent *event =
+    &t->events[(t->eventStart + t->eventCount++) % MAX_TRACE_EVENTS];
+  event->name = zone->name;
+  event->start = zone->start;
+  event->duration = duration;
+  event->frame = frame;
+  event->track = track;
+}
+
+/*****************************************************************************/
+/*                                 CPU zones                                 */
+/*****************************************************************************/
+void beginTraceZone(Tracer *t, const char *name) {
+  if (t->depth < MAX_TRACE_DEPTH) {
+    TraceZone *zone = &t->stack[t->depth];
+    zone->name = name;
+    zone->start = getTraceTime(t);
+  }
+
+  /* Too deep zones aren't recorded, but still have to be ended */
+  t->depth++;
+}
+
+void endTraceZone(Tracer *t) {
+  if (t->depth == 0) {
+    return;
+  }
+
+  if (--t->depth < MAX_TRACE_DEPTH) {
+    TraceZone *zone = &t->stack[t->depth];
+    pushTraceEvent(t, zone, getTraceTime(t) - zone->start, t->frame, TT_CPU);
+  }
+}
+
+void addTraceZone(
+  Tracer *t, const char *name, uint64_t start, uint64_t duration,
+  enum TraceTrack track) {
+  TraceZone zone = {.name = name, .start = start};
+  pushTraceEvent(t, &zone, duration, t->frame, track);
+}
+
+/*****************************************************************************/
+/*                                 GPU zones                                 */
+/*****************************************************************************/
+void beginGpuTraceZone(Tracer *t, const char *name) {
+  GpuTraceFrame *gpuFrame = &t->gpuFrames[t->frame % TRACE_GPU_FRAMES];
+
+  if (!t->hasTimerQueries || t->isGpuZoneOpen ||
+      gpuFrame->zoneCount == MAX_GPU_TRACE_ZONES) {
+    return;
+  }
+
+  TraceZone *zone = &gpuFrame->zones[gpuFrame->zoneCount];
+  zone->name = name;
+  zone->start = getTraceTime(t);
+
+  glBeginQuery(GL_TIME_ELAPSED, gpuFrame->queries[gpuFrame->zoneCount]);
+  t->isGpuZoneOpen = true;
+}
+
+void endGpuTraceZone(Tracer *t) {
+  if (!t->isGpuZoneOpen) {
+    return;
+  }
+
+  glEndQuery(GL_TIME_ELAPSED);
+
+  t->gpuFrames[t->frame % TRACE_GPU_FRAMES].zoneCount++;
+  t->isGpuZoneOpen = false;
+}
+
+/* The frame this slot was used for is TRACE_GPU_FRAMES old, its queries
+   are (almost always) done. The ones which aren't are left out */
+static void collectGpuZones(Tracer *t, GpuTraceFrame *gpuFrame) {
+  uint64_t now = getTraceTime(t);
+
+  for (uint32_t i = 0; i < gpuFrame->zoneCount; ++i) {
+    int32_t isAvailable = 0;
+    glGetQueryObjectiv(
+      gpuFrame->queries[i], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+
+    if (isAvailable) {
+      GLuint64 elapsed = 0;
+      glGetQueryObjectui64v(gpuFrame->queries[i], GL_QUERY_RESULT, &elapsed);
+
+      /* Can't have taken longer than it's been since it was submitted.
+         llvmpipe's very first query says it did */
+      TraceZone *zone = &gpuFrame->zones[i];
+      if ((uint64_t)elapsed <= now - zone->start) {
+        pushTraceEvent(t, zone, (uint64_t)elapsed, gpuFrame->frame, TT_GPU);
+      }
+    }
+  }
+
+  gpuFrame->zoneCount = 0;
+}
+
+/*****************************************************************************/
+/*                                   Frames                                  */
+/*****************************************************************************/
+static uint32_t getFrameTimeBucket(float milliseconds) {
+  uint32_t bucket = 0;
+  while (bucket < FRAME_TIME_BUCKET_COUNT - 1 &&
+         milliseconds > FRAME_TIME_BOUNDS[bucket]) {
+    bucket++;
+  }
+
+  return bucket;
+}
+
+static void addFrameTime(Tracer *t, float milliseconds) {
+  if (t->frameTimeCount == FRAME_TIME_HISTORY) {
+    /* The oldest one leaves the histogram */
+    t->buckets[getFrameTimeBucket(t->frameTimes[t->frameTimeHead])]--;
+  }
+  else {
+    t->frameTimeCount++;
+  }
+
+  t->frameTimes[t->frameTimeHead] = milliseconds;
+  t->frameTimeHead = (t->frameTimeHead + 1) % FRAME_TIME_HISTORY;
+  t->buckets[getFrameTimeBucket(milliseconds)]++;
+}
+
+void beginTraceFrame(Tracer *t) {
+  GpuTraceFrame *gpuFrame = &t->gpuFrames[t->frame % TRACE_GPU_FRAMES];
+
+  if (t->hasTimerQueries) {
+    collectGpuZones(t, gpuFrame);
+  }
+
+  gpuFrame->frame = t->frame;
+
+  beginTraceZone(t, "frame");
+}
+
+void endTraceFrame(Tracer *t) {
+  /* Whatever is still open belongs to this frame */
+  while (t->depth > 1) {
+    endTraceZone(t);
+  }
+
+  if (t->depth == 1) {
+    uint64_t start = t->stack[0].start;
+    endTraceZone(t);
+    addFrameTime(t, (float)(getTraceTime(t) - start) / 1000000.0f);
+  }
+
+  endGpuTraceZone(t);
+  t->frame++;
+}
+
+/*****************************************************************************/
+/*                                   Output                                  */
+/*****************************************************************************/
+bool writeChromeTrace(const Tracer *t, const char *path) {
+  FILE *file = fopen(path, "w");
+
+  if (!file) {
+    fprintf(stderr, "Unable to write trace to %s\n", path);
+    return false;
+  }
+
+  /* One process, a track for the main thread, the GPU and the simulation
+     thread */
+  fprintf(
+    file,
+    "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+    "\"args\":{\"name\":\"gloc\"}},\n"
+    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+    "\"args\":{\"name\":\"CPU\"}},\n"
+    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+    "\"args\":{\"name\":\"GPU\"}},\n"
+    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+    "\"args\":{\"name\":\"Simulation\"}}",
+    TT_CPU, TT_CPU, TT_GPU, TT_SIMULATION);
+
+  /* Complete events, timestamps in microseconds */
+  for (uint32_t i = 0; i < t->eventCount; ++i) {
+    const TraceEvent *event =
+      &t->events[(t->eventStart + i) % MAX_TRACE_EVENTS];
+
+    fprintf(
+      file,
+      ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+      event->name, event->track == TT_GPU ? "gpu" : "cpu", (int)event->track,
+      (double)event->start / 1000.0, (double)event->duration / 1000.0,
+      event->frame);
+  }
+
+  fprintf(file, "\n]}\n");
+
+  bool isWritten = !ferror(file);
+  fclose(file);
+
+  if (isWritten) {
+    printf("Wrote %u trace events to %s\n", t->eventCount, path);
+  }
+
+  return isWritten;
+}
+
+static int compareFloats(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+void printFrameHistogram(const Tracer *t) {
+  if (t->frameTimeCount == 0) {
+    return;
+  }
+
+  float sorted[FRAME_TIME_HISTORY];
+  memcpy(sorted, t->frameTimes, sizeof(float) * t->frameTimeCount);
+  qsort(sorted, t->frameTimeCount, sizeof(float), compareFloats);
+
+  uint32_t count = t->frameTimeCount;
+  printf(
+    "Frame times over the last %u frames: p50 %.2fms p95 %.2fms "
+    "p99 %.2fms max %.2fms\n",
+    count, sorted[count / 2], sorted[count * 95 / 100],
+    sorted[count * 99 / 100], sorted[count - 1]);
+
+  for (uint32_t i = 0; i < FRAME_TIME_BUCKET_COUNT; ++i) {
+    char range[32];
+    if (i < FRAME_TIME_BUCKET_COUNT - 1) {
+      snprintf(range, sizeof(range), "<= %5.1fms", FRAME_TIME_BOUNDS[i]);
+    }
+    else {
+      snprintf(range, sizeof(range), " > %5.1fms", FRAME_TIME_BOUNDS[i - 1]);
+    }
+
+    /* 50 characters for all the frames */
+    char bar[51] = {};
+    memset(bar, '#', MIN(t->buckets[i] * 50 / count, 50));
+
+    printf("  %s %5u %s\n", range, t->buckets[i], bar);
+  }
+}
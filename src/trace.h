@@ -0,0 +1,87 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Zones kept around for the trace (the oldest get overwritten) */
+#define MAX_TRACE_EVENTS 65536
+#define MAX_TRACE_DEPTH 16
+/* GPU zones are timed with GL_TIME_ELAPSED queries, which can't nest. A
+   frame's results are read TRACE_GPU_FRAMES frames later so that reading
+   them never waits on the GPU */
+#define MAX_GPU_TRACE_ZONES 4
+#define TRACE_GPU_FRAMES 4
+/* Where F4 writes the trace (the client's working directory) */
+#define TRACE_FILE "glo-trace.json"
+/* Frames the frame time histogram covers (10 seconds at 60 fps) */
+#define FRAME_TIME_HISTORY 600
+
+/* Upper bounds (milliseconds) of the histogram buckets, the last one
+   takes everything slower */
+#define FRAME_TIME_BUCKETS(BUCKET)              \
+  BUCKET(2.0f)                                  \
+  BUCKET(4.0f)                                  \
+  BUCKET(8.0f)                                  \
+  BUCKET(12.0f)                                 \
+  BUCKET(16.7f)                                 \
+  BUCKET(20.0f)                                 \
+  BUCKET(25.0f)                                 \
+  BUCKET(33.3f)                                 \
+  BUCKET(50.0f)                                 \
+  BUCKET(100.0f)
+
+enum TraceTrack {
+  TT_CPU, TT_GPU, TT_SIMULATION
+};
+
+typedef struct TraceEvent {
+  /* Has to be a string literal (or outlive the tracer) */
+  const char *name;
+
+  /* Nanoseconds since the tracer was created. GPU zones start when they
+     were submitted, their duration is the GPU's */
+  uint64_t start;
+  uint64_t duration;
+
+  uint32_t frame;
+  uint8_t track;
+} TraceEvent;
+
+/* Records where a frame's time goes: CPU zones from the client loop and
+   GPU zones around the draw calls, for a Chrome trace (chrome://tracing,
+   ui.perfetto.dev). It also keeps a rolling histogram of frame times */
+typedef struct Tracer Tracer;
+
+/* Needs the GL context. Without timer queries (GL 3.3 or
+   ARB_timer_query) GPU zones are left out */
+Tracer *createTracer();
+void destroyTracer(Tracer *t);
+
+/* A frame is a zone of its own, everything else nests inside it */
+void beginTraceFrame(Tracer *t);
+void endTraceFrame(Tracer *t);
+
+void beginTraceZone(Tracer *t, const char *name);
+void endTraceZone(Tracer *t);
+
+/* Nanoseconds since the tracer was created. Safe from any thread */
+uint64_t getTraceTime(const Tracer *t);
+/* A zone timed by some other thread with getTraceTime, recorded (by the
+   tracer's thread) into the current frame */
+void addTraceZone(
+  Tracer *t, const char *name, uint64_t start, uint64_t duration,
+  enum TraceTrack track);
+
+/* Around GL calls, one at a time */
+void beginGpuTraceZone(Tracer *t, const char *name);
+void endGpuTraceZone(Tracer *t);
+
+/* Writes every zone still around as Chrome trace events (JSON). Returns
+   false if the file couldn't be written */
+bool writeChromeTrace(const Tracer *t, const char *path);
+
+/* Frame times of the last FRAME_TIME_HISTORY frames, on stdout */
+void printFrameHistogram(const Tracer *t);
+
+#endif
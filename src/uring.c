@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "uring.h"
+
+#ifdef GLO_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Room for what recvmsg puts in front of the payload, and the payload.
+   Anything bigger than a packet buffer gets truncated and dropped */
+#define URING_RECV_PREFIX \
+  (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in))
+#define URING_RECV_BUFFER_SIZE (URING_RECV_PREFIX + PACKET_BUFFER_SIZE)
+#define URING_BUFFER_GROUP 0
+/* user_data of the receive, sends use their slot index */
+#define URING_RECV_TAG (~0ull)
+
+typedef struct UringSendSlot {
+  struct msghdr header;
+  struct iovec vectors[2];
+  struct sockaddr_in addr;
+  uint8_t data[PACKET_BUFFER_SIZE];
+
+  /* Buffer the second vector points into, NULL if there is none */
+  const PacketBuffer *shared;
+} UringSendSlot;
+
+typedef struct UringDatagram {
+  uint16_t buffer;
+  uint32_t size;
+} UringDatagram;
+
+struct UdpRing {
+  int fd;
+  int sock;
+
+  /* Submission queue (shared with the kernel) */
+  void *sqRing;
+  size_t sqRingSize;
+  uint32_t *sqHead, *sqTail, *sqMask, *sqArray;
+  uint32_t sqEntries;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+  /* Our tail, and how much of it the kernel has been handed */
+  uint32_t sqLocalTail;
+  uint32_t sqSubmitted;
+
+  /* Completion queue (shared with the kernel) */
+  void *cqRing;
+  size_t cqRingSize;
+  uint32_t *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+
+  /* Buffers the kernel picks from for every datagram it receives */
+  struct io_uring_buf_ring *bufferRing;
+  size_t bufferRingSize;
+  uint16_t bufferTail;
+  uint8_t *recvBuffers;
+  struct msghdr recvHeader;
+  bool isReceiving;
+  int receiveError;
+
+  /* Datagrams reaped but not read yet */
+  uint32_t datagramStart;
+  uint32_t datagramCount;
+  UringDatagram datagrams[URING_RECV_BUFFERS];
+
+  uint32_t freeSlotCount;
+  uint16_t freeSlots[URING_SEND_SLOTS];
+  UringSendSlot slots[URING_SEND_SLOTS];
+};
+
+/*****************************************************************************/
+/*                                  Syscalls                                 */
+/*****************************************************************************/
+static int uringSetup(uint32_t entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(
+  int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags) {
+  return (int)syscall(
+    __NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, uint32_t opcode, void *arg, uint32_t count) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/*****************************************************************************/
+/*                                   Queues                                  */
+/*****************************************************************************/
+/* NULL if the submission queue is full */
+static struct io_uring_sqe *getSubmission(UdpRing *ring) {
+  uint32_t head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+  if (ring->sqLocalTail - head == ring->sqEntries) {
+    return NULL;
+  }
+
+  uint32_t index = ring->sqLocalTail & *ring->sqMask;
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void provideBuffer(UdpRing *ring, uint16_t buffer) {
+  uint32_t mask = URING_RECV_BUFFERS - 1;
+  struct io_uring_buf *entry = &ring->bufferRing->bufs[ring->bufferTail & mask];
+  entry->addr = (uint64_t)(uintptr_t)
+    &ring->recvBuffers[buffer * URING_RECV_BUFFER_SIZE];
+  entry->len = URING_RECV_BUFFER_SIZE;
+  entry->bid = buffer;
+
+  ring->bufferTail++;
+  __atomic_store_n(&ring->bufferRing->tail, ring->bufferTail, __ATOMIC_RELEASE);
+}
+
+/* One receive keeps producing completions until it runs out of buffers */
+static void armReceive(UdpRing *ring) {
+  struct io_uring_sqe *sqe = getSubmission(ring);
+  if (!sqe) {
+    return;
+  }
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = ring->sock;
+  sqe->addr = (uint64_t)(uintptr_t)&ring->recvHeader;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = URING_RECV_TAG;
+
+  ring->isReceiving = true;
+}
+
+static void reapCompletion(UdpRing *ring, struct io_uring_cqe *cqe) {
+  if (cqe->user_data != URING_RECV_TAG) {
+    /* A send finished, its slot can be reused */
+    ring->slots[cqe->user_data].shared = NULL;
+    ring->freeSlots[ring->freeSlotCount++] = (uint16_t)cqe->user_data;
+    return;
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    /* Out of buffers or failed - armed again on the next flush */
+    ring->isReceiving = false;
+  }
+
+  if (cqe->res < 0) {
+    if (cqe->res != -ENOBUFS) {
+      ring->receiveError = -cqe->res;
+    }
+
+    return;
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return;
+  }
+
+  uint16_t buffer = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)
+    &ring->recvBuffers[buffer * URING_RECV_BUFFER_SIZE];
+
+  if (out->flags & MSG_TRUNC || ring->datagramCount == URING_RECV_BUFFERS) {
+    provideBuffer(ring, buffer);
+    return;
+  }
+
+  UringDatagram *datagram = &ring->datagrams[
+    (ring->datagramStart + ring->datagramCount++) % URING_RECV_BUFFERS];
+  datagram->buffer = buffer;
+  datagram->size = out->payloadlen;
+}
+
+/*****************************************************************************/
+/*                                    Ring                                   */
+/*****************************************************************************/
+UdpRing *createUdpRing(int sock) {
+  UdpRing *ring = (UdpRing *)calloc(1, sizeof(UdpRing));
+  ring->sock = sock;
+
+  struct io_uring_params params = {};
+  ring->fd = uringSetup(URING_ENTRIES, &params);
+
+  if (ring->fd < 0) {
+    fprintf(stderr, "io_uring unavailable (%d) - using sendto/recvfrom\n", errno);
+    free(ring);
+    return NULL;
+  }
+
+  /* Map the queues */
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cqRingSize =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sqRingSize = ring->cqRingSize =
+      ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize : ring->cqRingSize;
+  }
+
+  ring->sqRing = mmap(
+    NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing = ring->sqRing;
+  }
+  else {
+    ring->cqRing = mmap(
+      NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(
+    NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+  if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    fprintf(stderr, "Failed to map io_uring queues - using sendto/recvfrom\n");
+    destroyUdpRing(ring);
+    return NULL;
+  }
+
+  uint8_t *sq = (uint8_t *)ring->sqRing;
+  ring->sqHead = (uint32_t *)(sq + params.sq_off.head);
+  ring->sqTail = (uint32_t *)(sq + params.sq_off.tail);
+  ring->sqMask = (uint32_t *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (uint32_t *)(sq + params.sq_off.array);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = ring->sqSubmitted = *ring->sqTail;
+
+  uint8_t *cq = (uint8_t *)ring->cqRing;
+  ring->cqHead = (uint32_t *)(cq + params.cq_off.head);
+  ring->cqTail = (uint32_t *)(cq + params.cq_off.tail);
+  ring->cqMask = (uint32_t *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  /* Register the receive buffers */
+  ring->bufferRingSize = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+  ring->bufferRing = (struct io_uring_buf_ring *)mmap(
+    NULL, ring->bufferRingSize, PROT_READ | PROT_WRITE,
+    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+  struct io_uring_buf_reg registration = {
+    .ring_addr = (uint64_t)(uintptr_t)ring->bufferRing,
+    .ring_entries = URING_RECV_BUFFERS,
+    .bgid = URING_BUFFER_GROUP
+  };
+
+  if (ring->bufferRing == MAP_FAILED ||
+      uringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+    fprintf(stderr, "io_uring has no buffer rings - using sendto/recvfrom\n");
+    destroyUdpRing(ring);
+    return NULL;
+  }
+
+  ring->recvBuffers = (uint8_t *)malloc(
+    URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+
+  for (int i = 0; i < URING_RECV_BUFFERS; ++i) {
+    provideBuffer(ring, (uint16_t)i);
+  }
+
+  for (int i = 0; i < URING_SEND_SLOTS; ++i) {
+    ring->freeSlots[ring->freeSlotCount++] = (uint16_t)(URING_SEND_SLOTS - 1 - i);
+  }
+
+  ring->recvHeader.msg_namelen = sizeof(struct sockaddr_in);
+
+  /* Kernels without multishot receive fail the first one straight away */
+  armReceive(ring);
+  flushUdpRing(ring);
+
+  if (ring->receiveError) {
+    fprintf(
+      stderr, "io_uring multishot receive failed (%d) - using sendto/recvfrom\n",
+      ring->receiveError);
+    destroyUdpRing(ring);
+    return NULL;
+  }
+
+  printf("Using io_uring for the server socket\n");
+
+  return ring;
+}
+
+void destroyUdpRing(UdpRing *ring) {
+  /* Closing the ring cancels whatever is still in flight */
+  close(ring->fd);
+
+  if (ring->bufferRing && ring->bufferRing != MAP_FAILED) {
+    munmap(ring->bufferRing, ring->bufferRingSize);
+  }
+  if (ring->sqes && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqesSize);
+  }
+  if (ring->cqRing && ring->cqRing != MAP_FAILED &&
+      ring->cqRing != ring->sqRing) {
+    munmap(ring->cqRing, ring->cqRingSize);
+  }
+  if (ring->sqRing && ring->sqRing != MAP_FAILED) {
+    munmap(ring->sqRing, ring->sqRingSize);
+  }
+
+  free(ring->recvBuffers);
+  free(ring);
+}
+
+void flushUdpRing(UdpRing *ring) {
+  if (!ring->isReceiving) {
+    armReceive(ring);
+  }
+
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+  /* Also runs the completions the kernel had pending for us */
+  int submitted = uringEnter(
+    ring->fd, ring->sqLocalTail - ring->sqSubmitted, 0,
+    IORING_ENTER_GETEVENTS);
+
+  if (submitted > 0) {
+    ring->sqSubmitted += (uint32_t)submitted;
+  }
+
+  uint32_t head = *ring->cqHead;
+  uint32_t tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; ++head) {
+    reapCompletion(ring, &ring->cqes[head & *ring->cqMask]);
+  }
+
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+int32_t receiveFromUdpRing(
+  UdpRing *ring, PacketBuffer *packet, struct sockaddr_in *addr) {
+  if (!ring->datagramCount) {
+    return 0;
+  }
+
+  UringDatagram *datagram = &ring->datagrams[ring->datagramStart];
+  ring->datagramStart = (ring->datagramStart + 1) % URING_RECV_BUFFERS;
+  ring->datagramCount--;
+
+  uint8_t *buffer = &ring->recvBuffers[datagram->buffer * URING_RECV_BUFFER_SIZE];
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+
+  resetPacketBuffer(packet);
+  memcpy(addr, buffer + sizeof(*out), sizeof(*addr));
+  memcpy(packet->data, buffer + URING_RECV_PREFIX, datagram->size);
+  packet->size = datagram->size;
+
+  provideBuffer(ring, datagram->buffer);
+
+  return (int32_t)packet->size;
+}
+
+int sendToUdpRing(
+  UdpRing *ring, const struct sockaddr_in *addr, const PacketBuffer *packet) {
+  return sendPartsToUdpRing(ring, addr, packet, NULL);
+}
+
+int sendPartsToUdpRing(
+  UdpRing *ring, const struct sockaddr_in *addr,
+  const PacketBuffer *header, const PacketBuffer *body) {
+  if (!ring->freeSlotCount) {
+    return 0;
+  }
+
+  struct io_uring_sqe *sqe = getSubmission(ring);
+  if (!sqe) {
+    return 0;
+  }
+
+  uint16_t slotIndex = ring->freeSlots[--ring->freeSlotCount];
+  UringSendSlot *slot = &ring->slots[slotIndex];
+
+  memcpy(slot->data, header->data, header->size);
+  slot->addr = *addr;
+  slot->vectors[0].iov_base = slot->data;
+  slot->vectors[0].iov_len = header->size;
+  slot->header.msg_name = &slot->addr;
+  slot->header.msg_namelen = sizeof(slot->addr);
+  slot->header.msg_iov = slot->vectors;
+  slot->header.msg_iovlen = 1;
+
+  slot->shared = body;
+  if (body) {
+    slot->vectors[1].iov_base = (void *)body->data;
+    slot->vectors[1].iov_len = body->size;
+    slot->header.msg_iovlen = 2;
+  }
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = ring->sock;
+  sqe->addr = (uint64_t)(uintptr_t)&slot->header;
+  sqe->user_data = slotIndex;
+
+  return 1;
+}
+
+bool isUdpRingSending(const UdpRing *ring, const PacketBuffer *buffer) {
+  /* Free slots have shared cleared */
+  for (int i = 0; i < URING_SEND_SLOTS; ++i) {
+    if (ring->slots[i].shared == buffer) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#else
+
+/* Built without io_uring: the server sticks to sendto/recvfrom */
+UdpRing *createUdpRing(int sock) {
+  return NULL;
+}
+
+void destroyUdpRing(UdpRing *ring) {}
+void flushUdpRing(UdpRing *ring) {}
+
+int32_t receiveFromUdpRing(
+  UdpRing *ring, PacketBuffer *packet, struct sockaddr_in *addr) {
+  return 0;
+}
+
+int sendToUdpRing(
+  UdpRing *ring, const struct sockaddr_in *addr, const PacketBuffer *packet) {
+  return 0;
+}
+
+int sendPartsToUdpRing(
+  UdpRing *ring, const struct sockaddr_in *addr,
+  const PacketBuffer *header, const PacketBuffer *body) {
+  return 0;
+}
+
+bool isUdpRingSending(const UdpRing *ring, const PacketBuffer *buffer) {
+  return false;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "packet.h"
+
+/* Sizes of the io_uring socket backend (only built with -DGLO_IO_URING) */
+#define URING_ENTRIES 256
+/* Buffers the kernel receives datagrams into (power of 2) */
+#define URING_RECV_BUFFERS 64
+/* Sends which can be in flight at the same time */
+#define URING_SEND_SLOTS 128
+
+/* io_uring backed UDP socket: a multishot receive keeps filling the
+   registered buffers without a syscall per datagram, and sends are queued
+   and submitted together. Everything goes through the kernel in one
+   io_uring_enter per flushUdpRing */
+typedef struct UdpRing UdpRing;
+
+/* NULL if io_uring isn't built in or the kernel can't do it - the caller
+   then keeps using recvfrom/sendto on the socket */
+UdpRing *createUdpRing(int sock);
+void destroyUdpRing(UdpRing *ring);
+
+/* Submits the queued sends and reaps the completions: call once per tick */
+void flushUdpRing(UdpRing *ring);
+
+/* Next datagram reaped by the last flush, returns its size (0 if none) */
+int32_t receiveFromUdpRing(
+  UdpRing *ring, PacketBuffer *packet, struct sockaddr_in *addr);
+
+/* Queues the packet (copied, so it can be released straight away). Goes
+   out with the next flush */
+int sendToUdpRing(
+  UdpRing *ring, const struct sockaddr_in *addr, const PacketBuffer *packet);
+
+/* Queues a datagram made of header followed by body. Only the header gets
+   copied: body is sent from where it is, so it mustn't change (or go back
+   to its pool) while isUdpRingSending says it's in use */
+int sendPartsToUdpRing(
+  UdpRing *ring, const struct sockaddr_in *addr,
+  const PacketBuffer *header, const PacketBuffer *body);
+bool isUdpRingSending(const UdpRing *ring, const PacketBuffer *buffer);
+
+#endif